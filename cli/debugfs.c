@@ -18,6 +18,7 @@
 #include "shared/log.h"
 #include "shared/mount.h"
 #include "shared/pfs.h"
+#include "shared/stats.h"
 #include "shared/thread.h"
 #include "shared/txn.h"
 
@@ -82,12 +83,26 @@ static void cmd_stat(struct debugfs_context *ctx, int argc, char **argv)
 	}
 }
 
+/*
+ * The stats are the sum of all of this process's threads, so they
+ * include the work of all the commands that have run.
+ */
+static void cmd_stats(struct debugfs_context *ctx, int argc, char **argv)
+{
+	int ret;
+
+	ret = stats_print();
+	if (ret < 0)
+		printf("stats error: "ENOF"\n", ENOA(-ret));
+}
+
 static struct command {
 	char *name;
 	void (*func)(struct debugfs_context *ctx, int argc, char **argv);
 } commands[] = {
 	{ "mkfs", cmd_mkfs, },
 	{ "stat", cmd_stat, },
+	{ "stats", cmd_stats, },
 };
 
 static int compar_cmd_names(const void *A, const void *B)
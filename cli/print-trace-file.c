@@ -1,5 +1,24 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+/*
+ * Print or analyze the binary trace files written by userspace tracing.
+ * By default each event is printed on a line.  The analysis modes
+ * stream through the file with bounded memory:
+ *
+ *  - latency: match stages' begin and end events and record the time
+ *    between them in histograms
+ *  - threads: each thread's events and time spent in stages per
+ *    interval
+ *  - throughput: the count of each event per interval
+ *  - chrome: convert events to Chrome's trace event JSON, stages become
+ *    duration or async events
+ *
+ * Threads store events in private buffers that are written as they fill
+ * so events in the file are only ordered within each thread.  A stage's
+ * end can be read before its begin when they're stored by different
+ * threads, so we match whichever arrives first with the other.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,47 +30,770 @@
 
 #include "shared/lk/byteorder.h"
 #include "shared/lk/err.h"
+#include "shared/lk/kernel.h"
+#include "shared/lk/limits.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/time64.h"
 
 #include "shared/format-trace.h"
+#include "shared/hist.h"
 #include "shared/log.h"
+#include "shared/options.h"
+#include "shared/parse.h"
 #include "shared/trace.h"
 
 #include "cli/cli.h"
 
 #define BUF_SIZE (8 * 1024 * 1024)
 
+/* unmatched stage events, groups of entries are searched for matches */
+#define PENDING_NR	(256 * 1024)
+#define PENDING_GROUP	8
+
+#define THREADS_NR	4096
+
+/* bound per-interval series to a few weeks of seconds */
+#define SERIES_MAX_ROWS	(1024 * 1024)
+
+enum {
+	MODE_PRINT = 0,
+	MODE_LATENCY,
+	MODE_THREADS,
+	MODE_THROUGHPUT,
+	MODE_CHROME,
+	MODE__NR,
+};
+
+static char *mode_names[] = {
+	[MODE_PRINT] = "print",
+	[MODE_LATENCY] = "latency",
+	[MODE_THREADS] = "threads",
+	[MODE_THROUGHPUT] = "throughput",
+	[MODE_CHROME] = "chrome",
+};
+
+/*
+ * A stage is measured from its begin event to the end event with the
+ * same key field.  Stages whose events are stored by one thread also
+ * have to match on the thread.  Stages without a begin event record
+ * their end event's key field as the latency.
+ */
+struct stage {
+	char *name;
+	char *begin;
+	char *end;
+	char *key;
+	bool same_thread;
+
+	/* resolved from the generated event descriptions */
+	int begin_key;
+	int end_key;
+
+	struct hist hist;
+	u64 unmatched;
+};
+
+static struct stage stages[] = {
+	{ "txn_execute", "txn_execute_begin", "txn_execute_end", "bnr", true },
+	{ "wait_dirtying", "block_wait_dirtying_begin", "block_wait_dirtying_end", "bnr", true },
+	{ "wait_writeback", "block_wait_writeback_begin", "block_wait_writeback_end", "bnr", true },
+	{ "writeback_wait_dirtying", "writeback_wait_dirtying_begin",
+	  "writeback_wait_dirtying_end", "seq", true },
+	{ "writeback_set", "writeback_set_begin", "writeback_set_end", "seq", false },
+	{ "block_io", "block_submit", "block_end_io", "bnr", false },
+	{ "aio", "aio_submit", "aio_complete", "bnr", false },
+	{ "uring", "uring_submit", "uring_complete", "bnr", false },
+	{ "msg_request", NULL, "msg_result", "latency_ns", false },
+};
+
+struct event_stage {
+	struct stage *st;
+	bool end;
+};
+
+struct pending {
+	u64 key;
+	u64 ns;
+	u32 tid;
+	u8 stage;	/* index + 1, 0 is unused */
+	u8 end;
+	u8 _pad[2];
+};
+
+/* rows of per-interval counters */
+struct series {
+	u64 first;
+	u64 nr;
+	u64 alloced;
+	unsigned int width;
+	u64 *rows;
+};
+
+struct thread_info {
+	u32 tid;
+	u16 last_cpu;
+	u64 first_ns;
+	u64 last_ns;
+	u64 nr_events;
+	u64 nr_migrations;
+	u64 stage_ns;
+	struct series series;
+};
+
+/* threads series columns */
+enum {
+	TS_EVENTS = 0,
+	TS_STAGE_NS,
+	TS__NR,
+};
+
+struct ptf_state {
+	int mode;
+	u64 interval_ns;
+	char *path;
+
+	u64 nr_events;
+	u64 nr_unknown;
+	u64 first_ns;
+	u64 dropped;
+
+	struct event_stage ev_stages[NGNFS_TRACE_EVENT_NR];
+	struct pending *pending;
+	struct thread_info *threads;
+	struct series series;
+	bool chrome_comma;
+};
+
+static int parse_ptf_opt(int c, char *str, void *arg)
+{
+	struct ptf_state *ps = arg;
+	unsigned long long ms;
+	int ret;
+	int i;
+
+	switch(c) {
+	case 'i':
+		ret = parse_ull(&ms, str, 1, U64_MAX / NSEC_PER_MSEC);
+		if (ret == 0)
+			ps->interval_ns = ms * NSEC_PER_MSEC;
+		break;
+	case 'm':
+		ret = -EINVAL;
+		for (i = 0; i < MODE__NR; i++) {
+			if (!strcmp(str, mode_names[i])) {
+				ps->mode = i;
+				ret = 0;
+				break;
+			}
+		}
+		if (ret < 0)
+			log("unknown mode '%s'", str);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+static struct option_more ptf_moreopts[] = {
+	{ .longopt = { "interval_ms", required_argument, NULL, 'i' },
+	  .arg = "ms",
+	  .desc = "interval of threads and throughput rows (default 1000)", },
+	{ .longopt = { "mode", required_argument, NULL, 'm' },
+	  .arg = "print|latency|threads|throughput|chrome",
+	  .desc = "print events or analyze them (default print)", },
+};
+
+static int find_field(const struct ngnfs_trace_event_desc *desc, char *label)
+{
+	int i;
+
+	for (i = 0; i < desc->nr_fields; i++) {
+		if (!strcmp(desc->fields[i].label, label))
+			return i;
+	}
+
+	return -1;
+}
+
+static int find_event(char *name)
+{
+	const struct ngnfs_trace_event_desc *desc;
+	int id;
+
+	for (id = 1; id < NGNFS_TRACE_EVENT_NR; id++) {
+		desc = trace_event_desc(id);
+		if (!strcmp(desc->name, name))
+			return id;
+	}
+
+	return -1;
+}
+
+/*
+ * Map the stages' event names and key labels to event ids and field
+ * indices.  This will catch stages falling out of sync with the trace
+ * event definitions.
+ */
+static int resolve_stages(struct ptf_state *ps)
+{
+	struct stage *st;
+	int begin;
+	int end;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(stages); i++) {
+		st = &stages[i];
+		hist_init(&st->hist);
+
+		begin = st->begin ? find_event(st->begin) : 0;
+		end = find_event(st->end);
+		if (begin < 0 || end < 0) {
+			log("stage %s events %s and %s not found",
+			    st->name, st->begin ?: "(none)", st->end);
+			return -EINVAL;
+		}
+
+		st->begin_key = begin ? find_field(trace_event_desc(begin), st->key) : 0;
+		st->end_key = find_field(trace_event_desc(end), st->key);
+		if (st->begin_key < 0 || st->end_key < 0) {
+			log("stage %s key field %s not found", st->name, st->key);
+			return -EINVAL;
+		}
+
+		if ((begin && trace_event_desc(begin)->fields[st->begin_key].type != TRACE_FIELD_INT) ||
+		    trace_event_desc(end)->fields[st->end_key].type != TRACE_FIELD_INT) {
+			log("stage %s key field %s isn't an integer", st->name, st->key);
+			return -EINVAL;
+		}
+
+		if (begin) {
+			ps->ev_stages[begin].st = st;
+			ps->ev_stages[begin].end = false;
+		}
+		ps->ev_stages[end].st = st;
+		ps->ev_stages[end].end = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns false if the event is too small for the field, which is how
+ * we'd see traces from a different build, or if it isn't an integer.
+ */
+static bool field_val(const struct ngnfs_trace_event_desc *desc, int nr, void *ptr,
+		      size_t len, u64 *val)
+{
+	const struct ngnfs_trace_field_desc *fd = &desc->fields[nr];
+
+	if (fd->type != TRACE_FIELD_INT || fd->off + fd->size > len)
+		return false;
+
+	if (fd->size == sizeof(u64))
+		*val = *(u64 *)(ptr + fd->off);
+	else if (fd->is_signed)
+		*val = (s64)*(s32 *)(ptr + fd->off);
+	else
+		*val = *(u32 *)(ptr + fd->off);
+
+	return true;
+}
+
+static u64 *series_row(struct series *se, u64 idx)
+{
+	u64 nr;
+	u64 add;
+	void *rows;
+
+	if (se->nr == 0)
+		se->first = idx;
+
+	if (idx < se->first) {
+		add = se->first - idx;
+		nr = se->nr + add;
+	} else {
+		add = 0;
+		nr = max(se->nr, idx - se->first + 1);
+	}
+
+	if (nr > SERIES_MAX_ROWS)
+		return NULL;
+
+	if (nr > se->alloced) {
+		rows = reallocarray(se->rows, max(nr, se->alloced * 2) * se->width, sizeof(u64));
+		if (!rows)
+			return NULL;
+		se->rows = rows;
+		se->alloced = max(nr, se->alloced * 2);
+	}
+
+	if (add > 0) {
+		memmove(se->rows + (add * se->width), se->rows, se->nr * se->width * sizeof(u64));
+		memset(se->rows, 0, add * se->width * sizeof(u64));
+		se->first = idx;
+	} else if (nr > se->nr) {
+		memset(se->rows + (se->nr * se->width), 0, (nr - se->nr) * se->width * sizeof(u64));
+	}
+	se->nr = nr;
+
+	return se->rows + ((idx - se->first) * se->width);
+}
+
+static struct thread_info *get_thread(struct ptf_state *ps, u32 tid)
+{
+	struct thread_info *ti;
+	unsigned int i;
+	unsigned int h;
+
+	for (i = 0, h = tid % THREADS_NR; i < THREADS_NR; i++, h = (h + 1) % THREADS_NR) {
+		ti = &ps->threads[h];
+		if (ti->tid == tid)
+			return ti;
+		if (ti->tid == 0) {
+			ti->tid = tid;
+			ti->first_ns = U64_MAX;
+			ti->series.width = TS__NR;
+			return ti;
+		}
+	}
+
+	return NULL;
+}
+
+static u64 pending_hash(u64 key, u32 stage, u32 tid)
+{
+	u64 h = key ^ ((u64)stage << 56) ^ ((u64)tid << 24);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void record_stage(struct ptf_state *ps, struct stage *st, u32 tid, u64 lat)
+{
+	struct thread_info *ti;
+	u64 *row;
+
+	hist_add(&st->hist, lat);
+
+	if (ps->mode == MODE_THREADS && st->same_thread && (ti = get_thread(ps, tid))) {
+		ti->stage_ns += lat;
+		row = series_row(&ti->series, ti->last_ns / ps->interval_ns);
+		if (row)
+			row[TS_STAGE_NS] += lat;
+	}
+}
+
+/*
+ * Match the event with a pending event of the other end of its stage,
+ * or add it to the pending table.  An end matches the latest begin
+ * before it and a begin matches the earliest end after it.  If the
+ * group is full we evict its oldest event.
+ */
+static void match_stage(struct ptf_state *ps, struct event_stage *es, u32 tid, u64 key, u64 ns)
+{
+	struct stage *st = es->st;
+	u8 stage = (st - stages) + 1;
+	struct pending *group;
+	struct pending *best = NULL;
+	struct pending *free = NULL;
+	struct pending *oldest = NULL;
+	struct pending *pe;
+	int i;
+
+	if (!st->same_thread)
+		tid = 0;
+
+	group = &ps->pending[pending_hash(key, stage, tid) & (PENDING_NR - 1) & ~(PENDING_GROUP - 1)];
+
+	for (i = 0, pe = group; i < PENDING_GROUP; i++, pe++) {
+		if (pe->stage == 0) {
+			if (!free)
+				free = pe;
+			continue;
+		}
+
+		if (!oldest || pe->ns < oldest->ns)
+			oldest = pe;
+
+		if (pe->stage != stage || pe->key != key || pe->tid != tid || pe->end == es->end)
+			continue;
+
+		if (es->end) {
+			if (pe->ns <= ns && (!best || pe->ns > best->ns))
+				best = pe;
+		} else {
+			if (pe->ns >= ns && (!best || pe->ns < best->ns))
+				best = pe;
+		}
+	}
+
+	if (best) {
+		record_stage(ps, st, tid, es->end ? ns - best->ns : best->ns - ns);
+		best->stage = 0;
+		return;
+	}
+
+	if (!free) {
+		stages[oldest->stage - 1].unmatched++;
+		free = oldest;
+	}
+
+	free->key = key;
+	free->ns = ns;
+	free->tid = tid;
+	free->stage = stage;
+	free->end = es->end;
+}
+
+static void chrome_string(u8 *bytes, unsigned int size)
+{
+	unsigned int i;
+
+	putchar('"');
+	for (i = 0; i < size; i++) {
+		if (bytes[i] == '"' || bytes[i] == '\\')
+			printf("\\%c", bytes[i]);
+		else if (bytes[i] < 0x20 || bytes[i] >= 0x7f)
+			printf("\\u%04x", bytes[i]);
+		else
+			putchar(bytes[i]);
+	}
+	putchar('"');
+}
+
+/*
+ * Print a field as a chrome event arg.  The bytes of variable length
+ * fields follow the event struct in field order, var is the offset of
+ * the next field's bytes.  Returns false if the event is too small for
+ * the field.
+ */
+static bool chrome_arg(const struct ngnfs_trace_event_desc *desc, int nr, void *ptr,
+		       size_t len, size_t *var)
+{
+	const struct ngnfs_trace_field_desc *fd = &desc->fields[nr];
+	struct sockaddr_in sin;
+	u8 *bytes = ptr + fd->off;
+	unsigned int size = fd->size;
+	u64 val;
+
+	if (fd->off + fd->size > len)
+		return false;
+
+	if (fd->type == TRACE_FIELD_VAR_HEX || fd->type == TRACE_FIELD_VAR_STR) {
+		size = *(u16 *)(ptr + fd->off);
+		if (*var + size > len)
+			return false;
+		bytes = ptr + *var;
+		*var += size;
+	}
+
+	printf(",\"%s\":", fd->label);
+
+	switch(fd->type) {
+	case TRACE_FIELD_INT:
+		field_val(desc, nr, ptr, len, &val);
+		if (fd->is_signed)
+			printf("%lld", (s64)val);
+		else
+			printf("%llu", val);
+		break;
+	case TRACE_FIELD_IPV4:
+		memcpy(&sin, bytes, sizeof(sin));
+		printf("\"" IPV4F "\"", IPV4A(&sin));
+		break;
+	case TRACE_FIELD_VAR_STR:
+		chrome_string(bytes, size);
+		break;
+	default:
+		putchar('"');
+		trace_print_hex(bytes, size);
+		putchar('"');
+		break;
+	}
+
+	return true;
+}
+
+static void chrome_event(struct ptf_state *ps, struct ngnfs_trace_event_header *hdr,
+			 const struct ngnfs_trace_event_desc *desc, void *ptr, size_t len)
+{
+	u16 id = le16_to_cpu(hdr->id);
+	struct event_stage *es = &ps->ev_stages[id];
+	struct stage *st = es->st;
+	u64 ns = le64_to_cpu(hdr->ns);
+	size_t var = desc->size;
+	char *name;
+	char *ph;
+	u64 key = 0;
+	int i;
+
+	if (st && st->begin) {
+		name = st->name;
+		if (st->same_thread)
+			ph = es->end ? "E" : "B";
+		else
+			ph = es->end ? "e" : "b";
+		field_val(desc, es->end ? st->end_key : st->begin_key, ptr, len, &key);
+	} else {
+		name = desc->name;
+		ph = "i";
+	}
+
+	printf("%s{\"name\":\"%s\",\"cat\":\"ngnfs\",\"ph\":\"%s\",\"ts\":%llu.%03llu,"
+	       "\"pid\":1,\"tid\":%u",
+	       ps->chrome_comma ? ",\n" : "", name, ph, ns / 1000, ns % 1000,
+	       le32_to_cpu(hdr->tid));
+	ps->chrome_comma = true;
+
+	if (ph[0] == 'i')
+		printf(",\"s\":\"t\"");
+	else if (ph[0] == 'b' || ph[0] == 'e')
+		printf(",\"id\":\"0x%llx\"", key);
+
+	printf(",\"args\":{\"event\":\"%s\",\"cpu\":%u", desc->name, le16_to_cpu(hdr->cpu));
+	for (i = 0; i < desc->nr_fields; i++) {
+		if (!chrome_arg(desc, i, ptr, len, &var))
+			break;
+	}
+	printf("}}");
+}
+
+static void analyze_event(struct ptf_state *ps, struct ngnfs_trace_event_header *hdr, void *ptr,
+			  size_t len)
+{
+	const struct ngnfs_trace_event_desc *desc;
+	u16 id = le16_to_cpu(hdr->id);
+	u64 ns = le64_to_cpu(hdr->ns);
+	u32 tid = le32_to_cpu(hdr->tid);
+	u16 cpu = le16_to_cpu(hdr->cpu);
+	struct event_stage *es;
+	struct thread_info *ti;
+	struct stage *st;
+	u64 key;
+	u64 *row;
+
+	desc = trace_event_desc(id);
+	if (!desc) {
+		ps->nr_unknown++;
+		return;
+	}
+
+	ps->nr_events++;
+	ps->first_ns = min(ps->first_ns, ns);
+
+	switch(ps->mode) {
+	case MODE_LATENCY:
+	case MODE_THREADS:
+		es = &ps->ev_stages[id];
+		st = es->st;
+
+		if (ps->mode == MODE_THREADS) {
+			ti = get_thread(ps, tid);
+			if (!ti) {
+				ps->dropped++;
+				break;
+			}
+			if (ti->nr_events++ > 0 && cpu != ti->last_cpu)
+				ti->nr_migrations++;
+			ti->last_cpu = cpu;
+			ti->first_ns = min(ti->first_ns, ns);
+			ti->last_ns = ns;
+
+			row = series_row(&ti->series, ns / ps->interval_ns);
+			if (row)
+				row[TS_EVENTS]++;
+			else
+				ps->dropped++;
+		}
+
+		if (!st || !field_val(desc, es->end ? st->end_key : st->begin_key, ptr, len, &key))
+			break;
+
+		if (st->begin)
+			match_stage(ps, es, tid, key, ns);
+		else
+			record_stage(ps, st, tid, key);
+		break;
+
+	case MODE_THROUGHPUT:
+		row = series_row(&ps->series, ns / ps->interval_ns);
+		if (row)
+			row[id]++;
+		else
+			ps->dropped++;
+		break;
+
+	case MODE_CHROME:
+		chrome_event(ps, hdr, desc, ptr, len);
+		break;
+	}
+}
+
+static void print_latency(struct ptf_state *ps)
+{
+	struct pending *pe;
+	struct stage *st;
+	int i;
+
+	for (i = 0, pe = ps->pending; i < PENDING_NR; i++, pe++) {
+		if (pe->stage)
+			stages[pe->stage - 1].unmatched++;
+	}
+
+	printf("%-24s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+	       "stage (ns)", "count", "min", "mean", "p50", "p99", "p99.9", "max", "unmatched");
+
+	for (i = 0; i < ARRAY_SIZE(stages); i++) {
+		st = &stages[i];
+		if (st->hist.nr == 0 && st->unmatched == 0)
+			continue;
+
+		printf("%-24s %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+		       st->name, st->hist.nr, st->hist.nr ? st->hist.min : 0,
+		       st->hist.nr ? st->hist.sum / st->hist.nr : 0,
+		       hist_percentile(&st->hist, 500), hist_percentile(&st->hist, 990),
+		       hist_percentile(&st->hist, 999), st->hist.max, st->unmatched);
+	}
+}
+
+/* print row times as seconds since the first event */
+static void print_row_time(struct ptf_state *ps, u64 idx)
+{
+	u64 ms = ((idx * ps->interval_ns) - min(idx * ps->interval_ns, ps->first_ns)) / 1000000;
+
+	printf("%llu.%03llu", ms / 1000, ms % 1000);
+}
+
+static int cmp_threads(const void *a, const void *b)
+{
+	const struct thread_info *a_ti = a;
+	const struct thread_info *b_ti = b;
+
+	return a_ti->tid < b_ti->tid ? -1 : a_ti->tid > b_ti->tid ? 1 : 0;
+}
+
+static void print_threads(struct ptf_state *ps)
+{
+	struct thread_info *ti;
+	u64 *row;
+	u64 r;
+	int i;
+
+	qsort(ps->threads, THREADS_NR, sizeof(ps->threads[0]), cmp_threads);
+
+	for (i = 0, ti = ps->threads; i < THREADS_NR; i++, ti++) {
+		if (ti->tid == 0)
+			continue;
+
+		printf("tid %u events %llu first +%llu.%09llu last +%llu.%09llu cpu migrations %llu "
+		       "stage_ns %llu\n",
+		       ti->tid, ti->nr_events,
+		       (ti->first_ns - ps->first_ns) / NSEC_PER_SEC,
+		       (ti->first_ns - ps->first_ns) % NSEC_PER_SEC,
+		       (ti->last_ns - ps->first_ns) / NSEC_PER_SEC,
+		       (ti->last_ns - ps->first_ns) % NSEC_PER_SEC,
+		       ti->nr_migrations, ti->stage_ns);
+
+		for (r = 0, row = ti->series.rows; r < ti->series.nr; r++, row += TS__NR) {
+			if (row[TS_EVENTS] == 0 && row[TS_STAGE_NS] == 0)
+				continue;
+			printf("  +");
+			print_row_time(ps, ti->series.first + r);
+			printf(" events %llu stage %llu%%\n", row[TS_EVENTS],
+			       (row[TS_STAGE_NS] * 100) / ps->interval_ns);
+		}
+	}
+}
+
+static void print_throughput(struct ptf_state *ps)
+{
+	struct series *se = &ps->series;
+	u64 *row;
+	u64 r;
+	int id;
+
+	for (r = 0, row = se->rows; r < se->nr; r++, row += se->width) {
+		for (id = 1; id < NGNFS_TRACE_EVENT_NR; id++) {
+			if (row[id] == 0)
+				continue;
+			print_row_time(ps, se->first + r);
+			printf(" %s %llu %llu/s\n", trace_event_desc(id)->name, row[id],
+			       (row[id] * NSEC_PER_SEC) / ps->interval_ns);
+		}
+	}
+}
+
+static void free_state(struct ptf_state *ps)
+{
+	int i;
+
+	if (ps->threads) {
+		for (i = 0; i < THREADS_NR; i++)
+			free(ps->threads[i].series.rows);
+	}
+	free(ps->threads);
+	free(ps->pending);
+	free(ps->series.rows);
+}
+
 static int print_trace_file_func(int argc, char **argv)
 {
+	struct ptf_state _ps = {
+		.mode = MODE_PRINT,
+		.interval_ns = NSEC_PER_SEC,
+		.first_ns = U64_MAX,
+		.series.width = NGNFS_TRACE_EVENT_NR,
+	}, *ps = &_ps;
 	struct ngnfs_trace_event_header *hdr;
 	void *buf = NULL;
 	int fd = -1;
 	ssize_t sret;
+	size_t pos;
 	size_t size;
 	size_t off;
+	u16 ev_size;
 	int ret;
 
-	buf = malloc(BUF_SIZE);
-	if (!buf) {
-		ret = -errno;
+	ret = getopt_long_more(argc, argv, ptf_moreopts, ARRAY_SIZE(ptf_moreopts),
+			       parse_ptf_opt, ps);
+	if (ret < 0)
 		goto out;
-	}
 
-	/*
-	 * XXX how are we doing option parsing in commands?
-	 */
-	if (argc != 2) {
-		printf("incorrect argc %d\n", argc);
+	if (optind != argc - 1) {
+		log("print-trace-file needs one trace file path argument");
 		ret = -EINVAL;
 		goto out;
 	}
+	ps->path = argv[optind];
 
-	fd = open(argv[1], O_RDONLY);
+	buf = malloc(BUF_SIZE);
+	ps->pending = calloc(PENDING_NR, sizeof(ps->pending[0]));
+	ps->threads = calloc(THREADS_NR, sizeof(ps->threads[0]));
+	if (!buf || !ps->pending || !ps->threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = resolve_stages(ps);
+	if (ret < 0)
+		goto out;
+
+	fd = open(ps->path, O_RDONLY);
 	if (fd < 0) {
 		ret = -errno;
-		printf("error opening '%s': "ENOF"\n", argv[1], ENOA(-ret));
+		printf("error opening '%s': "ENOF"\n", ps->path, ENOA(-ret));
 		goto out;
 	}
 
+	if (ps->mode == MODE_CHROME)
+		printf("{\"traceEvents\":[\n");
+
+	pos = 0;
 	size = 0;
 	for (;;) {
 		sret = read(fd, buf + size, BUF_SIZE - size);
@@ -59,6 +801,7 @@ static int print_trace_file_func(int argc, char **argv)
 			if (sret == 0)
 				break;
 			ret = -errno;
+			log("error reading '%s': "ENOF, ps->path, ENOA(-ret));
 			goto out;
 		}
 
@@ -69,23 +812,57 @@ static int print_trace_file_func(int argc, char **argv)
 		while (off + sizeof(*hdr) <= size) {
 
 			hdr = buf + off;
-			if (off + le16_to_cpu(hdr->size) > size)
+			ev_size = le16_to_cpu(hdr->size);
+			if (ev_size < sizeof(*hdr)) {
+				log("invalid event size %u at offset %zu", ev_size, pos + off);
+				ret = -EIO;
+				goto out;
+			}
+
+			if (off + ev_size > size)
 				break;
 
-			print_trace_event(le16_to_cpu(hdr->id), buf + off + sizeof(*hdr));
-			off += le16_to_cpu(hdr->size);
+			if (ps->mode == MODE_PRINT)
+				print_trace_event(hdr, buf + off + sizeof(*hdr));
+			else
+				analyze_event(ps, hdr, buf + off + sizeof(*hdr), ev_size - sizeof(*hdr));
+			off += ev_size;
 		}
 
-		if (off < size) {
-			memmove(buf, buf + off, size - off);
-			size -= off;
-		}
+		/* keep the partial event at the end for the next read */
+		memmove(buf, buf + off, size - off);
+		size -= off;
+		pos += off;
+	}
+
+	if (size > 0)
+		log("ignoring %zu bytes of partial event at offset %zu", size, pos);
+
+	switch(ps->mode) {
+	case MODE_LATENCY:
+		print_latency(ps);
+		break;
+	case MODE_THREADS:
+		print_threads(ps);
+		break;
+	case MODE_THROUGHPUT:
+		print_throughput(ps);
+		break;
+	case MODE_CHROME:
+		printf("\n]}\n");
+		break;
 	}
 
+	if (ps->nr_unknown)
+		log("ignored %llu events with unknown ids", ps->nr_unknown);
+	if (ps->dropped)
+		log("dropped %llu events beyond the analysis limits", ps->dropped);
+
 	ret = 0;
 out:
 	if (fd >= 0)
 		close(fd);
+	free_state(ps);
 	free(buf);
 
 	return ret;
@@ -94,7 +871,7 @@ out:
 static struct cli_command print_trace_file_cmd = {
 	.func = print_trace_file_func,
 	.name = "print-trace-file",
-	.desc = "print-trace-file desc",
+	.desc = "print-trace-file [-m print|latency|threads|throughput|chrome] [-i interval_ms] path",
 };
 
 CLI_REGISTER(print_trace_file_cmd);
@@ -0,0 +1,350 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Print the events in a trace ring file, see trace_setup().  Events are
+ * printed from the oldest that's still in the ring and with -f the ring
+ * is followed as new events are stored.  The ring is only read so this
+ * can be used while the process is storing events or after it has
+ * exited or crashed.
+ *
+ * We don't know where records start in the oldest part of the ring as
+ * it's being overwritten by new records.  We find the next record by
+ * searching for an aligned position whose contents match the position,
+ * as every stored record's pos does.  The same search skips records
+ * that were overwritten before we could read them and records whose
+ * threads never finished storing them.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shared/lk/barrier.h"
+#include "shared/lk/byteorder.h"
+#include "shared/lk/kernel.h"
+#include "shared/lk/limits.h"
+#include "shared/lk/math.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/rwonce.h"
+#include "shared/lk/time64.h"
+
+#include "shared/format-trace.h"
+#include "shared/log.h"
+#include "shared/options.h"
+#include "shared/trace.h"
+
+#include "cli/cli.h"
+
+#define REC_ALIGN	sizeof(u64)
+#define REC_MIN		sizeof(struct ngnfs_trace_ring_record)
+
+#define POLL_NS		(10 * NSEC_PER_MSEC)
+/* give up on a reserved record that isn't stored after this long */
+#define STALL_NS	NSEC_PER_SEC
+
+struct tail_state {
+	bool follow;
+	char *path;
+	char *out_path;
+	int out_fd;
+
+	struct ngnfs_trace_ring_header *rh;
+	size_t map_size;
+	void *data;
+	u64 size;
+};
+
+static int parse_tail_opt(int c, char *str, void *arg)
+{
+	struct tail_state *ts = arg;
+	int ret;
+
+	switch(c) {
+	case 'f':
+		ts->follow = true;
+		ret = 0;
+		break;
+	case 'o':
+		ts->out_path = str;
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+static struct option_more tail_moreopts[] = {
+	{ .longopt = { "follow", no_argument, NULL, 'f' },
+	  .desc = "keep printing events as they're stored", },
+	{ .longopt = { "output", required_argument, NULL, 'o' },
+	  .arg = "file_path",
+	  .desc = "append events to this file for print-trace-file instead of printing them", },
+};
+
+static u64 read_head(struct tail_state *ts)
+{
+	u64 head = le64_to_cpu(READ_ONCE(ts->rh->head));
+
+	smp_rmb(); /* head before records */
+	return head;
+}
+
+/*
+ * Return the record at the position if it has been stored and its size
+ * is sane, otherwise NULL.
+ */
+static struct ngnfs_trace_ring_record *stored_rec(struct tail_state *ts, u64 pos)
+{
+	struct ngnfs_trace_ring_record *rec;
+	u64 off = pos % ts->size;
+	u16 size;
+
+	if (ts->size - off < REC_MIN)
+		return NULL;
+
+	rec = ts->data + off;
+	if (le64_to_cpu(READ_ONCE(rec->pos)) != pos)
+		return NULL;
+
+	smp_rmb(); /* pos before event */
+	size = le16_to_cpu(READ_ONCE(rec->hdr.size));
+	if (size < sizeof(rec->hdr) || sizeof(rec->pos) + size > ts->size - off)
+		return NULL;
+
+	return rec;
+}
+
+/* return the position of the next stored record at or after pos, or head */
+static u64 find_rec(struct tail_state *ts, u64 pos, u64 head)
+{
+	for (pos = round_up(pos, REC_ALIGN); pos < head; pos += REC_ALIGN) {
+		if (stored_rec(ts, pos))
+			break;
+	}
+
+	return min(pos, head);
+}
+
+static void sleep_poll(void)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = POLL_NS };
+
+	fflush(stdout);
+	nanosleep(&ts, NULL);
+}
+
+static int map_ring(struct tail_state *ts)
+{
+	struct ngnfs_trace_ring_header *rh;
+	struct stat st;
+	void *map;
+	int fd;
+	int ret;
+
+	fd = open(ts->path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		log("error opening '%s': "ENOF, ts->path, ENOA(-ret));
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		log("error getting size of '%s': "ENOF, ts->path, ENOA(-ret));
+		goto out;
+	}
+
+	if (st.st_size <= NGNFS_TRACE_RING_HEADER_SIZE) {
+		log("'%s' is too small to be a trace ring", ts->path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		log("error mapping '%s': "ENOF, ts->path, ENOA(-ret));
+		goto out;
+	}
+
+	ts->rh = rh = map;
+	ts->map_size = st.st_size;
+	ts->data = map + NGNFS_TRACE_RING_HEADER_SIZE;
+	ts->size = st.st_size - NGNFS_TRACE_RING_HEADER_SIZE;
+
+	if (le64_to_cpu(READ_ONCE(rh->magic)) != NGNFS_TRACE_RING_MAGIC) {
+		log("'%s' isn't a trace ring, bad magic 0x%llx", ts->path, le64_to_cpu(rh->magic));
+		ret = -EINVAL;
+		goto out;
+	}
+
+	smp_rmb(); /* magic before header */
+	if (le64_to_cpu(rh->size) != ts->size) {
+		log("'%s' trace ring size %llu doesn't match file size %llu", ts->path,
+		    le64_to_cpu(rh->size), (unsigned long long)st.st_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/*
+ * XXX The ring is recreated when its process restarts.  We'd fault if
+ * it was truncated while we were following it, we should notice and
+ * remap it.
+ */
+static int trace_tail_func(int argc, char **argv)
+{
+	struct tail_state _ts = { .out_fd = -1, }, *ts = &_ts;
+	struct ngnfs_trace_event_header *hdr;
+	struct ngnfs_trace_ring_record *rec;
+	void *buf = NULL;
+	u64 stall_ns = 0;
+	u64 head;
+	u64 next;
+	u64 pos;
+	u16 ev_size;
+	ssize_t sret;
+	int ret;
+
+	ret = getopt_long_more(argc, argv, tail_moreopts, ARRAY_SIZE(tail_moreopts),
+			       parse_tail_opt, ts);
+	if (ret < 0)
+		goto out;
+
+	if (optind != argc - 1) {
+		log("trace-tail needs one trace ring file path argument");
+		ret = -EINVAL;
+		goto out;
+	}
+	ts->path = argv[optind];
+
+	buf = malloc(U16_MAX + 1);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	hdr = buf;
+
+	ret = map_ring(ts);
+	if (ret < 0)
+		goto out;
+
+	if (ts->out_path) {
+		ts->out_fd = open(ts->out_path, O_CREAT | O_WRONLY | O_APPEND, 0644);
+		if (ts->out_fd < 0) {
+			ret = -errno;
+			log("error opening '%s': "ENOF, ts->out_path, ENOA(-ret));
+			goto out;
+		}
+	}
+
+	/* start from the oldest record that hasn't been overwritten */
+	head = read_head(ts);
+	pos = head > ts->size ? find_rec(ts, head - ts->size, head) : 0;
+
+	for (;;) {
+		head = read_head(ts);
+
+		/* writers have lapped us, resume at the oldest record */
+		if (head - pos > ts->size) {
+			next = find_rec(ts, head - ts->size, head);
+			fflush(stdout);
+			log("skipped %llu bytes of events that were overwritten before being read",
+			    next - pos);
+			pos = next;
+			continue;
+		}
+
+		if (pos == head) {
+			if (!ts->follow)
+				break;
+			sleep_poll();
+			continue;
+		}
+
+		/* tails too small for a record are skipped */
+		if (ts->size - (pos % ts->size) < REC_MIN) {
+			pos += ts->size - (pos % ts->size);
+			continue;
+		}
+
+		/* the record is reserved, wait for it to be stored */
+		rec = stored_rec(ts, pos);
+		if (!rec) {
+			if (ts->follow && stall_ns < STALL_NS) {
+				sleep_poll();
+				stall_ns += POLL_NS;
+				continue;
+			}
+
+			next = find_rec(ts, pos + REC_ALIGN, head);
+			fflush(stdout);
+			log("skipped %llu bytes of events that weren't stored", next - pos);
+			pos = next;
+			stall_ns = 0;
+			continue;
+		}
+		stall_ns = 0;
+
+		/* size could have been overwritten since stored_rec() checked it */
+		ev_size = le16_to_cpu(READ_ONCE(rec->hdr.size));
+		if (ev_size < sizeof(rec->hdr) ||
+		    sizeof(rec->pos) + ev_size > ts->size - (pos % ts->size))
+			continue;
+		memcpy(buf, &rec->hdr, ev_size);
+
+		/* make sure the copy wasn't overwritten, logged as we loop */
+		smp_rmb();
+		if (read_head(ts) - pos > ts->size)
+			continue;
+
+		pos += sizeof(rec->pos) + ev_size;
+
+		/* pad records have no event */
+		if (le16_to_cpu(hdr->id) == 0)
+			continue;
+
+		if (ts->out_fd >= 0) {
+			sret = write(ts->out_fd, buf, ev_size);
+			if (sret != ev_size) {
+				ret = sret < 0 ? -errno : -EIO;
+				log("error writing to '%s': "ENOF, ts->out_path, ENOA(-ret));
+				goto out;
+			}
+		} else {
+			print_trace_event(hdr, buf + sizeof(*hdr));
+		}
+	}
+
+	ret = 0;
+out:
+	if (ts->rh)
+		munmap(ts->rh, ts->map_size);
+	if (ts->out_fd >= 0)
+		close(ts->out_fd);
+	free(buf);
+
+	return ret;
+}
+
+static struct cli_command trace_tail_cmd = {
+	.func = trace_tail_func,
+	.name = "trace-tail",
+	.desc = "trace-tail [-f] [-o file_path] path",
+};
+
+CLI_REGISTER(trace_tail_cmd);
@@ -10,7 +10,26 @@
  * Using a static pool of iocbs creates contention on the bitmaps that
  * describe the state of the iocbs.  Managing these atomics seems better
  * than the implicit allocator contention between allocating producers
- * and freeing consumers of dynamically allocated iocbs.
+ * and freeing consumers of dynamically allocated iocbs.  The bitmaps
+ * are arrays of words that are each in their own cacheline so that the
+ * queue depth can grow to thousands of iocbs without all the actors
+ * contending on a single word.  Each bitmap has one thread that clears
+ * bits and it keeps a hint of the word where it last found bits.
+ *
+ * The submit thread sorts the iocbs it gathers and merges runs of
+ * adjacent blocks with the same op into single vectored iocbs so that
+ * the device sees large IOs for sequential patterns.  The merged
+ * iocbs are chained off the first iocb in the run which is the only
+ * one submitted.  The getevents thread walks the chain and splits the
+ * result back into each block's completion.
+ *
+ * Both threads can busy poll before they sleep.  The submit thread
+ * spins watching the count of iocbs with submit bits.  The getevents
+ * thread spins watching the head and tail of the completion ring that
+ * the kernel maps at the address of the aio context so that it only
+ * calls getevents once there are events to reap.  The kernel unmaps
+ * the ring when the context is destroyed so destroy waits for the
+ * getevents thread to finish spinning.
  */
 
 #define _GNU_SOURCE /* O_DIRECT */
@@ -22,24 +41,52 @@
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <linux/aio_abi.h>
 
+#include "shared/lk/atomic.h"
 #include "shared/lk/cache.h"
 #include "shared/lk/bitops.h"
 #include "shared/lk/bug.h"
+#include "shared/lk/barrier.h"
 #include "shared/lk/err.h"
+#include "shared/lk/math.h"
+#include "shared/lk/processor.h"
+#include "shared/lk/sort.h"
+#include "shared/lk/timekeeping.h"
 #include "shared/lk/types.h"
 #include "shared/lk/wait.h"
 
 #include "shared/block.h"
 #include "shared/format-block.h"
 #include "shared/log.h"
+#include "shared/stats.h"
 #include "shared/thread.h"
+#include "shared/trace.h"
 
 #include "devd/btr-aio.h"
+#include "devd/devmap.h"
+#include "devd/poll.h"
 
-/* maybe excessive, but comes from iocb bmaps, -1 for sloppy initialization */
-#define AIO_QUEUE_DEPTH	(BITS_PER_LONG - 1)
+#define AIO_MAX_MERGE_BLOCKS	32
+
+/*
+ * The header of the completion ring that the kernel maps at the address
+ * of the aio context, followed by the io_events.  It isn't exported in
+ * the uapi headers.
+ */
+struct aio_ring {
+	unsigned int id;
+	unsigned int nr;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int magic;
+	unsigned int compat_features;
+	unsigned int incompat_features;
+	unsigned int header_length;
+};
+
+#define AIO_RING_MAGIC		0xa10a10a1
 
 /*
  * Most everything here is read-{only,mostly} with the exception of iocb
@@ -49,10 +96,24 @@
  * the contentious fields in one cacheline and hopefully let them get
  * their work done quickly after one miss.
  */
+struct aio_bmap_word {
+	unsigned long bits;
+} ____cacheline_aligned;
+
+/*
+ * The empty bitmap is cleared by the btr submit caller and set by the
+ * getevents thread.  The submit bitmap is set by the btr submit caller
+ * and cleared by the submit thread, which waits for the count of iocbs
+ * with submit bits to be non-zero.
+ */
 struct btr_aio_info {
 	struct ngnfs_fs_info *nfi;
+	struct devd_devmap *map;
+	unsigned int dev;
 	aio_context_t ctx;
+	struct aio_ring *ring;
 	unsigned int queue_depth;
+	unsigned int nr_words;
 	int dev_fd;
 
 	struct thread submit_thr;
@@ -61,10 +122,25 @@ struct btr_aio_info {
 	struct iocb *iocbs;
 	struct iocb **iocbps;
 	struct io_event *events;
+	struct iovec *iovecs;
+	int *merge_next;
+	u64 *bnrs;
+	u64 *submit_ns;
+	struct ngnfs_block_io_result *bres;
 
-	unsigned long empty_bmap ____cacheline_aligned;
-	unsigned long submit_bmap;
+	struct aio_bmap_word *empty_bmap;
+	struct aio_bmap_word *submit_bmap;
+	unsigned int empty_hint;
+	unsigned int submit_hint;
+
+	struct devd_poller submit_poller;
+	struct devd_poller getevents_poller;
+
+	atomic_t nr_submit ____cacheline_aligned;
 	wait_queue_head_t submit_waitq;
+	atomic_t ring_polling;
+	/* blocks submitted to the aio context and not yet completed */
+	atomic_t nr_inflight;
 };
 
 static inline int iocb_bit_nr(struct btr_aio_info *ainf, struct iocb *iocb)
@@ -75,101 +151,285 @@ static inline int iocb_bit_nr(struct btr_aio_info *ainf, struct iocb *iocb)
 	return nr;
 }
 
-static inline void set_iocb_bit(struct btr_aio_info *ainf, struct iocb *iocb, unsigned long *bmap)
+static inline void set_iocb_bit(struct btr_aio_info *ainf, struct iocb *iocb,
+				struct aio_bmap_word *bmap)
 {
-	set_bit(iocb_bit_nr(ainf, iocb), bmap);
-}
+	int nr = iocb_bit_nr(ainf, iocb);
 
-static inline void clear_iocb_bit(struct btr_aio_info *ainf, struct iocb *iocb, unsigned long *bmap)
-{
-	clear_bit(iocb_bit_nr(ainf, iocb), bmap);
+	set_bit(nr % BITS_PER_LONG, &bmap[nr / BITS_PER_LONG].bits);
 }
 
-static inline struct iocb *get_and_clear_iocb_bit(struct btr_aio_info *ainf, unsigned long *bmap)
+/*
+ * Find and clear a set bit, starting from the word where we last found
+ * one.  Only one thread clears bits in each bitmap so the hint isn't
+ * shared.
+ */
+static inline struct iocb *get_and_clear_iocb_bit(struct btr_aio_info *ainf,
+						  struct aio_bmap_word *bmap,
+						  unsigned int *hint)
 {
-	struct iocb *iocb = NULL;
+	unsigned long *word;
 	unsigned long bits;
+	unsigned int w;
+	unsigned int i;
 	int nr;
 
-	while ((bits = READ_ONCE(*bmap))) {
-		nr = __ffs(bits);
-		if (!test_and_clear_bit(nr, bmap)) {
-			caa_cpu_relax();
-			continue;
+	for (i = 0, w = *hint; i < ainf->nr_words; i++, w = (w + 1) % ainf->nr_words) {
+		word = &bmap[w].bits;
+		while ((bits = READ_ONCE(*word))) {
+			nr = __ffs(bits);
+			if (!test_and_clear_bit(nr, word)) {
+				caa_cpu_relax();
+				continue;
+			}
+			*hint = w;
+			return &ainf->iocbs[(w * BITS_PER_LONG) + nr];
 		}
-		iocb = &ainf->iocbs[nr];
 	}
 
-	return iocb;
+	return NULL;
+}
+
+/* merged iocbs are vectored with an iovec per block */
+static unsigned int iocb_nr_blocks(struct iocb *iocb)
+{
+	if (iocb->aio_lio_opcode == IOCB_CMD_PREADV || iocb->aio_lio_opcode == IOCB_CMD_PWRITEV)
+		return iocb->aio_nbytes;
+	return 1;
+}
+
+static struct iocb *merge_next_iocb(struct btr_aio_info *ainf, struct iocb *iocb)
+{
+	int nr = ainf->merge_next[iocb_bit_nr(ainf, iocb)];
+
+	return nr >= 0 ? &ainf->iocbs[nr] : NULL;
 }
 
 /*
  * Send completion results back to the block cache.  It is updating its
  * accounting of blocks in flight with each completion and will submit
- * more blocks to saturate queue depth.
+ * more blocks to saturate queue depth.  All the blocks of the events
+ * returned by each getevents call are completed as one batch.
  */
+static bool aio_events_ready(void *arg)
+{
+	struct btr_aio_info *ainf = arg;
+
+	return READ_ONCE(ainf->ring->head) != READ_ONCE(ainf->ring->tail);
+}
+
+/*
+ * Spin watching the completion ring while destroy can see that we're
+ * using it.  Returns true if we're going to sleep in getevents.
+ */
+static bool poll_events(struct thread *thr, struct btr_aio_info *ainf)
+{
+	bool sleep = true;
+
+	if (ainf->ring) {
+		atomic_set(&ainf->ring_polling, 1);
+		smp_mb(); /* store polling before loading should_return */
+		if (!thread_should_return(thr))
+			sleep = !devd_poller_spin(&ainf->getevents_poller, aio_events_ready, ainf);
+		smp_mb(); /* finish loading the ring before clearing polling */
+		atomic_set(&ainf->ring_polling, 0);
+	}
+
+	return sleep;
+}
+
 static void getevents_thread(struct thread *thr, void *arg)
 {
 	struct btr_aio_info *ainf = arg;
+	struct ngnfs_block_io_result *bres;
 	struct io_event *event;
-	struct page *data_page;
 	struct iocb *iocb;
-	u64 bnr;
+	struct iocb *next;
+	u64 now;
+	s64 res;
+	int nr_bres;
+	bool sleep;
 	int ret;
-	int err;
 	int nr;
 	int i;
 
+	devd_poller_pin(&ainf->getevents_poller);
+
 	while (!thread_should_return(thr)) {
 
+		sleep = poll_events(thr, ainf);
+
 		ret = syscall(__NR_io_getevents, ainf->ctx, 1, ainf->queue_depth,
 			      ainf->events, NULL);
 		assert(ret > 0);
+		if (sleep)
+			devd_poller_woke(&ainf->getevents_poller);
 		nr = ret;
+		nr_bres = 0;
+		now = ktime_get_ns();
 
 		for (i = 0; i < nr; i++) {
 			event = &ainf->events[i];
-			data_page = (struct page *)event->data;
+			res = event->res;
+
 			iocb = (struct iocb *)event->obj;
-			bnr = iocb->aio_offset >> NGNFS_BLOCK_SHIFT;
+			trace_ngnfs_aio_complete(ainf->dev, ainf->bnrs[iocb_bit_nr(ainf, iocb)],
+						 iocb_nr_blocks(iocb), res);
+			stats_hist_add(STAT_HIST_AIO_IO_NS, now - ainf->submit_ns[iocb_bit_nr(ainf, iocb)]);
+
+			/* blocks past the end of a short merged io see -EIO */
+			for (iocb = (struct iocb *)event->obj; iocb; iocb = next) {
+				next = merge_next_iocb(ainf, iocb);
+				bres = &ainf->bres[nr_bres++];
+				bres->data_page = (struct page *)(unsigned long)iocb->aio_data;
+				bres->bnr = ainf->bnrs[iocb_bit_nr(ainf, iocb)];
+
+				if (res < 0) {
+					bres->err = res;
+				} else if (res >= NGNFS_BLOCK_SIZE) {
+					bres->err = 0;
+					res -= NGNFS_BLOCK_SIZE;
+				} else {
+					bres->err = -EIO;
+				}
+
+				/* free the iocb before end_io lets the block cache submit more */
+				cmm_mb(); /* load iocb fields before storing empty bit */
+				set_iocb_bit(ainf, iocb, ainf->empty_bmap);
+			}
+		}
 
-			if (event->res == NGNFS_BLOCK_SIZE)
-				err = 0;
-			else if (event->res < 0)
-				err = event->res;
-			else
-				err = -EIO;
+		atomic_sub(nr_bres, &ainf->nr_inflight);
+		devd_devmap_end_io_batch(ainf->nfi, ainf->map, ainf->dev, ainf->bres, nr_bres);
 
-			ngnfs_block_end_io(ainf->nfi, bnr, data_page, err);
-			put_page(data_page);
+		for (i = 0; i < nr_bres; i++)
+			put_page(ainf->bres[i].data_page);
+	}
+}
 
-			cmm_mb(); /* load iocb fields before storing empty bit */
-			set_iocb_bit(ainf, iocb, &ainf->empty_bmap);
+static int cmp_iocbps(const void *a, const void *b, const void *priv)
+{
+	const struct iocb *a_iocb = *(const struct iocb **)a;
+	const struct iocb *b_iocb = *(const struct iocb **)b;
+
+	return a_iocb->aio_lio_opcode < b_iocb->aio_lio_opcode ? -1 :
+	       a_iocb->aio_lio_opcode > b_iocb->aio_lio_opcode ?  1 :
+	       a_iocb->aio_offset < b_iocb->aio_offset ? -1 :
+	       a_iocb->aio_offset > b_iocb->aio_offset ?  1 : 0;
+}
+
+/*
+ * Sort the gathered iocbs by op and offset and merge runs of adjacent
+ * blocks.  The first iocb of a run is converted into a vectored iocb
+ * whose iovecs point to each block's page, and the rest of the run is
+ * chained off it.  The run leaders are left at the front of iocbps and
+ * we return their count.
+ */
+static int merge_iocbs(struct btr_aio_info *ainf, int nr)
+{
+	struct iocb *lead = NULL;
+	struct iocb *prev = NULL;
+	struct iocb *iocb;
+	struct iovec *iov = NULL;
+	u16 lead_op = 0;
+	int run = 0;
+	int out = 0;
+	int i;
+
+	sort_r(ainf->iocbps, nr, sizeof(ainf->iocbps[0]), cmp_iocbps, NULL, NULL);
+
+	for (i = 0; i < nr; i++) {
+		iocb = ainf->iocbps[i];
+		ainf->merge_next[iocb_bit_nr(ainf, iocb)] = -1;
+
+		if (lead && iocb->aio_lio_opcode == lead_op && run < AIO_MAX_MERGE_BLOCKS &&
+		    iocb->aio_offset == prev->aio_offset + NGNFS_BLOCK_SIZE) {
+			if (run == 1) {
+				iov = &ainf->iovecs[iocb_bit_nr(ainf, lead) * AIO_MAX_MERGE_BLOCKS];
+				iov[0].iov_base = (void *)(unsigned long)lead->aio_buf;
+				iov[0].iov_len = NGNFS_BLOCK_SIZE;
+				lead->aio_lio_opcode = lead_op == IOCB_CMD_PWRITE ? IOCB_CMD_PWRITEV :
+										   IOCB_CMD_PREADV;
+				lead->aio_buf = (unsigned long)iov;
+				lead->aio_nbytes = 1;
+			}
+
+			iov[run].iov_base = (void *)(unsigned long)iocb->aio_buf;
+			iov[run].iov_len = NGNFS_BLOCK_SIZE;
+			lead->aio_nbytes++;
+			ainf->merge_next[iocb_bit_nr(ainf, prev)] = iocb_bit_nr(ainf, iocb);
+			run++;
+		} else {
+			lead = iocb;
+			lead_op = iocb->aio_lio_opcode;
+			run = 1;
+			ainf->iocbps[out++] = iocb;
 		}
+
+		prev = iocb;
 	}
+
+	return out;
 }
 
 /*
  * _submit_block has filled iocbs and marked their submit bits.  We
- * gather those iocbs and submit them to the aio context.
+ * gather those iocbs, merge adjacent blocks, and submit them to the aio
+ * context.
  */
+static void trace_submit(struct btr_aio_info *ainf, int nr)
+{
+	struct iocb *iocb;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		iocb = ainf->iocbps[i];
+		trace_ngnfs_aio_submit(ainf->dev, ainf->bnrs[iocb_bit_nr(ainf, iocb)],
+				       iocb_nr_blocks(iocb),
+				       iocb->aio_lio_opcode == IOCB_CMD_PWRITE ||
+				       iocb->aio_lio_opcode == IOCB_CMD_PWRITEV);
+	}
+}
+
+static bool submit_ready(void *arg)
+{
+	struct btr_aio_info *ainf = arg;
+
+	return atomic_read(&ainf->nr_submit) != 0 || thread_should_return(&ainf->submit_thr);
+}
+
 static void submit_thread(struct thread *thr, void *arg)
 {
 	struct btr_aio_info *ainf = arg;
 	struct iocb *iocb;
+	u64 now;
 	int ret;
 	int nr;
+	int i;
+
+	devd_poller_pin(&ainf->submit_poller);
 
 	while (!thread_should_return(thr)) {
 
-		wait_event(&ainf->submit_waitq, uatomic_read(&ainf->submit_bmap) != 0 ||
-						thread_should_return(thr));
+		if (!devd_poller_spin(&ainf->submit_poller, submit_ready, ainf)) {
+			wait_event(&ainf->submit_waitq, submit_ready(ainf));
+			devd_poller_woke(&ainf->submit_poller);
+		}
 
 		nr = 0;
-		while ((iocb = get_and_clear_iocb_bit(ainf, &ainf->submit_bmap)))
+		while ((iocb = get_and_clear_iocb_bit(ainf, ainf->submit_bmap, &ainf->submit_hint)))
 			ainf->iocbps[nr++] = iocb;
 
 		if (nr > 0) {
+			atomic_sub(nr, &ainf->nr_submit);
+			stats_add(STAT_AIO_BLOCKS, nr);
+			stats_hist_add(STAT_HIST_AIO_INFLIGHT, atomic_add_return(nr, &ainf->nr_inflight));
+			nr = merge_iocbs(ainf, nr);
+			stats_add(STAT_AIO_SUBMITTED, nr);
+			now = ktime_get_ns();
+			for (i = 0; i < nr; i++)
+				ainf->submit_ns[iocb_bit_nr(ainf, ainf->iocbps[i])] = now;
+			trace_submit(ainf, nr);
 			ret = syscall(__NR_io_submit, ainf->ctx, nr, ainf->iocbps);
 			assert(ret == nr);
 		}
@@ -186,9 +446,16 @@ static int btr_aio_submit_block(struct ngnfs_fs_info *nfi, void *btr_info,
 {
 	struct btr_aio_info *ainf = btr_info;
 	struct iocb *iocb;
+	unsigned int dev;
+	u64 dev_bnr;
+	int ret;
+
+	ret = devd_devmap_lookup(ainf->map, bnr, &dev, &dev_bnr);
+	BUG_ON(ret < 0 || dev != ainf->dev);
 
-	iocb = get_and_clear_iocb_bit(ainf, &ainf->empty_bmap);
+	iocb = get_and_clear_iocb_bit(ainf, ainf->empty_bmap, &ainf->empty_hint);
 	BUG_ON(!iocb);
+	ainf->bnrs[iocb_bit_nr(ainf, iocb)] = bnr;
 
 	memset(iocb, 0, sizeof(struct iocb));
 	iocb->aio_data = (unsigned long)data_page;
@@ -196,18 +463,26 @@ static int btr_aio_submit_block(struct ngnfs_fs_info *nfi, void *btr_info,
 	iocb->aio_fildes = ainf->dev_fd;
 	iocb->aio_buf = (long)page_address(data_page);
 	iocb->aio_nbytes = NGNFS_BLOCK_SIZE;
-	iocb->aio_offset = bnr << NGNFS_BLOCK_SHIFT;
+	iocb->aio_offset = dev_bnr << NGNFS_BLOCK_SHIFT;
 	iocb->aio_flags = 0;
 
 	get_page(data_page);
 
 	cmm_wmb(); /* store iocb fields before submit bit */
-	set_iocb_bit(ainf, iocb, &ainf->submit_bmap);
+	set_iocb_bit(ainf, iocb, ainf->submit_bmap);
+	atomic_inc(&ainf->nr_submit);
 	wake_up(&ainf->submit_waitq);
 
 	return 0;
 }
 
+static int btr_aio_submit_discard(struct ngnfs_fs_info *nfi, void *btr_info, u64 dev_bnr, u64 nr)
+{
+	struct btr_aio_info *ainf = btr_info;
+
+	return devd_devmap_discard(nfi, ainf->map, ainf->dev, ainf->dev_fd, dev_bnr, nr);
+}
+
 static int btr_aio_queue_depth(struct ngnfs_fs_info *nfi, void *btr_info)
 {
 	struct btr_aio_info *ainf = btr_info;
@@ -217,12 +492,14 @@ static int btr_aio_queue_depth(struct ngnfs_fs_info *nfi, void *btr_info)
 
 static void *btr_aio_setup(struct ngnfs_fs_info *nfi, void *arg)
 {
-	unsigned int depth = AIO_QUEUE_DEPTH;
+	struct devd_btr_args *args = arg;
+	unsigned int depth = args->queue_depth;
 	struct btr_aio_info *ainf = NULL;
-	char *dev_path = arg;
+	char *dev_path = args->map->devs[args->dev].path;
 	int oflags;
 	int ret;
 	int fd;
+	int i;
 
 	ainf = calloc(1, sizeof(struct btr_aio_info));
 	if (!ainf) {
@@ -231,12 +508,18 @@ static void *btr_aio_setup(struct ngnfs_fs_info *nfi, void *arg)
 	}
 
 	ainf->nfi = nfi;
+	ainf->map = args->map;
+	ainf->dev = args->dev;
 	ainf->queue_depth = depth;
+	ainf->nr_words = DIV_ROUND_UP(depth, BITS_PER_LONG);
 	ainf->dev_fd = -1;
 	thread_init(&ainf->submit_thr);
 	thread_init(&ainf->getevents_thr);
-	ainf->empty_bmap = (1UL << AIO_QUEUE_DEPTH) - 1;
+	atomic_set(&ainf->nr_submit, 0);
 	init_waitqueue_head(&ainf->submit_waitq);
+	atomic_set(&ainf->ring_polling, 0);
+	devd_poller_init(&ainf->submit_poller, args->poll, "aio submit", args->dev);
+	devd_poller_init(&ainf->getevents_poller, args->poll, "aio getevents", args->dev);
 
 	oflags = O_RDWR | O_DIRECT;
 	fd = open(dev_path, oflags, O_RDWR);
@@ -257,12 +540,24 @@ static void *btr_aio_setup(struct ngnfs_fs_info *nfi, void *arg)
 	ainf->iocbs = calloc(depth, sizeof(struct iocb));
 	ainf->iocbps = calloc(depth, sizeof(struct iocb *));
 	ainf->events = calloc(depth, sizeof(struct io_event));
-	if (!ainf->iocbs || !ainf->iocbps || !ainf->events) {
+	ainf->empty_bmap = calloc(ainf->nr_words, sizeof(struct aio_bmap_word));
+	ainf->submit_bmap = calloc(ainf->nr_words, sizeof(struct aio_bmap_word));
+	ainf->iovecs = calloc(depth * AIO_MAX_MERGE_BLOCKS, sizeof(struct iovec));
+	ainf->merge_next = calloc(depth, sizeof(int));
+	ainf->bnrs = calloc(depth, sizeof(u64));
+	ainf->submit_ns = calloc(depth, sizeof(u64));
+	ainf->bres = calloc(depth, sizeof(struct ngnfs_block_io_result));
+	if (!ainf->iocbs || !ainf->iocbps || !ainf->events || !ainf->empty_bmap ||
+	    !ainf->submit_bmap || !ainf->iovecs || !ainf->merge_next || !ainf->bnrs ||
+	    !ainf->submit_ns || !ainf->bres) {
 		ret = -ENOMEM;
 		log("error allocating aio ring structures: " ENOF, ENOA(-ret));
 		goto out;
 	}
 
+	for (i = 0; i < depth; i++)
+		set_iocb_bit(ainf, &ainf->iocbs[i], ainf->empty_bmap);
+
 	ret = syscall(__NR_io_setup, depth, &ainf->ctx);
 	if (ret < 0) {
 		ret = -errno;
@@ -271,6 +566,14 @@ static void *btr_aio_setup(struct ngnfs_fs_info *nfi, void *arg)
 		goto out;
 	}
 
+	if (ainf->getevents_poller.max_ns) {
+		ainf->ring = (struct aio_ring *)(unsigned long)ainf->ctx;
+		if (ainf->ring->magic != AIO_RING_MAGIC) {
+			log("unrecognized aio completion ring, not polling for events");
+			ainf->ring = NULL;
+		}
+	}
+
 	ret = thread_start(&ainf->submit_thr, submit_thread, ainf) ?:
 	      thread_start(&ainf->getevents_thr, getevents_thread, ainf);
 
@@ -296,6 +599,11 @@ static void btr_aio_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
 
 	wake_up(&ainf->submit_waitq);
 
+	/* the ring is unmapped when the context is destroyed */
+	smp_mb(); /* store should_return before loading polling */
+	while (atomic_read(&ainf->ring_polling))
+		cpu_relax();
+
 	/* destroying the context causes aio syscalls to return -EINVAL */
 	if (ainf->ctx != 0) {
 		syscall(SYS_io_destroy, ainf->ctx);
@@ -305,12 +613,22 @@ static void btr_aio_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
 	thread_stop_wait(&ainf->submit_thr);
 	thread_stop_wait(&ainf->getevents_thr);
 
+	devd_poller_report(&ainf->submit_poller);
+	devd_poller_report(&ainf->getevents_poller);
+
 	if (ainf->dev_fd >= 0)
 		close(ainf->dev_fd);
 
 	free(ainf->iocbs);
 	free(ainf->iocbps);
 	free(ainf->events);
+	free(ainf->empty_bmap);
+	free(ainf->submit_bmap);
+	free(ainf->iovecs);
+	free(ainf->merge_next);
+	free(ainf->bnrs);
+	free(ainf->submit_ns);
+	free(ainf->bres);
 	free(ainf);
 }
 
@@ -319,4 +637,5 @@ struct ngnfs_block_transport_ops ngnfs_btr_aio_ops = {
 	.destroy = btr_aio_destroy,
 	.queue_depth = btr_aio_queue_depth,
 	.submit_block = btr_aio_submit_block,
+	.submit_discard = btr_aio_submit_discard,
 };
@@ -0,0 +1,689 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * devd's io_uring block transport is an alternative to the aio
+ * transport that avoids handing each IO between threads.  The block
+ * submit work fills sqes directly as it calls _submit_block and then
+ * submits the whole batch with one io_uring_enter when it calls
+ * _submit_flush.  A single completion thread reaps cqes and sends the
+ * results back to the block cache.
+ *
+ * The submit work is the only caller of _submit_block and _submit_flush
+ * so it owns the sq tail without locking.  The completion thread owns
+ * the cq head.  The only shared state is the free io list and the
+ * count of ios in flight that the completion thread waits on.
+ *
+ * The device is registered with the ring so that sqes use the fixed
+ * file and don't have to acquire the file for each IO.  The ring can
+ * optionally use a kernel thread to poll the sq (SQPOLL) so that
+ * submission doesn't need a syscall, and can busy poll the device for
+ * completions (IOPOLL), which requires O_DIRECT.
+ *
+ * Without IOPOLL the completion thread can busy poll the cq tail for a
+ * while before it enters the kernel to wait for completions.
+ *
+ * If submitting or waiting for completions fails then we stop using
+ * the ring.  The completion thread fails all the ios in flight and any
+ * that are submitted after the failure.  Submission that the kernel
+ * refuses until completions are reaped is retried rather than failed.
+ *
+ * XXX Block pages are allocated individually rather than from an arena
+ * so there's no region to register as fixed buffers.
+ *
+ * We use the raw syscalls and the ring layout from the uapi header
+ * rather than depending on liburing.
+ */
+
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "shared/lk/atomic.h"
+#include "shared/lk/barrier.h"
+#include "shared/lk/bug.h"
+#include "shared/lk/cache.h"
+#include "shared/lk/container_of.h"
+#include "shared/lk/err.h"
+#include "shared/lk/llist.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/rwonce.h"
+#include "shared/lk/string.h"
+#include "shared/lk/time64.h"
+#include "shared/lk/types.h"
+#include "shared/lk/wait.h"
+
+#include "shared/block.h"
+#include "shared/format-block.h"
+#include "shared/log.h"
+#include "shared/thread.h"
+#include "shared/trace.h"
+
+#include "devd/btr-uring.h"
+#include "devd/devmap.h"
+#include "devd/poll.h"
+
+
+/* the kernel sq poll thread sleeps after this much idle time */
+#define URING_SQPOLL_IDLE_MS	1000
+/* retry refused submission at least this often if nothing is reaped */
+#define URING_REAP_WAIT_NS	NSEC_PER_MSEC
+
+struct uring_io {
+	struct llist_node llnode;
+	struct page *data_page;
+	u64 bnr;
+	bool inflight;
+};
+
+struct btr_uring_info {
+	struct ngnfs_fs_info *nfi;
+	struct devd_devmap *map;
+	unsigned int dev;
+	unsigned int queue_depth;
+	unsigned int flags;
+	int dev_fd;
+	int ring_fd;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_flags;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct uring_io *ios;
+	struct ngnfs_block_io_result *bres;
+
+	/* only used by the submit work */
+	unsigned int sq_fill_tail;
+
+	struct thread complete_thr;
+	struct devd_poller poller;
+
+	struct llist_head free_llist ____cacheline_aligned;
+	atomic_t nr_inflight;
+	wait_queue_head_t complete_waitq;
+	wait_queue_head_t reap_waitq;
+	int err;
+};
+
+static int uring_enter(struct btr_uring_info *uinf, unsigned int to_submit,
+		       unsigned int min_complete, unsigned int flags)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, uinf->ring_fd, to_submit, min_complete, flags, NULL, 0);
+	if (ret < 0)
+		ret = -errno;
+
+	return ret;
+}
+
+static bool cq_ready(void *arg)
+{
+	struct btr_uring_info *uinf = arg;
+
+	return READ_ONCE(*uinf->cq_tail) != *uinf->cq_head;
+}
+
+/*
+ * Once the ring has failed the kernel won't complete the ios that it
+ * was given so we fail all the ios that have been submitted.  Ios are
+ * marked in flight before they're counted so we can find them before
+ * the submit work counts them, which only briefly drives the count
+ * negative.
+ */
+static void fail_ios(struct btr_uring_info *uinf)
+{
+	struct ngnfs_block_io_result *bres;
+	struct uring_io *io;
+	int nr = 0;
+	int i;
+
+	for (i = 0; i < uinf->queue_depth; i++) {
+		io = &uinf->ios[i];
+		if (!READ_ONCE(io->inflight))
+			continue;
+
+		smp_rmb(); /* load in flight before io fields */
+		bres = &uinf->bres[nr++];
+		bres->bnr = io->bnr;
+		bres->data_page = io->data_page;
+		bres->err = uinf->err;
+		trace_ngnfs_uring_complete(uinf->dev, io->bnr, uinf->err);
+
+		WRITE_ONCE(io->inflight, false);
+		init_llist_node(&io->llnode);
+		llist_add(&io->llnode, &uinf->free_llist);
+	}
+
+	if (nr == 0)
+		return;
+
+	atomic_sub(nr, &uinf->nr_inflight);
+
+	devd_devmap_end_io_batch(uinf->nfi, uinf->map, uinf->dev, uinf->bres, nr);
+
+	for (i = 0; i < nr; i++)
+		put_page(uinf->bres[i].data_page);
+}
+
+/*
+ * Completions have to be able to make room in the queue depth for the
+ * block cache's next submission so ios are returned to the free list
+ * before their completion is sent to the block cache.  All the cqes
+ * that we find are completed as one batch.
+ *
+ * We keep completing ios after we're told to stop until all the ios in
+ * flight have completed and dropped their page references.
+ */
+static void complete_thread(struct thread *thr, void *arg)
+{
+	struct btr_uring_info *uinf = arg;
+	struct ngnfs_block_io_result *bres;
+	struct io_uring_cqe *cqe;
+	struct uring_io *io;
+	unsigned int head;
+	unsigned int tail;
+	int ret;
+	int nr;
+	int i;
+
+	devd_poller_pin(&uinf->poller);
+
+	while (!thread_should_return(thr) || atomic_read(&uinf->nr_inflight) > 0) {
+
+		wait_event(&uinf->complete_waitq, atomic_read(&uinf->nr_inflight) > 0 ||
+						  thread_should_return(thr));
+		smp_rmb(); /* load count before err */
+
+		if (READ_ONCE(uinf->err)) {
+			fail_ios(uinf);
+			wake_up(&uinf->reap_waitq);
+			continue;
+		}
+
+		/* told to return with nothing left to wait for */
+		if (atomic_read(&uinf->nr_inflight) <= 0)
+			continue;
+
+		head = *uinf->cq_head;
+		tail = READ_ONCE(*uinf->cq_tail);
+		smp_rmb(); /* load cq tail before cqes */
+
+		if (head == tail) {
+			if (devd_poller_spin(&uinf->poller, cq_ready, uinf))
+				continue;
+			/* (IOPOLL polls for completions in this enter) */
+			ret = uring_enter(uinf, 0, 1, IORING_ENTER_GETEVENTS);
+			if (ret < 0 && ret != -EINTR) {
+				log("io_uring_enter waiting for completions failed, failing all ios: "
+				    ENOF, ENOA(-ret));
+				WRITE_ONCE(uinf->err, ret);
+			}
+			devd_poller_woke(&uinf->poller);
+			continue;
+		}
+
+		for (nr = 0; head != tail; head++, nr++) {
+			cqe = &uinf->cqes[head & uinf->cq_mask];
+			io = (struct uring_io *)(unsigned long)cqe->user_data;
+			bres = &uinf->bres[nr];
+			bres->bnr = io->bnr;
+			bres->data_page = io->data_page;
+			trace_ngnfs_uring_complete(uinf->dev, io->bnr, cqe->res);
+
+			if (cqe->res == NGNFS_BLOCK_SIZE)
+				bres->err = 0;
+			else if (cqe->res < 0)
+				bres->err = cqe->res;
+			else
+				bres->err = -EIO;
+
+			WRITE_ONCE(io->inflight, false);
+			init_llist_node(&io->llnode);
+			llist_add(&io->llnode, &uinf->free_llist);
+		}
+
+		smp_mb(); /* finish loading cqes before releasing them */
+		WRITE_ONCE(*uinf->cq_head, head);
+		atomic_sub(nr, &uinf->nr_inflight);
+		wake_up(&uinf->reap_waitq);
+
+		devd_devmap_end_io_batch(uinf->nfi, uinf->map, uinf->dev, uinf->bres, nr);
+
+		for (i = 0; i < nr; i++)
+			put_page(uinf->bres[i].data_page);
+	}
+}
+
+/*
+ * The caller limits the number of submitted blocks by our advertised
+ * queue depth.  That also bounds the number of sqes that the kernel
+ * hasn't consumed so there's always a free sqe.  The sqe isn't visible
+ * to the kernel until _submit_flush advances the sq tail.
+ *
+ * Once the ring has failed we don't fill sqes, the io is only counted
+ * so that the completion thread fails it.
+ */
+static int btr_uring_submit_block(struct ngnfs_fs_info *nfi, void *btr_info,
+				  int op, u64 bnr, struct page *data_page)
+{
+	struct btr_uring_info *uinf = btr_info;
+	struct io_uring_sqe *sqe;
+	struct llist_node *llnode;
+	struct uring_io *io;
+	unsigned int idx;
+	unsigned int dev;
+	u64 dev_bnr;
+	int ret;
+
+	ret = devd_devmap_lookup(uinf->map, bnr, &dev, &dev_bnr);
+	BUG_ON(ret < 0 || dev != uinf->dev);
+
+	llnode = llist_del_first(&uinf->free_llist);
+	BUG_ON(!llnode);
+	io = container_of(llnode, struct uring_io, llnode);
+
+	get_page(data_page);
+	io->data_page = data_page;
+	io->bnr = bnr;
+	smp_wmb(); /* store io fields before in flight */
+	WRITE_ONCE(io->inflight, true);
+
+	if (READ_ONCE(uinf->err)) {
+		uinf->sq_fill_tail++;
+		return 0;
+	}
+
+	BUG_ON(uinf->sq_fill_tail - READ_ONCE(*uinf->sq_head) >= uinf->sq_entries);
+
+	idx = uinf->sq_fill_tail & uinf->sq_mask;
+	sqe = &uinf->sqes[idx];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op == NGNFS_BTX_OP_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0; /* index in registered files */
+	sqe->addr = (unsigned long)page_address(data_page);
+	sqe->len = NGNFS_BLOCK_SIZE;
+	sqe->off = dev_bnr << NGNFS_BLOCK_SHIFT;
+	sqe->user_data = (unsigned long)io;
+
+	uinf->sq_array[idx] = idx;
+	uinf->sq_fill_tail++;
+
+	trace_ngnfs_uring_submit(uinf->dev, bnr, op == NGNFS_BTX_OP_WRITE);
+
+	return 0;
+}
+
+/*
+ * Ios are counted once the kernel has them, or once the ring has
+ * failed and the completion thread will fail them, so that the
+ * completion thread doesn't wait in the kernel for ios that it was
+ * never given.
+ */
+static void count_inflight(struct btr_uring_info *uinf, unsigned int nr)
+{
+	atomic_add(nr, &uinf->nr_inflight);
+	wake_up(&uinf->complete_waitq);
+}
+
+/*
+ * The kernel refuses sqes while it has completions that don't fit in
+ * the cq (-EBUSY) or while it's short of memory (-EAGAIN).  Reaping
+ * is up to the completion thread so we wait for it to advance the cq
+ * head, or a moment if it has nothing to reap, before trying again.
+ */
+static bool submit_refused(int ret)
+{
+	return ret == -EBUSY || ret == -EAGAIN;
+}
+
+static void wait_for_reap(struct btr_uring_info *uinf)
+{
+	unsigned int head = READ_ONCE(*uinf->cq_head);
+
+	wait_event_timeout(&uinf->reap_waitq, READ_ONCE(*uinf->cq_head) != head ||
+					      READ_ONCE(uinf->err) != 0,
+			   URING_REAP_WAIT_NS);
+}
+
+/*
+ * Stop using the ring after submission failed.  The error is stored
+ * before the caller counts the ios that the kernel didn't take so that
+ * the completion thread sees it and fails them.
+ */
+static void fail_submit(struct btr_uring_info *uinf, int ret)
+{
+	log("io_uring_enter submitting failed, failing all ios: " ENOF, ENOA(-ret));
+	WRITE_ONCE(uinf->err, ret);
+	smp_wmb(); /* store err before counting ios */
+}
+
+/*
+ * Publish all the sqes filled by this pass of the submit work and
+ * submit them with a single syscall, or wake the kernel sq poll thread
+ * if it has gone idle.  Submission errors are handled by failing the
+ * ring, we always return success so that the block cache doesn't have
+ * to handle the ios that we've already been given.
+ */
+static int btr_uring_submit_flush(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_uring_info *uinf = btr_info;
+	unsigned int nr;
+	int ret;
+
+	nr = uinf->sq_fill_tail - *uinf->sq_tail;
+	if (nr == 0)
+		return 0;
+
+	/* the completion thread fails ios once the ring has failed */
+	if (READ_ONCE(uinf->err)) {
+		uinf->sq_fill_tail = *uinf->sq_tail;
+		count_inflight(uinf, nr);
+		return 0;
+	}
+
+	smp_wmb(); /* store sqes before sq tail */
+	WRITE_ONCE(*uinf->sq_tail, uinf->sq_fill_tail);
+
+	if (uinf->flags & NGNFS_BTR_URING_SQPOLL) {
+		/* the sq poll thread can take the sqes as soon as they're published */
+		count_inflight(uinf, nr);
+
+		smp_mb(); /* store sq tail before loading sq poll thread flags */
+		while (!READ_ONCE(uinf->err) &&
+		       (READ_ONCE(*uinf->sq_flags) & IORING_SQ_NEED_WAKEUP)) {
+			ret = uring_enter(uinf, 0, 0, IORING_ENTER_SQ_WAKEUP);
+			if (ret >= 0)
+				break;
+			if (submit_refused(ret)) {
+				wait_for_reap(uinf);
+			} else if (ret != -EINTR) {
+				fail_submit(uinf, ret);
+				break;
+			}
+		}
+		return 0;
+	}
+
+	while (nr > 0) {
+		/* stop retrying if the completion thread failed the ring */
+		if (READ_ONCE(uinf->err)) {
+			count_inflight(uinf, nr);
+			break;
+		}
+
+		ret = uring_enter(uinf, nr, 0, 0);
+		if (ret > 0) {
+			count_inflight(uinf, ret);
+			nr -= ret;
+		} else if (ret == 0 || submit_refused(ret)) {
+			wait_for_reap(uinf);
+		} else if (ret != -EINTR) {
+			/* the kernel never consumes the remaining published sqes */
+			fail_submit(uinf, ret);
+			count_inflight(uinf, nr);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int btr_uring_submit_discard(struct ngnfs_fs_info *nfi, void *btr_info, u64 dev_bnr, u64 nr)
+{
+	struct btr_uring_info *uinf = btr_info;
+
+	return devd_devmap_discard(nfi, uinf->map, uinf->dev, uinf->dev_fd, dev_bnr, nr);
+}
+
+static int btr_uring_queue_depth(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_uring_info *uinf = btr_info;
+
+	return uinf->queue_depth;
+}
+
+/*
+ * Map the rings and set up our pointers to their fields.  Kernels with
+ * SINGLE_MMAP map both the sq and cq ring with the sq ring offset.
+ */
+static int map_rings(struct btr_uring_info *uinf, struct io_uring_params *p)
+{
+	void *sq;
+	void *cq;
+	int ret;
+
+	uinf->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(__u32);
+	uinf->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	uinf->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		uinf->sq_ring_size = max(uinf->sq_ring_size, uinf->cq_ring_size);
+
+	sq = mmap(NULL, uinf->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  uinf->ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+	uinf->sq_ring = sq;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, uinf->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uinf->ring_fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			ret = -errno;
+			goto out;
+		}
+	}
+	uinf->cq_ring = cq;
+
+	uinf->sqes = mmap(NULL, uinf->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  uinf->ring_fd, IORING_OFF_SQES);
+	if (uinf->sqes == MAP_FAILED) {
+		uinf->sqes = NULL;
+		ret = -errno;
+		goto out;
+	}
+
+	uinf->sq_head = sq + p->sq_off.head;
+	uinf->sq_tail = sq + p->sq_off.tail;
+	uinf->sq_flags = sq + p->sq_off.flags;
+	uinf->sq_array = sq + p->sq_off.array;
+	uinf->sq_mask = *(unsigned int *)(sq + p->sq_off.ring_mask);
+	uinf->sq_entries = *(unsigned int *)(sq + p->sq_off.ring_entries);
+	uinf->sq_fill_tail = *uinf->sq_tail;
+
+	uinf->cq_head = cq + p->cq_off.head;
+	uinf->cq_tail = cq + p->cq_off.tail;
+	uinf->cq_mask = *(unsigned int *)(cq + p->cq_off.ring_mask);
+	uinf->cqes = cq + p->cq_off.cqes;
+
+	ret = 0;
+out:
+	return ret;
+}
+
+static void *btr_uring_setup(struct ngnfs_fs_info *nfi, void *arg)
+{
+	struct devd_btr_args *args = arg;
+	unsigned int depth = args->queue_depth;
+	struct btr_uring_info *uinf = NULL;
+	struct io_uring_params params;
+	char *dev_path = args->map->devs[args->dev].path;
+	int oflags;
+	int ret;
+	int fd;
+	int i;
+
+	uinf = calloc(1, sizeof(struct btr_uring_info));
+	if (!uinf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	uinf->nfi = nfi;
+	uinf->map = args->map;
+	uinf->dev = args->dev;
+	uinf->queue_depth = depth;
+	uinf->flags = args->uring_flags;
+	uinf->dev_fd = -1;
+	uinf->ring_fd = -1;
+	thread_init(&uinf->complete_thr);
+	init_llist_head(&uinf->free_llist);
+	atomic_set(&uinf->nr_inflight, 0);
+	init_waitqueue_head(&uinf->complete_waitq);
+	init_waitqueue_head(&uinf->reap_waitq);
+
+	oflags = O_RDWR | O_DIRECT;
+	fd = open(dev_path, oflags, O_RDWR);
+	if (fd < 0 && errno == EINVAL) {
+		oflags &= ~O_DIRECT;
+		errno = 0;
+		fd = open(dev_path, oflags, O_RDWR);
+		if (fd >= 0)
+			log("O_DIRECT not supported on '%s', using buffered", dev_path);
+	}
+	if (fd < 0) {
+		ret = -errno;
+		log("error opening device '%s' :" ENOF, dev_path, ENOA(-ret));
+		goto out;
+	}
+	uinf->dev_fd = fd;
+
+	if ((uinf->flags & NGNFS_BTR_URING_IOPOLL) && !(oflags & O_DIRECT)) {
+		log("io_uring iopoll requires O_DIRECT, using interrupt completion");
+		uinf->flags &= ~NGNFS_BTR_URING_IOPOLL;
+	}
+
+	devd_poller_init(&uinf->poller, args->poll, "uring complete", args->dev);
+	if ((uinf->flags & NGNFS_BTR_URING_IOPOLL) && uinf->poller.max_ns) {
+		/* iopoll completions are only found by entering */
+		log("io_uring iopoll already polls for completions, not spinning");
+		uinf->poller.max_ns = 0;
+	}
+
+	uinf->ios = calloc(depth, sizeof(struct uring_io));
+	uinf->bres = calloc(depth, sizeof(struct ngnfs_block_io_result));
+	if (!uinf->ios || !uinf->bres) {
+		ret = -ENOMEM;
+		log("error allocating io_uring ios: " ENOF, ENOA(-ret));
+		goto out;
+	}
+
+	for (i = 0; i < depth; i++) {
+		init_llist_node(&uinf->ios[i].llnode);
+		llist_add(&uinf->ios[i].llnode, &uinf->free_llist);
+	}
+
+	/* the cq is larger than the depth of ios that can complete */
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = depth * 2;
+	if (uinf->flags & NGNFS_BTR_URING_SQPOLL) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = URING_SQPOLL_IDLE_MS;
+	}
+	if (uinf->flags & NGNFS_BTR_URING_IOPOLL)
+		params.flags |= IORING_SETUP_IOPOLL;
+
+	ret = syscall(__NR_io_uring_setup, depth, &params);
+	if (ret < 0) {
+		ret = -errno;
+		log("io_uring_setup entries=%u flags=0x%x failed: " ENOF,
+		    depth, params.flags, ENOA(-ret));
+		goto out;
+	}
+	uinf->ring_fd = ret;
+
+	ret = map_rings(uinf, &params);
+	if (ret < 0) {
+		log("error mapping io_uring rings: " ENOF, ENOA(-ret));
+		goto out;
+	}
+
+	ret = syscall(__NR_io_uring_register, uinf->ring_fd, IORING_REGISTER_FILES,
+		      &uinf->dev_fd, 1);
+	if (ret < 0) {
+		ret = -errno;
+		log("error registering device with io_uring: " ENOF, ENOA(-ret));
+		goto out;
+	}
+
+	ret = thread_start(&uinf->complete_thr, complete_thread, uinf);
+out:
+	if (ret < 0) {
+		ngnfs_btr_uring_ops.destroy(nfi, uinf);
+		uinf = ERR_PTR(ret);
+	}
+
+	return uinf;
+}
+
+/*
+ * The block cache has stopped submitting by the time we're destroyed.
+ * The completion thread keeps completing ios until none are in flight
+ * before it returns.
+ */
+static void btr_uring_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_uring_info *uinf = btr_info;
+
+	if (IS_ERR_OR_NULL(uinf))
+		return;
+
+	thread_stop_indicate(&uinf->complete_thr);
+	wake_up(&uinf->complete_waitq);
+	thread_stop_wait(&uinf->complete_thr);
+	devd_poller_report(&uinf->poller);
+
+	if (uinf->sqes)
+		munmap(uinf->sqes, uinf->sqes_size);
+	if (uinf->cq_ring && uinf->cq_ring != uinf->sq_ring)
+		munmap(uinf->cq_ring, uinf->cq_ring_size);
+	if (uinf->sq_ring)
+		munmap(uinf->sq_ring, uinf->sq_ring_size);
+
+	if (uinf->ring_fd >= 0)
+		close(uinf->ring_fd);
+	if (uinf->dev_fd >= 0)
+		close(uinf->dev_fd);
+
+	free(uinf->ios);
+	free(uinf->bres);
+	free(uinf);
+}
+
+struct ngnfs_block_transport_ops ngnfs_btr_uring_ops = {
+	.setup = btr_uring_setup,
+	.destroy = btr_uring_destroy,
+	.queue_depth = btr_uring_queue_depth,
+	.submit_block = btr_uring_submit_block,
+	.submit_flush = btr_uring_submit_flush,
+	.submit_discard = btr_uring_submit_discard,
+};
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_DEVD_BTR_URING_H
+#define NGNFS_DEVD_BTR_URING_H
+
+#include "shared/block.h"
+
+enum {
+	NGNFS_BTR_URING_SQPOLL = (1 << 0),
+	NGNFS_BTR_URING_IOPOLL = (1 << 1),
+};
+
+extern struct ngnfs_block_transport_ops ngnfs_btr_uring_ops;
+
+#endif
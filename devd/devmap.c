@@ -0,0 +1,610 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * A devd can serve the fs blocks of multiple devices.  The devmap
+ * describes how fs block numbers map to the devices and the block
+ * numbers within them.  Devices are either concatenated in the order
+ * they were given or striped in units of a number of blocks.  Striped
+ * devices only use the largest multiple of the stripe that fits in the
+ * smallest device.
+ *
+ * The devmap transport sits between the block cache and a block
+ * transport instance for each device, each with its own IO context and
+ * completion thread.  It routes each block to its device's transport
+ * and fails blocks outside the map.  The device transports look up the
+ * device block number themselves so that they can complete IO with the
+ * fs block number the block cache knows.
+ *
+ * Each device's transport has its own queue depth and we advertise the
+ * sum of them.  The block cache doesn't know how blocks map to devices
+ * so it can submit more blocks for a device than it has room for.  We
+ * hold those back in the order they arrived and the device transports
+ * complete blocks through us so that we can kick the submit work to
+ * send them on once the device has room.
+ *
+ * Discarded extents are split into runs of contiguous device blocks.
+ * Neither aio nor io_uring have a discard op so the device transports
+ * discard synchronously.  That can take a while so we queue extents to
+ * our own discard work rather than blocking the block cache's work,
+ * which also submits and writes back blocks.
+ */
+
+#define _GNU_SOURCE /* fallocate */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#include "shared/format-block.h"
+#include "shared/lk/barrier.h"
+#include "shared/lk/bug.h"
+#include "shared/lk/err.h"
+#include "shared/lk/limits.h"
+#include "shared/lk/list.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/mutex.h"
+#include "shared/lk/slab.h"
+#include "shared/lk/stddef.h"
+#include "shared/lk/wait.h"
+#include "shared/lk/workqueue.h"
+#include "shared/log.h"
+#include "shared/nerr.h"
+
+#include "devd/devmap.h"
+
+static int get_nr_blocks(char *path, u64 *nr_blocks, bool *blkdev)
+{
+	struct stat st;
+	u64 size;
+	int ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		log("error opening device '%s': " ENOF, path, ENOA(-ret));
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		log("error getting size of device '%s': " ENOF, path, ENOA(-ret));
+		goto out;
+	}
+
+	*blkdev = S_ISBLK(st.st_mode);
+	if (*blkdev) {
+		if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+			ret = -errno;
+			log("error getting size of device '%s': " ENOF, path, ENOA(-ret));
+			goto out;
+		}
+	} else {
+		size = st.st_size;
+	}
+
+	*nr_blocks = size >> NGNFS_BLOCK_SHIFT;
+	if (*nr_blocks == 0) {
+		ret = -EINVAL;
+		log("device '%s' is smaller than a block", path);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/*
+ * Set up the map of the comma separated device paths.
+ */
+int devd_devmap_setup(struct devd_devmap **map_ret, char *paths, u64 stripe_blocks)
+{
+	struct devd_devmap *map = NULL;
+	struct devd_device *dev;
+	char *saveptr = NULL;
+	unsigned int nr;
+	char *copy = NULL;
+	char *tok;
+	u64 least;
+	int ret;
+	int i;
+
+	ret = strdup_nerr(&copy, paths);
+	if (ret < 0)
+		goto out;
+
+	for (nr = 1, tok = paths; (tok = strchr(tok, ',')); tok++)
+		nr++;
+
+	map = kzalloc(offsetof(struct devd_devmap, devs[nr]), GFP_NOFS);
+	if (!map) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	map->stripe_blocks = stripe_blocks;
+
+	for (tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		dev = &map->devs[map->nr_devs++];
+
+		ret = strdup_nerr(&dev->path, tok) ?:
+		      get_nr_blocks(dev->path, &dev->nr_blocks, &dev->blkdev);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (map->nr_devs == 0) {
+		ret = -EINVAL;
+		log("no device paths in '%s'", paths);
+		goto out;
+	}
+
+	if (stripe_blocks == 0) {
+		for (i = 0; i < map->nr_devs; i++) {
+			map->devs[i].start_bnr = map->total_blocks;
+			map->total_blocks += map->devs[i].nr_blocks;
+		}
+	} else {
+		least = U64_MAX;
+		for (i = 0; i < map->nr_devs; i++)
+			least = min(least, map->devs[i].nr_blocks);
+
+		least -= least % stripe_blocks;
+		if (least == 0) {
+			ret = -EINVAL;
+			log("devices are smaller than a stripe of %llu blocks", stripe_blocks);
+			goto out;
+		}
+
+		for (i = 0; i < map->nr_devs; i++)
+			map->devs[i].nr_blocks = least;
+		map->total_blocks = least * map->nr_devs;
+	}
+
+	ret = 0;
+out:
+	free(copy);
+	if (ret < 0) {
+		devd_devmap_destroy(map);
+		map = NULL;
+	}
+
+	*map_ret = map;
+	return ret;
+}
+
+void devd_devmap_destroy(struct devd_devmap *map)
+{
+	int i;
+
+	if (map) {
+		for (i = 0; i < map->nr_devs; i++)
+			free(map->devs[i].path);
+		kfree(map);
+	}
+}
+
+/*
+ * Returns -EINVAL if the fs block number is outside the map.
+ */
+int devd_devmap_lookup(struct devd_devmap *map, u64 bnr, unsigned int *dev, u64 *dev_bnr)
+{
+	u64 stripe;
+	int i;
+
+	if (bnr >= map->total_blocks)
+		return -EINVAL;
+
+	if (map->stripe_blocks == 0) {
+		for (i = map->nr_devs - 1; i > 0 && bnr < map->devs[i].start_bnr; i--)
+			;
+		*dev = i;
+		*dev_bnr = bnr - map->devs[i].start_bnr;
+	} else {
+		stripe = bnr / map->stripe_blocks;
+		*dev = stripe % map->nr_devs;
+		*dev_bnr = ((stripe / map->nr_devs) * map->stripe_blocks) +
+			   (bnr % map->stripe_blocks);
+	}
+
+	return 0;
+}
+
+/*
+ * The device transports have no discard op to submit so their
+ * ->submit_discard discards synchronously with this in the devmap
+ * transport's discard work.  Block devices are discarded with
+ * BLKDISCARD and files have holes punched.  We stop trying once a
+ * device says it doesn't support either.  Discard is only advisory so
+ * errors are only given to the block cache and we always return 0.
+ */
+int devd_devmap_discard(struct ngnfs_fs_info *nfi, struct devd_devmap *map, unsigned int dev,
+			int fd, u64 dev_bnr, u64 nr)
+{
+	struct devd_device *device = &map->devs[dev];
+	u64 range[2] = { dev_bnr << NGNFS_BLOCK_SHIFT, nr << NGNFS_BLOCK_SHIFT };
+	int ret;
+
+	if (device->no_discard) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (device->blkdev)
+		ret = ioctl(fd, BLKDISCARD, range);
+	else
+		ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+	if (ret < 0) {
+		ret = -errno;
+		if (ret == -EOPNOTSUPP) {
+			log("device '%s' doesn't support discard", device->path);
+			device->no_discard = true;
+		}
+	}
+out:
+	ngnfs_block_end_discard(nfi, nr, ret);
+	return 0;
+}
+
+struct devd_discard_ext {
+	struct list_head head;
+	u64 bnr;
+	u64 nr;
+};
+
+struct devd_discard_run {
+	u64 dev_bnr;
+	u64 nr;
+};
+
+struct devd_deferred_io {
+	struct list_head head;
+	u64 bnr;
+	struct page *data_page;
+	int op;
+};
+
+struct btr_devmap_info {
+	struct ngnfs_fs_info *nfi;
+	struct devd_devmap *map;
+	struct ngnfs_block_transport_ops *ops;
+	int queue_depth;
+	/* only used by the submit work */
+	struct devd_deferred_io *ios;
+	struct list_head free_ios;
+	struct list_head *deferred;
+	struct workqueue_struct *discard_wq;
+	struct work_struct discard_work;
+	struct mutex discard_mutex;
+	struct list_head discard_list;
+	/* only used by the discard work */
+	struct devd_discard_run *runs;
+	void *dev_infos[];
+};
+
+static bool dev_has_room(struct ngnfs_fs_info *nfi, struct btr_devmap_info *dinf,
+			 unsigned int dev)
+{
+	return atomic_read(&dinf->map->devs[dev].nr_inflight) <
+	       dinf->ops->queue_depth(nfi, dinf->dev_infos[dev]);
+}
+
+static int submit_dev_block(struct ngnfs_fs_info *nfi, struct btr_devmap_info *dinf,
+			    unsigned int dev, int op, u64 bnr, struct page *data_page)
+{
+	atomic_inc(&dinf->map->devs[dev].nr_inflight);
+	return dinf->ops->submit_block(nfi, dinf->dev_infos[dev], op, bnr, data_page);
+}
+
+/*
+ * Blocks are held back if their device is full or if earlier blocks
+ * for the device are already held back.  The block cache limits
+ * submitted blocks to the sum of the device queue depths so there's
+ * always a free io.
+ */
+static int btr_devmap_submit_block(struct ngnfs_fs_info *nfi, void *btr_info,
+				   int op, u64 bnr, struct page *data_page)
+{
+	struct btr_devmap_info *dinf = btr_info;
+	struct devd_deferred_io *io;
+	unsigned int dev;
+	u64 dev_bnr;
+
+	if (devd_devmap_lookup(dinf->map, bnr, &dev, &dev_bnr) < 0) {
+		ngnfs_block_end_io(nfi, bnr, data_page, -EINVAL);
+		return 0;
+	}
+
+	if (list_empty(&dinf->deferred[dev]) && dev_has_room(nfi, dinf, dev))
+		return submit_dev_block(nfi, dinf, dev, op, bnr, data_page);
+
+	BUG_ON(list_empty(&dinf->free_ios));
+	io = list_first_entry(&dinf->free_ios, struct devd_deferred_io, head);
+	io->bnr = bnr;
+	io->data_page = data_page;
+	io->op = op;
+	list_move_tail(&io->head, &dinf->deferred[dev]);
+	atomic_inc(&dinf->map->devs[dev].nr_deferred);
+
+	return 0;
+}
+
+/*
+ * Submit as many held back blocks as the device has room for.  Either
+ * we see the room made by a completion or the completion sees our held
+ * back blocks and kicks the submit work.
+ */
+static int submit_deferred(struct ngnfs_fs_info *nfi, struct btr_devmap_info *dinf,
+			   unsigned int dev)
+{
+	struct devd_deferred_io *io;
+	struct devd_deferred_io *tmp;
+	int ret;
+
+	if (list_empty(&dinf->deferred[dev]))
+		return 0;
+
+	smp_mb(); /* store deferred before loading inflight, pairs with _end_io_batch */
+
+	list_for_each_entry_safe(io, tmp, &dinf->deferred[dev], head) {
+		if (!dev_has_room(nfi, dinf, dev))
+			break;
+
+		list_move(&io->head, &dinf->free_ios);
+		atomic_dec(&dinf->map->devs[dev].nr_deferred);
+		ret = submit_dev_block(nfi, dinf, dev, io->op, io->bnr, io->data_page);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+void devd_devmap_end_io_batch(struct ngnfs_fs_info *nfi, struct devd_devmap *map, unsigned int dev,
+			      struct ngnfs_block_io_result *res, unsigned int nr)
+{
+	struct devd_device *device = &map->devs[dev];
+
+	atomic_sub(nr, &device->nr_inflight);
+	ngnfs_block_end_io_batch(nfi, res, nr);
+
+	smp_mb(); /* store inflight before loading deferred, pairs with submit_deferred */
+	if (atomic_read(&device->nr_deferred) > 0)
+		ngnfs_block_kick_submit(nfi);
+}
+
+static void discard_run(struct ngnfs_fs_info *nfi, struct btr_devmap_info *dinf,
+			unsigned int dev)
+{
+	struct devd_discard_run *run = &dinf->runs[dev];
+	int ret;
+
+	if (run->nr > 0) {
+		ret = dinf->ops->submit_discard(nfi, dinf->dev_infos[dev], run->dev_bnr, run->nr);
+		if (ret < 0)
+			ngnfs_block_end_discard(nfi, run->nr, ret);
+		run->nr = 0;
+	}
+}
+
+/*
+ * Walk the extent's blocks, building up a run of contiguous device
+ * blocks for each device.  Consecutive stripes on a device are
+ * contiguous so striped extents still produce large runs.
+ */
+static void discard_extent(struct ngnfs_fs_info *nfi, struct btr_devmap_info *dinf,
+			   u64 bnr, u64 nr)
+{
+	struct devd_discard_run *run;
+	unsigned int dev;
+	u64 dev_bnr;
+	u64 outside = 0;
+
+	for (; nr > 0; bnr++, nr--) {
+		if (devd_devmap_lookup(dinf->map, bnr, &dev, &dev_bnr) < 0) {
+			outside++;
+			continue;
+		}
+
+		run = &dinf->runs[dev];
+		if (run->nr > 0 && run->dev_bnr + run->nr != dev_bnr)
+			discard_run(nfi, dinf, dev);
+		if (run->nr == 0)
+			run->dev_bnr = dev_bnr;
+		run->nr++;
+	}
+
+	if (outside > 0)
+		ngnfs_block_end_discard(nfi, outside, -EINVAL);
+}
+
+/*
+ * The block cache hands us sorted extents so runs can continue across
+ * the extents that were queued together.
+ */
+static void btr_devmap_discard_work(struct work_struct *work)
+{
+	struct btr_devmap_info *dinf = container_of(work, struct btr_devmap_info, discard_work);
+	struct ngnfs_fs_info *nfi = dinf->nfi;
+	struct devd_discard_ext *ext;
+	struct devd_discard_ext *tmp;
+	LIST_HEAD(list);
+	int i;
+
+	mutex_lock(&dinf->discard_mutex);
+	list_splice_init(&dinf->discard_list, &list);
+	mutex_unlock(&dinf->discard_mutex);
+
+	list_for_each_entry_safe(ext, tmp, &list, head) {
+		discard_extent(nfi, dinf, ext->bnr, ext->nr);
+		list_del_init(&ext->head);
+		kfree(ext);
+	}
+
+	for (i = 0; i < dinf->map->nr_devs; i++)
+		discard_run(nfi, dinf, i);
+}
+
+static int btr_devmap_submit_discard(struct ngnfs_fs_info *nfi, void *btr_info, u64 bnr, u64 nr)
+{
+	struct btr_devmap_info *dinf = btr_info;
+	struct devd_discard_ext *ext;
+
+	if (!dinf->ops->submit_discard)
+		return -EOPNOTSUPP;
+
+	ext = kmalloc(sizeof(struct devd_discard_ext), GFP_NOFS);
+	if (!ext)
+		return -ENOMEM;
+
+	ext->bnr = bnr;
+	ext->nr = nr;
+
+	mutex_lock(&dinf->discard_mutex);
+	list_add_tail(&ext->head, &dinf->discard_list);
+	mutex_unlock(&dinf->discard_mutex);
+
+	queue_work(dinf->discard_wq, &dinf->discard_work);
+
+	return 0;
+}
+
+static int btr_devmap_submit_flush(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_devmap_info *dinf = btr_info;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < dinf->map->nr_devs && ret == 0; i++) {
+		ret = submit_deferred(nfi, dinf, i);
+		if (ret == 0 && dinf->ops->submit_flush)
+			ret = dinf->ops->submit_flush(nfi, dinf->dev_infos[i]);
+	}
+
+	return ret;
+}
+
+static int btr_devmap_queue_depth(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_devmap_info *dinf = btr_info;
+
+	return dinf->queue_depth;
+}
+
+static void *btr_devmap_setup(struct ngnfs_fs_info *nfi, void *arg)
+{
+	struct devd_devmap_args *args = arg;
+	struct devd_devmap *map = args->dev_args.map;
+	struct btr_devmap_info *dinf;
+	struct devd_btr_args dev_args;
+	void *info;
+	int ret;
+	int i;
+
+	dinf = kzalloc(offsetof(struct btr_devmap_info, dev_infos[map->nr_devs]), GFP_NOFS);
+	if (!dinf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dinf->nfi = nfi;
+	dinf->map = map;
+	dinf->ops = args->dev_ops;
+	INIT_WORK(&dinf->discard_work, btr_devmap_discard_work);
+	mutex_init(&dinf->discard_mutex);
+	INIT_LIST_HEAD(&dinf->discard_list);
+
+	dinf->runs = kzalloc(map->nr_devs * sizeof(dinf->runs[0]), GFP_NOFS);
+	if (!dinf->runs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dinf->discard_wq = create_singlethread_workqueue("ngnfs-discard");
+	if (!dinf->discard_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dinf->deferred = kmalloc(map->nr_devs * sizeof(dinf->deferred[0]), GFP_NOFS);
+	if (!dinf->deferred) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dev_args = args->dev_args;
+
+	for (i = 0; i < map->nr_devs; i++) {
+		INIT_LIST_HEAD(&dinf->deferred[i]);
+		atomic_set(&map->devs[i].nr_inflight, 0);
+		atomic_set(&map->devs[i].nr_deferred, 0);
+
+		dev_args.dev = i;
+		info = dinf->ops->setup(nfi, &dev_args);
+		if (IS_ERR(info)) {
+			ret = PTR_ERR(info);
+			goto out;
+		}
+		dinf->dev_infos[i] = info;
+		dinf->queue_depth += dinf->ops->queue_depth(nfi, info);
+	}
+
+	dinf->ios = kmalloc(dinf->queue_depth * sizeof(dinf->ios[0]), GFP_NOFS);
+	if (!dinf->ios) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	INIT_LIST_HEAD(&dinf->free_ios);
+	for (i = 0; i < dinf->queue_depth; i++)
+		list_add_tail(&dinf->ios[i].head, &dinf->free_ios);
+
+	ret = 0;
+out:
+	if (ret < 0) {
+		ngnfs_btr_devmap_ops.destroy(nfi, dinf);
+		dinf = ERR_PTR(ret);
+	}
+
+	return dinf;
+}
+
+static void btr_devmap_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_devmap_info *dinf = btr_info;
+	int i;
+
+	if (IS_ERR_OR_NULL(dinf))
+		return;
+
+	/* the block cache is done so there's no more queueing */
+	if (dinf->discard_wq)
+		destroy_workqueue(dinf->discard_wq);
+
+	for (i = 0; i < dinf->map->nr_devs; i++) {
+		if (dinf->dev_infos[i])
+			dinf->ops->destroy(nfi, dinf->dev_infos[i]);
+	}
+
+	kfree(dinf->ios);
+	kfree(dinf->deferred);
+	kfree(dinf->runs);
+	kfree(dinf);
+}
+
+struct ngnfs_block_transport_ops ngnfs_btr_devmap_ops = {
+	.setup = btr_devmap_setup,
+	.destroy = btr_devmap_destroy,
+	.queue_depth = btr_devmap_queue_depth,
+	.submit_block = btr_devmap_submit_block,
+	.submit_flush = btr_devmap_submit_flush,
+	.submit_discard = btr_devmap_submit_discard,
+};
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_DEVD_DEVMAP_H
+#define NGNFS_DEVD_DEVMAP_H
+
+#include "shared/block.h"
+#include "shared/lk/atomic.h"
+#include "shared/lk/types.h"
+
+#include "devd/poll.h"
+
+struct devd_device {
+	char *path;
+	u64 nr_blocks;
+	u64 start_bnr;
+	bool blkdev;
+	bool no_discard;
+	/* blocks the devmap transport has sent to the device or held back */
+	atomic_t nr_inflight;
+	atomic_t nr_deferred;
+};
+
+/*
+ * Maps fs block numbers to the devices that store them.  A
+ * stripe_blocks of 0 concatenates the devices.
+ */
+struct devd_devmap {
+	unsigned int nr_devs;
+	u64 stripe_blocks;
+	u64 total_blocks;
+	struct devd_device devs[];
+};
+
+/* given to the block transport of each device */
+struct devd_btr_args {
+	struct devd_devmap *map;
+	unsigned int dev;
+	unsigned int queue_depth;
+	unsigned int uring_flags;
+	struct devd_poll_args *poll;
+};
+
+/*
+ * Given to the devmap transport, dev_args is copied for each device.
+ * The device transports' ->submit_discard is given device block
+ * numbers and they complete blocks with _devmap_end_io_batch.
+ */
+struct devd_devmap_args {
+	struct ngnfs_block_transport_ops *dev_ops;
+	struct devd_btr_args dev_args;
+};
+
+int devd_devmap_setup(struct devd_devmap **map_ret, char *paths, u64 stripe_blocks);
+void devd_devmap_destroy(struct devd_devmap *map);
+int devd_devmap_lookup(struct devd_devmap *map, u64 bnr, unsigned int *dev, u64 *dev_bnr);
+int devd_devmap_discard(struct ngnfs_fs_info *nfi, struct devd_devmap *map, unsigned int dev,
+			int fd, u64 dev_bnr, u64 nr);
+void devd_devmap_end_io_batch(struct ngnfs_fs_info *nfi, struct devd_devmap *map, unsigned int dev,
+			      struct ngnfs_block_io_result *res, unsigned int nr);
+
+extern struct ngnfs_block_transport_ops ngnfs_btr_devmap_ops;
+
+#endif
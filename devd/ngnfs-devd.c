@@ -1,8 +1,8 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
 /*
- * Each devd process handles incoming network requests using a single
- * device.
+ * Each devd process handles incoming network requests using one or
+ * more devices that are concatenated or striped.
  */
 
 #include <unistd.h>
@@ -18,6 +18,7 @@
 #include "shared/block.h"
 #include "shared/lk/err.h"
 #include "shared/lk/kernel.h"
+#include "shared/lk/limits.h"
 #include "shared/log.h"
 #include "shared/msg.h"
 #include "shared/mtr-socket.h"
@@ -29,17 +30,44 @@
 
 #include "devd/recv.h"
 #include "devd/btr-aio.h"
+#include "devd/btr-uring.h"
+#include "devd/devmap.h"
+#include "devd/poll.h"
 
 struct devd_options {
-	char *dev_path;
+	char *dev_paths;
+	u64 stripe_blocks;
+	struct ngnfs_block_transport_ops *btr_ops;
+	unsigned int uring_flags;
+	unsigned int queue_depth;
 	struct sockaddr_in listen_addr;
 	char *trace_path;
+	u64 trace_ring_size;
+	unsigned int nr_workers;
+	int encoding;
+	struct devd_poll_args poll;
 };
 
+#define DEVD_DEFAULT_WORKERS	8
+#define DEVD_MAX_WORKERS	1024
+#define DEVD_DEFAULT_QUEUE_DEPTH	256
+#define DEVD_MAX_QUEUE_DEPTH	4096
+#define DEVD_MAX_POLL_US	10000
+
 static struct option_more devd_moreopts[] = {
+	{ .longopt = { "block_io", required_argument, NULL, 'b' },
+	  .arg = "aio|uring[,sqpoll][,iopoll]",
+	  .desc = "block IO interface used to access the device (default aio)",
+	  .required = 0, },
+
+	{ .longopt = { "poll_cpus", required_argument, NULL, 'c' },
+	  .arg = "cpu[,cpu...]",
+	  .desc = "pin block IO threads to these cpus in turn",
+	  .required = 0, },
+
 	{ .longopt = { "device_path", required_argument, NULL, 'd' },
-	  .arg = "path",
-	  .desc = "path to block device",
+	  .arg = "path[,path...]",
+	  .desc = "paths to block devices",
 	  .required = 1, },
 
 	{ .longopt = { "listen_addr", required_argument, NULL, 'l' },
@@ -47,27 +75,134 @@ static struct option_more devd_moreopts[] = {
 	  .desc = "listening IPv4 address and port",
 	  .required = 1, },
 
+	{ .longopt = { "poll_us", required_argument, NULL, 'p' },
+	  .arg = "us",
+	  .desc = "busy poll for up to us microseconds before block IO threads sleep (default 0)",
+	  .required = 0, },
+
+	{ .longopt = { "queue_depth", required_argument, NULL, 'q' },
+	  .arg = "nr",
+	  .desc = "number of block IOs to keep in flight to each device (default 256)",
+	  .required = 0, },
+
+	{ .longopt = { "stripe_blocks", required_argument, NULL, 's' },
+	  .arg = "nr",
+	  .desc = "stripe devices in units of nr blocks (default concatenate)",
+	  .required = 0, },
+
 	{ .longopt = { "trace_file", required_argument, NULL, 't' },
 	  .arg = "file_path",
-	  .desc = "append debugging traces to this file",
+	  .desc = "append debugging traces to this file, file_path.events lists enabled events",
 	  .required = 1, },
+
+	{ .longopt = { "trace_ring_mb", required_argument, NULL, 'r' },
+	  .arg = "nr",
+	  .desc = "store traces in a ring of nr MiB in the trace file instead of appending",
+	  .required = 0, },
+
+	{ .longopt = { "encoding", required_argument, NULL, 'e' },
+	  .arg = "none|trim|lz",
+	  .desc = "encoding of block payloads sent to clients (default none)",
+	  .required = 0, },
+
+	{ .longopt = { "workers", required_argument, NULL, 'w' },
+	  .arg = "nr",
+	  .desc = "number of threads processing received requests (default 8)",
+	  .required = 0, },
 };
 
+/*
+ * The block io interface name can be followed by comma separated
+ * io_uring options.
+ */
+static int parse_block_io(struct devd_options *opts, char *str)
+{
+	char *saveptr = NULL;
+	char *tok;
+
+	tok = strtok_r(str, ",", &saveptr);
+	if (!tok)
+		return -EINVAL;
+
+	if (strcmp(tok, "aio") == 0)
+		opts->btr_ops = &ngnfs_btr_aio_ops;
+	else if (strcmp(tok, "uring") == 0)
+		opts->btr_ops = &ngnfs_btr_uring_ops;
+	else
+		return -EINVAL;
+
+	opts->uring_flags = 0;
+	while ((tok = strtok_r(NULL, ",", &saveptr))) {
+		if (opts->btr_ops != &ngnfs_btr_uring_ops)
+			return -EINVAL;
+
+		if (strcmp(tok, "sqpoll") == 0)
+			opts->uring_flags |= NGNFS_BTR_URING_SQPOLL;
+		else if (strcmp(tok, "iopoll") == 0)
+			opts->uring_flags |= NGNFS_BTR_URING_IOPOLL;
+		else
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
 static int parse_devd_opt(int c, char *str, void *arg)
 {
 	struct devd_options *opts = arg;
+	unsigned long long ull;
 	int ret = -EINVAL;
 
 	switch(c) {
+	case 'b':
+		ret = parse_block_io(opts, str);
+		if (ret < 0)
+			log("invalid -b block io '%s'", str);
+		break;
+	case 'c':
+		ret = devd_poll_parse_cpus(&opts->poll, str);
+		if (ret < 0)
+			log("invalid -c poll cpus '%s'", str);
+		break;
 	case 'd':
-		ret = strdup_nerr(&opts->dev_path, str);
+		ret = strdup_nerr(&opts->dev_paths, str);
+		break;
+	case 'e':
+		ret = ngnfs_msg_parse_encoding(&opts->encoding, str);
+		if (ret < 0)
+			log("unknown -e encoding '%s'", str);
 		break;
 	case 'l':
 		ret = parse_ipv4_addr_port(&opts->listen_addr, str);
 		break;
+	case 'p':
+		ret = parse_ull(&ull, str, 0, DEVD_MAX_POLL_US);
+		if (ret == 0)
+			opts->poll.max_ns = ull * 1000;
+		break;
+	case 'q':
+		ret = parse_ull(&ull, str, 1, DEVD_MAX_QUEUE_DEPTH);
+		if (ret == 0)
+			opts->queue_depth = ull;
+		break;
+	case 's':
+		ret = parse_ull(&ull, str, 1, U32_MAX);
+		if (ret == 0)
+			opts->stripe_blocks = ull;
+		break;
+	case 'r':
+		ret = parse_ull(&ull, str, 1, TRACE_RING_MAX_MB);
+		if (ret == 0)
+			opts->trace_ring_size = ull << 20;
+		break;
 	case 't':
 		ret = strdup_nerr(&opts->trace_path, str);
 		break;
+	case 'w':
+		ret = parse_ull(&ull, str, 1, DEVD_MAX_WORKERS);
+		if (ret == 0)
+			opts->nr_workers = ull;
+		break;
 	}
 
 	return ret;
@@ -76,7 +211,13 @@ static int parse_devd_opt(int c, char *str, void *arg)
 int main(int argc, char **argv)
 {
 	struct ngnfs_fs_info nfi = INIT_NGNFS_FS_INFO;
-	struct devd_options opts = { };
+	struct devd_options opts = {
+		.btr_ops = &ngnfs_btr_aio_ops,
+		.queue_depth = DEVD_DEFAULT_QUEUE_DEPTH,
+		.nr_workers = DEVD_DEFAULT_WORKERS,
+	};
+	struct devd_devmap_args dm_args;
+	struct devd_devmap *map = NULL;
 	int ret;
 
 	ret = getopt_long_more(argc, argv, devd_moreopts, ARRAY_SIZE(devd_moreopts),
@@ -84,14 +225,29 @@ int main(int argc, char **argv)
 	if (ret < 0)
 		goto out;
 
+	ret = devd_devmap_setup(&map, opts.dev_paths, opts.stripe_blocks);
+	if (ret < 0)
+		goto out;
+
 	ret = thread_prepare_main();
 	if (ret < 0)
 		goto out;
 
-	ret = trace_setup(opts.trace_path) ?:
+	dm_args = (struct devd_devmap_args) {
+		.dev_ops = opts.btr_ops,
+		.dev_args = {
+			.map = map,
+			.queue_depth = opts.queue_depth,
+			.uring_flags = opts.uring_flags,
+			.poll = &opts.poll,
+		},
+	};
+
+	ret = trace_setup(opts.trace_path, opts.trace_ring_size) ?:
 	      ngnfs_msg_setup(&nfi, &ngnfs_mtr_socket_ops, NULL, &opts.listen_addr) ?:
-	      ngnfs_block_setup(&nfi, &ngnfs_btr_aio_ops, opts.dev_path) ?:
-	      devd_recv_setup(&nfi) ?:
+	      ngnfs_msg_set_encoding(&nfi, opts.encoding) ?:
+	      ngnfs_block_setup(&nfi, &ngnfs_btr_devmap_ops, &dm_args) ?:
+	      devd_recv_setup(&nfi, map->total_blocks, opts.nr_workers) ?:
 	      thread_sigwait();
 
 	devd_recv_destroy(&nfi);
@@ -100,5 +256,6 @@ int main(int argc, char **argv)
 
 	thread_finish_main();
 out:
+	devd_devmap_destroy(map);
 	return !!ret;
 }
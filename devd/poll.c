@@ -0,0 +1,189 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * devd's transport threads can busy poll for work before sleeping.  On
+ * fast devices the latency of sleeping in the kernel and being woken
+ * can be a large part of the latency of a block IO so it can be worth
+ * burning cpu to notice completions and submissions as soon as they
+ * arrive.
+ *
+ * Each waiting thread has a poller that spins until the caller's ready
+ * test succeeds or its budget runs out, and then the caller sleeps as
+ * it always would have.  The budget adapts to the waits the thread
+ * sees.  Sleeps that would have been satisfied by spinning a little
+ * longer grow the budget to cover them, up to the max, and sleeps that
+ * were longer than the max halve it so that idle threads stop wasting
+ * cpu.
+ *
+ * Pollers count the waits that spinning satisfied and the waits that
+ * had to sleep and periodically report the ratio so that the max budget
+ * can be tuned.  The polling thread reports as it finishes a wait so
+ * idle threads don't report.
+ */
+
+#define _GNU_SOURCE /* cpu sets */
+
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "shared/lk/minmax.h"
+#include "shared/lk/processor.h"
+#include "shared/lk/timekeeping.h"
+#include "shared/log.h"
+#include "shared/parse.h"
+
+#include "devd/poll.h"
+
+#define DEVD_POLL_MIN_NS	500
+#define DEVD_POLL_REPORT_NS	(10ULL * NSEC_PER_SEC)
+
+/*
+ * Parse a comma separated list of cpus that pollers will be pinned to.
+ */
+int devd_poll_parse_cpus(struct devd_poll_args *args, char *str)
+{
+	unsigned long long ull;
+	char *saveptr = NULL;
+	char *tok;
+	int ret;
+
+	args->nr_cpus = 0;
+
+	for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (args->nr_cpus == DEVD_POLL_MAX_CPUS) {
+			log("more than %u poll cpus", DEVD_POLL_MAX_CPUS);
+			return -EINVAL;
+		}
+
+		ret = parse_ull(&ull, tok, 0, CPU_SETSIZE - 1);
+		if (ret < 0)
+			return ret;
+
+		args->cpus[args->nr_cpus++] = ull;
+	}
+
+	return args->nr_cpus > 0 ? 0 : -EINVAL;
+}
+
+void devd_poller_init(struct devd_poller *pl, struct devd_poll_args *args, char *name,
+		      unsigned int dev)
+{
+	memset(pl, 0, sizeof(struct devd_poller));
+	pl->name = name;
+	pl->dev = dev;
+	pl->cpu = -1;
+
+	pl->report_start = ktime_get_ns();
+
+	if (args) {
+		pl->max_ns = args->max_ns;
+		pl->budget_ns = args->max_ns;
+		if (args->nr_cpus > 0)
+			pl->cpu = args->cpus[args->next_cpu++ % args->nr_cpus];
+	}
+}
+
+/*
+ * Called by the polling thread before it starts waiting.  Failing to
+ * pin only costs performance so we carry on.
+ */
+void devd_poller_pin(struct devd_poller *pl)
+{
+	cpu_set_t set;
+	int ret;
+
+	if (pl->cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(pl->cpu, &set);
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0)
+		log("error pinning %s dev %u poller to cpu %d: " ENOF,
+		    pl->name, pl->dev, pl->cpu, ENOA(ret));
+}
+
+static void report_counts(struct devd_poller *pl)
+{
+	u64 total = pl->nr_spins + pl->nr_sleeps;
+
+	log("%s dev %u poll: %llu spins %llu sleeps (%llu%% spun) %llu us spinning, budget %llu ns",
+	    pl->name, pl->dev, pl->nr_spins, pl->nr_sleeps,
+	    total ? (pl->nr_spins * 100) / total : 0, pl->spin_ns / 1000, pl->budget_ns);
+}
+
+static void maybe_report(struct devd_poller *pl, u64 now)
+{
+	if (now - pl->report_start >= DEVD_POLL_REPORT_NS) {
+		report_counts(pl);
+		pl->nr_spins = 0;
+		pl->nr_sleeps = 0;
+		pl->spin_ns = 0;
+		pl->report_start = now;
+	}
+}
+
+/*
+ * Spin until ready returns true or the budget runs out.  Returns false
+ * if the caller has to sleep, in which case it calls _woke once it has
+ * slept so that we can adapt the budget.  Waits that are satisfied
+ * before we start spinning aren't counted.
+ */
+bool devd_poller_spin(struct devd_poller *pl, devd_poll_ready_t ready, void *arg)
+{
+	u64 start;
+	u64 now;
+
+	if (pl->max_ns == 0 || ready(arg))
+		return pl->max_ns != 0;
+
+	start = ktime_get_ns();
+	now = start;
+
+	do {
+		cpu_relax();
+		if (ready(arg)) {
+			now = ktime_get_ns();
+			pl->nr_spins++;
+			pl->spin_ns += now - start;
+			maybe_report(pl, now);
+			return true;
+		}
+		now = ktime_get_ns();
+	} while (now - start < pl->budget_ns);
+
+	pl->nr_sleeps++;
+	pl->spin_ns += now - start;
+	pl->wait_start = start;
+	return false;
+}
+
+void devd_poller_woke(struct devd_poller *pl)
+{
+	u64 waited;
+	u64 now;
+
+	if (pl->max_ns == 0)
+		return;
+
+	now = ktime_get_ns();
+	waited = now - pl->wait_start;
+	if (waited <= pl->max_ns)
+		pl->budget_ns = min(pl->max_ns, max(pl->budget_ns * 2, waited + (waited / 4)));
+	else
+		pl->budget_ns = max((u64)DEVD_POLL_MIN_NS, pl->budget_ns / 2);
+
+	maybe_report(pl, now);
+}
+
+/*
+ * Report the counts since the last periodic report.
+ */
+void devd_poller_report(struct devd_poller *pl)
+{
+	if (pl->max_ns != 0 && (pl->nr_spins || pl->nr_sleeps))
+		report_counts(pl);
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_DEVD_POLL_H
+#define NGNFS_DEVD_POLL_H
+
+#include <stdbool.h>
+
+#include "shared/lk/types.h"
+
+#define DEVD_POLL_MAX_CPUS	64
+
+/*
+ * Shared by all the transports' pollers.  A max_ns of 0 disables
+ * polling.  Pollers are pinned to the cpus in turn as they're
+ * initialized.
+ */
+struct devd_poll_args {
+	u64 max_ns;
+	unsigned int nr_cpus;
+	unsigned int next_cpu;
+	int cpus[DEVD_POLL_MAX_CPUS];
+};
+
+/* only used by the thread that's waiting */
+struct devd_poller {
+	char *name;
+	unsigned int dev;
+	int cpu;
+	u64 max_ns;
+	u64 budget_ns;
+	u64 wait_start;
+	u64 report_start;
+	u64 nr_spins;
+	u64 nr_sleeps;
+	u64 spin_ns;
+};
+
+typedef bool (*devd_poll_ready_t)(void *arg);
+
+int devd_poll_parse_cpus(struct devd_poll_args *args, char *str);
+void devd_poller_init(struct devd_poller *pl, struct devd_poll_args *args, char *name,
+		      unsigned int dev);
+void devd_poller_pin(struct devd_poller *pl);
+bool devd_poller_spin(struct devd_poller *pl, devd_poll_ready_t ready, void *arg);
+void devd_poller_woke(struct devd_poller *pl);
+void devd_poller_report(struct devd_poller *pl);
+
+#endif
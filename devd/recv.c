@@ -2,6 +2,25 @@
 
 /*
  * devd's handling of received messages.
+ *
+ * The transport's receive threads only verify incoming requests and
+ * hand them off to a pool of worker threads.  Workers start the block
+ * cache operations for each request and move on to the next without
+ * waiting for IO.  The results are sent by continuations that the
+ * block cache calls as the reads or writes complete, so each worker can
+ * have many requests in flight.
+ *
+ * Requests are assigned to workers by hashing their block number so
+ * requests for a given block are started in the order they arrived.
+ * Vector requests are split into a part for each worker that owns any
+ * of their blocks.  The parts are queued as the request arrives so a
+ * resent request is still ordered with the later requests for each of
+ * its blocks.
+ *
+ * Free requests can cover any number of blocks so they're queued to
+ * every worker.  The last worker to reach the request frees the blocks
+ * so the free is ordered after all the requests that arrived before
+ * it, without any worker waiting for the others.
  */
 
 #include <string.h>
@@ -10,116 +29,764 @@
 #include "shared/block.h"
 #include "shared/format-block.h"
 #include "shared/format-msg.h"
+#include "shared/lk/atomic.h"
+#include "shared/lk/bitops.h"
+#include "shared/lk/build_bug.h"
 #include "shared/lk/byteorder.h"
+#include "shared/lk/container_of.h"
 #include "shared/lk/err.h"
+#include "shared/lk/jhash.h"
+#include "shared/lk/kernel.h"
+#include "shared/lk/slab.h"
+#include "shared/lk/stddef.h"
+#include "shared/lk/wait.h"
+#include "shared/log.h"
 #include "shared/msg.h"
+#include "shared/thread.h"
 #include "shared/txn.h"
 
 #include "devd/recv.h"
 
-static int devd_get_block(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+struct devd_recv_worker {
+	struct ngnfs_fs_info *nfi;
+	struct thread thr;
+	wait_queue_head_t waitq;
+	struct cds_wfcq_head q_head;
+	struct cds_wfcq_tail q_tail;
+};
+
+struct devd_recv_info {
+	u64 nr_blocks;
+	unsigned int nr_workers;
+	struct devd_recv_worker workers[];
+};
+
+struct devd_recv_work;
+struct devd_recv_part;
+
+struct devd_recv_block {
+	struct ngnfs_block_cont cont;
+	struct devd_recv_work *work;
+	struct devd_recv_part *part;
+	int err;
+};
+
+/*
+ * The part of a request that's queued for one worker.  The bitmap
+ * records which of the request's blocks belong to the worker.
+ */
+struct devd_recv_part {
+	struct cds_wfcq_node q_node;
+	struct devd_recv_work *work;
+	unsigned int wkr;
+	unsigned long blocks;
+};
+
+/*
+ * A copy of a received request that's queued for workers and lives
+ * until its result is sent.  The desc points to the copied addr, ctl,
+ * and referenced data pages that are stored in the work.  The ctl is
+ * stored after the parts.
+ */
+struct devd_recv_work {
+	struct ngnfs_msg_desc mdesc;
+	struct sockaddr_in addr;
+	struct page *data_pages[NGNFS_MSG_MAX_BLOCKS];
+	struct devd_recv_block blocks[NGNFS_MSG_MAX_BLOCKS];
+	atomic_t remaining;
+	atomic_t nr_parts;
+	void *ctl;
+	struct devd_recv_part parts[];
+};
+
+static void free_work(struct devd_recv_work *work)
+{
+	unsigned int i;
+
+	for (i = 0; i < ngnfs_msg_nr_data_pages(&work->mdesc); i++)
+		put_page(work->data_pages[i]);
+	kfree(work);
+}
+
+/*
+ * Results are sent from continuations which have no one to return
+ * errors to.  Send errors come from the transport which is shutting
+ * down the peer so there's nothing more for us to do than drop the
+ * result.
+ */
+
+/*
+ * Requests for blocks past the end of the devices get an error result
+ * before they reach the block cache, which doesn't support write
+ * errors.
+ */
+static int check_bnr(struct ngnfs_fs_info *nfi, __le64 bnr)
+{
+	struct devd_recv_info *rinf = nfi->devd_recv_info;
+
+	return le64_to_cpu(bnr) < rinf->nr_blocks ? 0 : -EINVAL;
+}
+
+static int verify_get_block(struct ngnfs_msg_desc *mdesc)
 {
 	struct ngnfs_msg_get_block *gb = mdesc->ctl_buf;
-	struct ngnfs_msg_get_block_result res;
-	struct ngnfs_msg_desc res_mdesc;
-	struct ngnfs_block *bl;
-	int ret;
 
 	if ((mdesc->ctl_size != sizeof(struct ngnfs_msg_get_block)) ||
 	    (gb->access >= NGNFS_MSG_BLOCK_ACCESS__UNKNOWN) ||
 	    (mdesc->data_size != 0))
 		return -EINVAL;
 
-	/* XXX there'd be fs bnr -> dev bnr mapping */
-	/* XXX that'd catch invalid bnr's coming in? */
+	return 0;
+}
 
-	bl = ngnfs_block_get(nfi, le64_to_cpu(gb->bnr), NBF_READ);
-	if (IS_ERR(bl))
-		ret = PTR_ERR(bl);
-	else
-		ret = 0;
+static void get_block_cont(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont, int err)
+{
+	struct devd_recv_block *rb = container_of(cont, struct devd_recv_block, cont);
+	struct devd_recv_work *work = rb->work;
+	struct ngnfs_msg_get_block *gb = (void *)work->ctl;
+	struct ngnfs_msg_get_block_result res;
+	struct ngnfs_msg_desc res_mdesc;
+	struct page *data_page;
 
 	res.bnr = gb->bnr;
 	res.access = gb->access;
-	res.err = ngnfs_msg_err(ret);
+	res.err = ngnfs_msg_err(err);
 
 	res_mdesc.type = NGNFS_MSG_GET_BLOCK_RESULT;
-	res_mdesc.addr = mdesc->addr;
+	res_mdesc.addr = work->mdesc.addr;
+	res_mdesc.req_id = work->mdesc.req_id;
 	res_mdesc.ctl_buf = &res;
 	res_mdesc.ctl_size = sizeof(res);
-	if (ret < 0) {
-		res_mdesc.data_page = NULL;
+	if (err < 0) {
+		res_mdesc.data_pages = NULL;
 		res_mdesc.data_size = 0;
 	} else {
-		res_mdesc.data_page = ngnfs_block_page(bl);
+		data_page = ngnfs_block_get_page(cont->bl);
+		res_mdesc.data_pages = &data_page;
 		res_mdesc.data_size = NGNFS_BLOCK_SIZE;
 	}
 
-	ret = ngnfs_msg_send(nfi, &res_mdesc);
-	ngnfs_block_put(bl);
+	ngnfs_msg_send(nfi, &res_mdesc);
+	if (err == 0)
+		put_page(data_page);
+	if (cont->bl)
+		ngnfs_block_put(cont->bl);
+	free_work(work);
+}
 
-	return ret;
+static void devd_get_block(struct ngnfs_fs_info *nfi, struct devd_recv_part *part)
+{
+	struct devd_recv_work *work = part->work;
+	struct ngnfs_msg_get_block *gb = (void *)work->ctl;
+	struct ngnfs_block_cont *cont = &work->blocks[0].cont;
+	int ret;
+
+	ngnfs_block_cont_init(cont, get_block_cont);
+
+	ret = check_bnr(nfi, gb->bnr);
+	if (ret < 0)
+		cont->func(nfi, cont, ret);
+	else
+		ngnfs_block_get_cont(nfi, le64_to_cpu(gb->bnr), NBF_READ, cont);
 }
 
 /*
- * We're copying the block contents today, but we should be able to swap
- * data pages as long as we appropriately manage concurrent readers.
+ * The received page isn't modified after it's queued for the worker so
+ * the block can use it as its contents.  We only copy if the block is
+ * still being read.  Results that send block contents hold their own
+ * page references so they don't see the swap.
  */
 static void commit_write_block(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
 			       struct ngnfs_block *bl, void *arg)
 {
 	struct page *data_page = arg;
 
-	memcpy(ngnfs_block_buf(bl), page_address(data_page), NGNFS_BLOCK_SIZE);
+	if (!ngnfs_block_swap_page(bl, data_page))
+		memcpy(ngnfs_block_buf(bl), page_address(data_page), NGNFS_BLOCK_SIZE);
 }
 
-static int devd_write_block(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+/* XXX errors that shutdown the session? */
+/* XXX verify more fields? */
+static int verify_write_block(struct ngnfs_msg_desc *mdesc)
 {
-	struct ngnfs_transaction txn = INIT_NGNFS_TXN(txn);
-	struct ngnfs_msg_write_block *wb = mdesc->ctl_buf;
+	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_write_block) ||
+	    mdesc->data_size != NGNFS_BLOCK_SIZE)
+		return -EIO;
+
+	return 0;
+}
+
+static void write_block_cont(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont, int err)
+{
+	struct devd_recv_block *rb = container_of(cont, struct devd_recv_block, cont);
+	struct devd_recv_work *work = rb->work;
+	struct ngnfs_msg_write_block *wb = (void *)work->ctl;
 	struct ngnfs_msg_write_block_result res;
 	struct ngnfs_msg_desc res_mdesc;
+
+	res.bnr = wb->bnr;
+	res.err = ngnfs_msg_err(err);
+
+	res_mdesc.type = NGNFS_MSG_WRITE_BLOCK_RESULT;
+	res_mdesc.addr = work->mdesc.addr;
+	res_mdesc.req_id = work->mdesc.req_id;
+	res_mdesc.ctl_buf = &res;
+	res_mdesc.ctl_size = sizeof(res);
+	res_mdesc.data_pages = NULL;
+	res_mdesc.data_size = 0;
+
+	ngnfs_msg_send(nfi, &res_mdesc);
+	free_work(work);
+}
+
+/*
+ * The incoming blocks are given to the cache by a transaction in
+ * the worker.  Only the sync that writes them waits for IO and it calls
+ * the continuation once the blocks are written.
+ */
+static void devd_write_block(struct ngnfs_fs_info *nfi, struct devd_recv_part *part)
+{
+	struct devd_recv_work *work = part->work;
+	struct ngnfs_transaction txn = INIT_NGNFS_TXN(txn);
+	struct ngnfs_msg_write_block *wb = (void *)work->ctl;
+	struct ngnfs_block_cont *cont = &work->blocks[0].cont;
+	int ret;
+
+	ngnfs_block_cont_init(cont, write_block_cont);
+
+	ret = check_bnr(nfi, wb->bnr) ?:
+	      ngnfs_txn_add_block(nfi, &txn, le64_to_cpu(wb->bnr), NBF_NEW | NBF_WRITE,
+				  NULL, commit_write_block, work->data_pages[0]) ?:
+	      ngnfs_txn_execute(nfi, &txn);
+	ngnfs_txn_destroy(nfi, &txn);
+	if (ret < 0)
+		cont->func(nfi, cont, ret);
+	else
+		ngnfs_block_sync_cont(nfi, cont);
+}
+
+static int verify_get_blocks(struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_get_blocks *gb = mdesc->ctl_buf;
+
+	if ((mdesc->ctl_size < sizeof(struct ngnfs_msg_get_blocks)) ||
+	    (gb->nr == 0 || gb->nr > NGNFS_MSG_MAX_BLOCKS) ||
+	    (mdesc->ctl_size != offsetof(struct ngnfs_msg_get_blocks, bnrs[gb->nr])) ||
+	    (gb->access >= NGNFS_MSG_BLOCK_ACCESS__UNKNOWN) ||
+	    (mdesc->data_size != 0))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * The last block's continuation sends the contents of all the blocks in
+ * one result.  Each block has its own result so that one failed block
+ * doesn't fail the others.
+ */
+static void get_blocks_cont(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont, int err)
+{
+	struct devd_recv_block *rb = container_of(cont, struct devd_recv_block, cont);
+	struct devd_recv_work *work = rb->work;
+	struct ngnfs_msg_get_blocks *gb = (void *)work->ctl;
+	struct page *data_pages[NGNFS_MSG_MAX_BLOCKS];
+	struct ngnfs_msg_desc res_mdesc;
+	union {
+		struct ngnfs_msg_get_blocks_result gbr;
+		u8 buf[offsetof(struct ngnfs_msg_get_blocks_result, res[NGNFS_MSG_MAX_BLOCKS])];
+	} res;
+	struct ngnfs_block *bl;
+	unsigned int nr_pages = 0;
+	unsigned int i;
+
+	rb->err = err;
+	if (atomic_dec_return(&work->remaining) > 0)
+		return;
+
+	res.gbr.nr = gb->nr;
+	res.gbr.access = gb->access;
+	memset(res.gbr._pad, 0, sizeof(res.gbr._pad));
+
+	for (i = 0; i < gb->nr; i++) {
+		rb = &work->blocks[i];
+
+		res.gbr.res[i].bnr = gb->bnrs[i];
+		res.gbr.res[i].err = ngnfs_msg_err(rb->err);
+		memset(res.gbr.res[i]._pad, 0, sizeof(res.gbr.res[i]._pad));
+		if (rb->err == 0)
+			data_pages[nr_pages++] = ngnfs_block_get_page(rb->cont.bl);
+	}
+
+	res_mdesc.type = NGNFS_MSG_GET_BLOCKS_RESULT;
+	res_mdesc.addr = work->mdesc.addr;
+	res_mdesc.req_id = work->mdesc.req_id;
+	res_mdesc.ctl_buf = &res;
+	res_mdesc.ctl_size = offsetof(struct ngnfs_msg_get_blocks_result, res[gb->nr]);
+	res_mdesc.data_pages = data_pages;
+	res_mdesc.data_size = nr_pages * NGNFS_BLOCK_SIZE;
+
+	ngnfs_msg_send(nfi, &res_mdesc);
+
+	for (i = 0; i < nr_pages; i++)
+		put_page(data_pages[i]);
+	for (i = 0; i < gb->nr; i++) {
+		bl = work->blocks[i].cont.bl;
+		if (bl)
+			ngnfs_block_put(bl);
+	}
+	free_work(work);
+}
+
+/*
+ * The remaining count was set to the number of blocks as the request
+ * was dispatched so the result can't be sent, and the work freed, until
+ * all the parts have started their reads.  The work can be freed as our
+ * last read is started so we iterate over a copy of our blocks.
+ */
+static void devd_get_blocks(struct ngnfs_fs_info *nfi, struct devd_recv_part *part)
+{
+	struct devd_recv_work *work = part->work;
+	struct ngnfs_msg_get_blocks *gb = (void *)work->ctl;
+	struct ngnfs_block_cont *cont;
+	unsigned long blocks = part->blocks;
+	unsigned int i;
 	int ret;
 
-	/* XXX errors that shutdown the session? */
-	/* XXX verify more fields? */
-	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_write_block) ||
-	    mdesc->data_size != NGNFS_BLOCK_SIZE) {
-		ret = -EIO;
-		goto out;
+	for (i = 0; i < gb->nr; i++) {
+		if (blocks & (1UL << i))
+			ngnfs_block_cont_init(&work->blocks[i].cont, get_blocks_cont);
 	}
 
-	/* XXX there'd be fs bnr -> dev bnr mapping */
+	while (blocks) {
+		i = __ffs(blocks);
+		blocks &= blocks - 1;
 
-	ret = ngnfs_txn_add_block(nfi, &txn, le64_to_cpu(wb->bnr), NBF_NEW | NBF_WRITE,
-				  NULL, commit_write_block, mdesc->data_page) ?:
-	      ngnfs_txn_execute(nfi, &txn);
+		cont = &work->blocks[i].cont;
+		ret = check_bnr(nfi, gb->bnrs[i]);
+		if (ret < 0)
+			cont->func(nfi, cont, ret);
+		else
+			ngnfs_block_get_cont(nfi, le64_to_cpu(gb->bnrs[i]), NBF_READ, cont);
+	}
+}
+
+static int verify_write_blocks(struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_write_blocks *wb = mdesc->ctl_buf;
+
+	if ((mdesc->ctl_size < sizeof(struct ngnfs_msg_write_blocks)) ||
+	    (wb->nr == 0 || wb->nr > NGNFS_MSG_MAX_BLOCKS) ||
+	    (mdesc->ctl_size != offsetof(struct ngnfs_msg_write_blocks, bnrs[wb->nr])) ||
+	    (mdesc->data_size != wb->nr * NGNFS_BLOCK_SIZE))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Each part's transaction either succeeds or fails as a whole so the
+ * part's blocks share its error.  The last part to finish sends the
+ * result.
+ */
+static void write_blocks_cont(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont, int err)
+{
+	struct devd_recv_block *rb = container_of(cont, struct devd_recv_block, cont);
+	struct devd_recv_work *work = rb->work;
+	struct devd_recv_part *part = rb->part;
+	struct ngnfs_msg_write_blocks *wb = (void *)work->ctl;
+	struct ngnfs_msg_desc res_mdesc;
+	union {
+		struct ngnfs_msg_write_blocks_result wbr;
+		u8 buf[offsetof(struct ngnfs_msg_write_blocks_result, res[NGNFS_MSG_MAX_BLOCKS])];
+	} res;
+	unsigned int i;
+
+	for (i = 0; i < wb->nr; i++) {
+		if (part->blocks & (1UL << i))
+			work->blocks[i].err = err;
+	}
+
+	if (atomic_add_return(-hweight_long(part->blocks), &work->remaining) > 0)
+		return;
+
+	res.wbr.nr = wb->nr;
+	memset(res.wbr._pad, 0, sizeof(res.wbr._pad));
+	for (i = 0; i < wb->nr; i++) {
+		res.wbr.res[i].bnr = wb->bnrs[i];
+		res.wbr.res[i].err = ngnfs_msg_err(work->blocks[i].err);
+		memset(res.wbr.res[i]._pad, 0, sizeof(res.wbr.res[i]._pad));
+	}
+
+	res_mdesc.type = NGNFS_MSG_WRITE_BLOCKS_RESULT;
+	res_mdesc.addr = work->mdesc.addr;
+	res_mdesc.req_id = work->mdesc.req_id;
+	res_mdesc.ctl_buf = &res;
+	res_mdesc.ctl_size = offsetof(struct ngnfs_msg_write_blocks_result, res[wb->nr]);
+	res_mdesc.data_pages = NULL;
+	res_mdesc.data_size = 0;
+
+	ngnfs_msg_send(nfi, &res_mdesc);
+	free_work(work);
+}
+
+/*
+ * All of a part's blocks are written in one transaction and share a
+ * single sync whose continuation is stored in the part's first block.
+ */
+static void devd_write_blocks(struct ngnfs_fs_info *nfi, struct devd_recv_part *part)
+{
+	struct ngnfs_transaction txn = INIT_NGNFS_TXN(txn);
+	struct devd_recv_work *work = part->work;
+	struct ngnfs_msg_write_blocks *wb = (void *)work->ctl;
+	struct devd_recv_block *rb = &work->blocks[__ffs(part->blocks)];
+	struct ngnfs_block_cont *cont = &rb->cont;
+	unsigned int i;
+	int ret;
+
+	ngnfs_block_cont_init(cont, write_blocks_cont);
+	rb->part = part;
+
+	ret = 0;
+	for (i = 0; i < wb->nr && ret == 0; i++) {
+		if (!(part->blocks & (1UL << i)))
+			continue;
+
+		ret = check_bnr(nfi, wb->bnrs[i]) ?:
+		      ngnfs_txn_add_block(nfi, &txn, le64_to_cpu(wb->bnrs[i]),
+					  NBF_NEW | NBF_WRITE, NULL, commit_write_block,
+					  work->data_pages[i]);
+	}
 	if (ret == 0)
-		ret = ngnfs_block_sync(nfi);
+		ret = ngnfs_txn_execute(nfi, &txn);
+	ngnfs_txn_destroy(nfi, &txn);
+	if (ret < 0)
+		cont->func(nfi, cont, ret);
+	else
+		ngnfs_block_sync_cont(nfi, cont);
+}
 
-	res.bnr = wb->bnr;
-	res.err = ngnfs_msg_err(ret);
+static int verify_free_blocks(struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_free_blocks *fb = mdesc->ctl_buf;
 
-	res_mdesc.type = NGNFS_MSG_WRITE_BLOCK_RESULT;
-	res_mdesc.addr = mdesc->addr;
+	if ((mdesc->ctl_size < sizeof(struct ngnfs_msg_free_blocks)) ||
+	    (fb->nr == 0 || fb->nr > NGNFS_MSG_MAX_FREE_EXTENTS) ||
+	    (mdesc->ctl_size != offsetof(struct ngnfs_msg_free_blocks, exts[fb->nr])) ||
+	    (mdesc->data_size != 0))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void free_blocks_cont(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont, int err)
+{
+	struct devd_recv_block *rb = container_of(cont, struct devd_recv_block, cont);
+	struct devd_recv_work *work = rb->work;
+	struct ngnfs_msg_free_blocks *fb = (void *)work->ctl;
+	struct ngnfs_msg_free_blocks_result res;
+	struct ngnfs_msg_desc res_mdesc;
+
+	res.nr_blocks = fb->nr_blocks;
+	res.err = ngnfs_msg_err(err);
+	memset(res._pad, 0, sizeof(res._pad));
+
+	res_mdesc.type = NGNFS_MSG_FREE_BLOCKS_RESULT;
+	res_mdesc.addr = work->mdesc.addr;
+	res_mdesc.req_id = work->mdesc.req_id;
 	res_mdesc.ctl_buf = &res;
 	res_mdesc.ctl_size = sizeof(res);
-	res_mdesc.data_page = NULL;
+	res_mdesc.data_pages = NULL;
 	res_mdesc.data_size = 0;
 
-	ret = ngnfs_msg_send(nfi, &res_mdesc);
-out:
-	return ret;
+	ngnfs_msg_send(nfi, &res_mdesc);
+	free_work(work);
+}
+
+/*
+ * The extents are freed in the block cache which discards them in
+ * batches.  The result is sent by a sync which waits for the discards
+ * to finish.  Extents outside the devices fail the whole request
+ * before any are freed.
+ *
+ * Every worker has a part and only the last to get here frees.  The
+ * others can't touch the work once they've dropped their count.
+ */
+static void devd_free_blocks(struct ngnfs_fs_info *nfi, struct devd_recv_part *part)
+{
+	struct devd_recv_info *rinf = nfi->devd_recv_info;
+	struct devd_recv_work *work = part->work;
+	struct ngnfs_msg_free_blocks *fb = (void *)work->ctl;
+	struct ngnfs_block_cont *cont = &work->blocks[0].cont;
+	unsigned int i;
+	u64 bnr;
+	u64 nr;
+
+	if (atomic_dec_return(&work->remaining) > 0)
+		return;
+
+	ngnfs_block_cont_init(cont, free_blocks_cont);
+
+	for (i = 0; i < fb->nr; i++) {
+		bnr = le64_to_cpu(fb->exts[i].bnr);
+		nr = le64_to_cpu(fb->exts[i].nr);
+		if (nr == 0 || bnr >= rinf->nr_blocks || nr > rinf->nr_blocks - bnr) {
+			cont->func(nfi, cont, -EINVAL);
+			return;
+		}
+	}
+
+	for (i = 0; i < fb->nr; i++)
+		ngnfs_block_free(nfi, le64_to_cpu(fb->exts[i].bnr), le64_to_cpu(fb->exts[i].nr));
+
+	ngnfs_block_sync_cont(nfi, cont);
+}
+
+/*
+ * Vector requests have an array of block numbers whose count is the
+ * first byte of their ctl.  Requests for all workers are queued to
+ * every worker and don't use their bnr_off.
+ */
+#define RT_VECTOR	(1 << 0)
+#define RT_ALL_WORKERS	(1 << 1)
+
+static struct devd_recv_type {
+	int (*verify)(struct ngnfs_msg_desc *mdesc);
+	void (*process)(struct ngnfs_fs_info *nfi, struct devd_recv_part *part);
+	size_t bnr_off;
+	unsigned int flags;
+} recv_types[] = {
+	[NGNFS_MSG_GET_BLOCK] = {
+		verify_get_block, devd_get_block,
+		offsetof(struct ngnfs_msg_get_block, bnr), 0,
+	},
+	[NGNFS_MSG_WRITE_BLOCK] = {
+		verify_write_block, devd_write_block,
+		offsetof(struct ngnfs_msg_write_block, bnr), 0,
+	},
+	[NGNFS_MSG_GET_BLOCKS] = {
+		verify_get_blocks, devd_get_blocks,
+		offsetof(struct ngnfs_msg_get_blocks, bnrs[0]), RT_VECTOR,
+	},
+	[NGNFS_MSG_WRITE_BLOCKS] = {
+		verify_write_blocks, devd_write_blocks,
+		offsetof(struct ngnfs_msg_write_blocks, bnrs[0]), RT_VECTOR,
+	},
+	[NGNFS_MSG_FREE_BLOCKS] = {
+		verify_free_blocks, devd_free_blocks,
+		0, RT_ALL_WORKERS,
+	},
+};
+
+/*
+ * Processing a request's parts passes the work on to the block cache
+ * continuations which free it once its result is sent.
+ */
+static void recv_worker_thread(struct thread *thr, void *arg)
+{
+	struct devd_recv_worker *wkr = arg;
+	struct devd_recv_part *part;
+	struct cds_wfcq_node *node;
+	struct cds_wfcq_head head;
+	struct cds_wfcq_tail tail;
+
+	cds_wfcq_init(&head, &tail);
+
+	while (!thread_should_return(thr)) {
+
+		wait_event(&wkr->waitq, !cds_wfcq_empty(&wkr->q_head, &wkr->q_tail) ||
+			   thread_should_return(thr));
+
+		__cds_wfcq_splice_nonblocking(&head, &tail, &wkr->q_head, &wkr->q_tail);
+
+		while ((node = __cds_wfcq_dequeue_nonblocking(&head, &tail))) {
+			part = caa_container_of(node, struct devd_recv_part, q_node);
+
+			recv_types[part->work->mdesc.type].process(wkr->nfi, part);
+		}
+	}
+}
+
+static unsigned int bnr_worker(struct devd_recv_info *rinf, __le64 bnr)
+{
+	return jhash_2words(le64_to_cpu(bnr), le64_to_cpu(bnr) >> 32, 0) % rinf->nr_workers;
 }
 
-int devd_recv_setup(struct ngnfs_fs_info *nfi)
+static void init_part(struct devd_recv_work *work, struct devd_recv_part *part, unsigned int wkr)
 {
-	return ngnfs_msg_register_recv(nfi, NGNFS_MSG_GET_BLOCK, devd_get_block) ?:
-	       ngnfs_msg_register_recv(nfi, NGNFS_MSG_WRITE_BLOCK, devd_write_block);
+	cds_wfcq_node_init(&part->q_node);
+	part->work = work;
+	part->wkr = wkr;
+	part->blocks = 0;
 }
 
+/*
+ * The transport's recv thread calls us with a message that is only
+ * valid for the duration of the call.  We verify it, copy it into a
+ * work item, and queue a part for each worker that owns its blocks.
+ *
+ * The work can be freed as soon as its last part is processed so we
+ * can't touch it once its last part is queued.
+ */
+static int devd_recv_dispatch(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+{
+	struct devd_recv_info *rinf = nfi->devd_recv_info;
+	struct devd_recv_type *rt = &recv_types[mdesc->type];
+	struct devd_recv_worker *wkr;
+	struct devd_recv_work *work;
+	struct devd_recv_part *part;
+	unsigned int max_parts;
+	unsigned int nr_parts;
+	unsigned int nr;
+	unsigned int w;
+	unsigned int i;
+	unsigned int j;
+	__le64 bnr;
+	int ret;
+
+	ret = rt->verify(mdesc);
+	if (ret < 0)
+		return ret;
+
+	BUILD_BUG_ON(offsetof(struct ngnfs_msg_get_blocks, nr) != 0);
+	BUILD_BUG_ON(offsetof(struct ngnfs_msg_write_blocks, nr) != 0);
+	BUILD_BUG_ON(NGNFS_MSG_MAX_BLOCKS > BITS_PER_LONG);
+	nr = (rt->flags & RT_VECTOR) ? *(u8 *)mdesc->ctl_buf : 1;
+	max_parts = (rt->flags & RT_ALL_WORKERS) ? rinf->nr_workers : nr;
+
+	work = kmalloc(offsetof(struct devd_recv_work, parts[max_parts]) + mdesc->ctl_size,
+		       GFP_NOFS);
+	if (!work)
+		return -ENOMEM;
+
+	work->ctl = &work->parts[max_parts];
+	work->addr = *mdesc->addr;
+	memcpy(work->ctl, mdesc->ctl_buf, mdesc->ctl_size);
+	work->mdesc = *mdesc;
+	work->mdesc.addr = &work->addr;
+	work->mdesc.ctl_buf = work->ctl;
+	work->mdesc.data_pages = work->data_pages;
+	for (i = 0; i < ngnfs_msg_nr_data_pages(mdesc); i++) {
+		work->data_pages[i] = mdesc->data_pages[i];
+		get_page(work->data_pages[i]);
+	}
+	for (i = 0; i < ARRAY_SIZE(work->blocks); i++)
+		work->blocks[i].work = work;
+
+	if (rt->flags & RT_ALL_WORKERS) {
+		for (j = 0; j < rinf->nr_workers; j++)
+			init_part(work, &work->parts[j], j);
+		nr_parts = rinf->nr_workers;
+		atomic_set(&work->remaining, nr_parts);
+	} else {
+		/* gather the blocks owned by each worker into its part */
+		nr_parts = 0;
+		for (i = 0; i < nr; i++) {
+			memcpy(&bnr, work->ctl + rt->bnr_off + (i * sizeof(bnr)), sizeof(bnr));
+			w = bnr_worker(rinf, bnr);
+
+			for (j = 0; j < nr_parts && work->parts[j].wkr != w; j++)
+				;
+			if (j == nr_parts)
+				init_part(work, &work->parts[nr_parts++], w);
+
+			work->parts[j].blocks |= 1UL << i;
+		}
+		atomic_set(&work->remaining, nr);
+	}
+	atomic_set(&work->nr_parts, nr_parts);
+
+	for (j = 0; j < nr_parts; j++) {
+		part = &work->parts[j];
+		wkr = &rinf->workers[part->wkr];
+		cds_wfcq_enqueue(&wkr->q_head, &wkr->q_tail, &part->q_node);
+		wake_up(&wkr->waitq);
+	}
+
+	return 0;
+}
+
+int devd_recv_setup(struct ngnfs_fs_info *nfi, u64 nr_blocks, unsigned int nr_workers)
+{
+	struct devd_recv_info *rinf;
+	struct devd_recv_worker *wkr;
+	unsigned int i;
+	int ret;
+
+	rinf = kzalloc(offsetof(struct devd_recv_info, workers[nr_workers]), GFP_NOFS);
+	if (!rinf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	rinf->nr_blocks = nr_blocks;
+	rinf->nr_workers = nr_workers;
+	for (i = 0; i < nr_workers; i++) {
+		wkr = &rinf->workers[i];
+
+		wkr->nfi = nfi;
+		thread_init(&wkr->thr);
+		init_waitqueue_head(&wkr->waitq);
+		cds_wfcq_init(&wkr->q_head, &wkr->q_tail);
+	}
+
+	nfi->devd_recv_info = rinf;
+
+	for (i = 0; i < nr_workers; i++) {
+		ret = thread_start(&rinf->workers[i].thr, recv_worker_thread, &rinf->workers[i]);
+		if (ret < 0) {
+			log("error starting recv worker thread: "ENOF, ENOA(-ret));
+			goto out;
+		}
+	}
+
+	ret = ngnfs_msg_register_recv(nfi, NGNFS_MSG_GET_BLOCK, devd_recv_dispatch) ?:
+	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_WRITE_BLOCK, devd_recv_dispatch) ?:
+	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_GET_BLOCKS, devd_recv_dispatch) ?:
+	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_WRITE_BLOCKS, devd_recv_dispatch) ?:
+	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_FREE_BLOCKS, devd_recv_dispatch);
+out:
+	return ret;
+}
+
+/*
+ * Once the handlers are unregistered and the workers have stopped we
+ * can free any requests whose parts were all still queued.
+ *
+ * XXX Requests waiting in block cache continuations are only freed as
+ * their IO completes, and requests with only some parts processed are
+ * leaked.
+ */
 void devd_recv_destroy(struct ngnfs_fs_info *nfi)
 {
-	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_GET_BLOCK, devd_get_block);
-	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_WRITE_BLOCK, devd_write_block);
+	struct devd_recv_info *rinf = nfi->devd_recv_info;
+	struct devd_recv_worker *wkr;
+	struct devd_recv_part *part;
+	struct cds_wfcq_node *node;
+	unsigned int i;
+
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_GET_BLOCK, devd_recv_dispatch);
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_WRITE_BLOCK, devd_recv_dispatch);
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_GET_BLOCKS, devd_recv_dispatch);
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_WRITE_BLOCKS, devd_recv_dispatch);
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_FREE_BLOCKS, devd_recv_dispatch);
+
+	if (!rinf)
+		return;
+
+	for (i = 0; i < rinf->nr_workers; i++) {
+		wkr = &rinf->workers[i];
+
+		thread_stop_indicate(&wkr->thr);
+		wake_up(&wkr->waitq);
+		thread_stop_wait(&wkr->thr);
+
+		while ((node = __cds_wfcq_dequeue_nonblocking(&wkr->q_head, &wkr->q_tail))) {
+			part = caa_container_of(node, struct devd_recv_part, q_node);
+			if (atomic_dec_and_test(&part->work->nr_parts))
+				free_work(part->work);
+		}
+	}
+
+	kfree(rinf);
+	nfi->devd_recv_info = NULL;
 }
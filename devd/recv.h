@@ -2,7 +2,7 @@
 #ifndef NGNFS_DEVD_RECV_H
 #define NGNFS_DEVD_RECV_H
 
-int devd_recv_setup(struct ngnfs_fs_info *nfi);
+int devd_recv_setup(struct ngnfs_fs_info *nfi, u64 nr_blocks, unsigned int nr_workers);
 void devd_recv_destroy(struct ngnfs_fs_info *nfi);
 
 #endif
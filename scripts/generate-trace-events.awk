@@ -23,10 +23,31 @@
 #	some_event id llu type d 
 #	other length x width u
 #
+# A few formats store more than integers:
+#
+#	hexN	N bytes from a pointer argument, printed as hex
+#	hex	bytes from a pointer and size_t length argument pair
+#	str	a nul terminated string, without the nul
+#	ipv4	a struct sockaddr_in from a pointer argument
+#
+# The variable length hex and str fields store at most TRACE_VAR_MAX
+# bytes after the event struct.  Each field is stored with an
+# assignment or a memcpy, formatting is left to print_trace_event().
+#
+# Each stored event is preceded by a header that records the time it was
+# stored and the thread and cpu that stored it.  print_trace_event()
+# prints those before the event's name and its fields.
+#
+# Each event only stores if its bit in trace_event_bits is set, see
+# trace_set_events().
+#
+# trace_event_desc() describes each event's name and the label, format,
+# and location of its fields so that tools can analyze events without
+# knowing about each event.
+#
 # todo:
 #  - structs?
 #  - fixed width hex output?
-#  - strings?
 # 
 
 BEGIN {
@@ -36,6 +57,8 @@ BEGIN {
 	fmt_types["d"]="u32"
 	fmt_types["u"]="u32"
 	fmt_types["x"]="u32"
+	fmt_signed["lld"]="true"
+	fmt_signed["d"]="true"
 
 	print	"/*\n"									\
 		" * This is output that is generated by scripts from descriptions\n"	\
@@ -65,40 +88,94 @@ BEGIN {
 	name_line[name]=NR
 
 	id++
-	space=""
+	struct = "struct trace_ngnfs_" name "_event"
 	comma=""
 	newline=""
 	args=""
 	fields=""
+	decls=""
+	lens=""
+	var_size=""
 	assign=""
-	pf_fmt=""
-	pf_args=""
+	pf=""
+	pf_decls=""
+	desc=""
 	for (i = 2; i <= NF; i += 2) {
 		nr = i / 2
 		str = $i
 		fmt = $(i+1)
 		type = fmt_types[fmt]
 		arg = "a" nr
+		off = "offsetof(" struct ", " arg ")"
+
+		if (type != "") {
+			args = (args comma type " " arg)
+			fields = (fields newline "  " type " " arg ";")
+			assign = (assign newline "    ev->" arg " = " arg ";")
+			pf = (pf "      printf(\" " str " %" fmt "\", ev->" arg ");\n")
+			desc_type = "TRACE_FIELD_INT"
+			desc_size = "sizeof(" type ")"
+
+		} else if (fmt == "ipv4") {
+			args = (args comma "struct sockaddr_in *" arg)
+			fields = (fields newline "  struct sockaddr_in " arg ";")
+			assign = (assign newline "    ev->" arg " = *" arg ";")
+			pf = (pf "      printf(\" " str " \" IPV4F, IPV4A(&ev->" arg "));\n")
+			desc_type = "TRACE_FIELD_IPV4"
+			desc_size = "sizeof(struct sockaddr_in)"
+
+		} else if (fmt ~ /^hex[0-9]+$/) {
+			n = substr(fmt, 4) + 0
+			if (n < 1 || n > 255) {
+				print "line " NR " field \"" str "\" hex size must be 1 to 255" > "/dev/stderr"
+				exit 1
+			}
+			args = (args comma "const void *" arg)
+			fields = (fields newline "  u8 " arg "[" n "];")
+			assign = (assign newline "    memcpy(ev->" arg ", " arg ", " n ");")
+			pf = (pf "      printf(\" " str " \");\n"				\
+				 "      trace_print_hex(ev->" arg ", " n ");\n")
+			desc_type = "TRACE_FIELD_HEX"
+			desc_size = n
+
+		} else if (fmt == "hex" || fmt == "str") {
+			len = arg "_len"
+			if (fmt == "hex") {
+				args = (args comma "const void *" arg ", size_t " len)
+				lens = (lens "  " len " = min_t(size_t, " len ", TRACE_VAR_MAX);\n")
+				pf = (pf "      len = trace_var_len(var, ev->" len ", end);\n"	\
+					 "      printf(\" " str " \");\n"			\
+					 "      trace_print_hex(var, len);\n"			\
+					 "      var += len;\n")
+				desc_type = "TRACE_FIELD_VAR_HEX"
+			} else {
+				args = (args comma "const char *" arg)
+				decls = (decls "  size_t " len ";\n")
+				lens = (lens "  " len " = strnlen(" arg ", TRACE_VAR_MAX);\n")
+				pf = (pf "      len = trace_var_len(var, ev->" len ", end);\n"	\
+					 "      printf(\" " str " %.*s\", len, (char *)var);\n"	\
+					 "      var += len;\n")
+				desc_type = "TRACE_FIELD_VAR_STR"
+			}
+			fields = (fields newline "  u16 " len ";")
+			var_size = (var_size " + " len)
+			assign = (assign newline "    ev->" len " = " len ";"		\
+					 "\n    memcpy(var, " arg ", " len ");"		\
+					 "\n    var += " len ";")
+			pf_decls = "      void *var = ev + 1;\n      u16 len;\n"
+			any_var = 1
+			off = "offsetof(" struct ", " len ")"
+			desc_size = "sizeof(u16)"
+
+		} else {
+			print "line " NR " field \"" str "\" has unknown format \"" fmt "\"" > "/dev/stderr"
+			exit 1
+		}
+
+		# field descriptions
+		desc = (desc "    { \"" str "\", \"" fmt "\", " off ", " desc_size ", "	\
+			desc_type ", " (fmt_signed[fmt] ? "true" : "false") " },\n")
 
-		# arguments
-		args = (args comma type " " arg)
-
-		# struct fields
-		struct = "struct trace_ngnfs_" name "_event"
-		fields = (fields newline "  " type " " arg ";")
-
-		# assignment
-		assign = (assign newline "    ev->" arg " = " arg ";")
-#		print assign
-
-		# printf format
-		pf_fmt = (pf_fmt space str " %" fmt)
-#		print pf_fmt
-
-		# printf args
-		pf_args = (pf_args comma "ev->" arg)
-
-		space=" "
 		comma=", "
 		newline="\n"
 	}
@@ -110,24 +187,62 @@ BEGIN {
 	print "static inline void trace_ngnfs_" name "(" args ")\n"		\
 		"{\n"								\
 		"  " struct " *ev;\n"						\
+		   (var_size != "" ? "  void *var;\n" : "")			\
+		   decls							\
+		"\n"								\
+		"  if (!trace_event_enabled(" id "))\n"				\
+		"    return;\n"							\
+		"\n"								\
+		   (lens != "" ? lens "\n" : "")				\
 		"  trace_store_begin();\n"					\
-		"  ev = trace_store_ptr(" id ", sizeof(" struct "));\n"		\
+		"  ev = trace_store_ptr(" id ", sizeof(" struct ")" var_size ");\n" \
 		"  if (ev) {\n"							\
+		   (var_size != "" ? "    var = ev + 1;\n" : "")		\
 		     assign "\n"						\
 		"  }\n"								\
-		"  trace_store_end();\n"					\
+		"  trace_store_end(ev);\n"					\
 		"}\n"
 
+	desc_fields = (desc_fields "  static const struct ngnfs_trace_field_desc " name "_fields[] = {\n" \
+		desc								\
+		"  };\n")
+	desc_events = (desc_events "    [" id "] = { \"" name "\", sizeof(" struct "), " (NF - 1) / 2 ", " \
+		name "_fields },\n")
+
 	print_cases = (print_cases "  case " id ":\n"				\
 		"    { " struct " *ev = ptr;\n"					\
-		"      printf(\"" pf_fmt "\\n\", " pf_args ");\n"		\
+		   pf_decls							\
+		"      printf(\"" name "\");\n"					\
+		   pf								\
+		"      printf(\"\\n\");\n"					\
 		"      break; }\n")
 }
 END { 
-	print "static inline void print_trace_event(u16 id, void *ptr)\n"	\
+	print "static inline void print_trace_event(struct ngnfs_trace_event_header *hdr, void *ptr)\n" \
 		"{\n"								\
+		"  u64 ns = le64_to_cpu(hdr->ns);\n"				\
+		"  u16 id = le16_to_cpu(hdr->id);\n"				\
+		   (any_var ? "  void *end = ptr + le16_to_cpu(hdr->size) - sizeof(*hdr);\n" : "") \
+		"\n"								\
+		"  printf(\"%llu.%09llu tid %u cpu %u \", ns / 1000000000ULL, ns % 1000000000ULL,\n" \
+		"         le32_to_cpu(hdr->tid), le16_to_cpu(hdr->cpu));\n"	\
+		"\n"								\
 		"  switch(id) {\n"						\
 		     print_cases						\
+		"  default:\n"							\
+		"    printf(\"unknown id %u size %u\\n\", id, le16_to_cpu(hdr->size));\n" \
 		"  }\n"								\
 		"}\n"
+
+	print "#define NGNFS_TRACE_EVENT_NR " (id + 1) "\n"
+
+	print "static inline const struct ngnfs_trace_event_desc *trace_event_desc(u16 id)\n" \
+		"{\n"								\
+		     desc_fields						\
+		"  static const struct ngnfs_trace_event_desc descs[] = {\n"	\
+		     desc_events						\
+		"  };\n"							\
+		"\n"								\
+		"  return (id > 0 && id < NGNFS_TRACE_EVENT_NR) ? &descs[id] : NULL;\n" \
+		"}"
 }
@@ -17,6 +17,10 @@
  * initially dirtied.  Background memory pressure or explicit cache sync
  * operations can trigger writeback.
  *
+ * Callers can free ranges of blocks that they'll no longer use.  The
+ * frees are gathered and passed to the transport as merged extents to
+ * discard so that devices can reclaim the space.
+ *
  * XXX:
  *  - This doesn't yet support exclusive read and write references.
  *    Some callers won't have serialization of operations do we'll be
@@ -39,15 +43,19 @@
 #include "shared/lk/list.h"
 #include "shared/lk/llist.h"
 #include "shared/lk/minmax.h"
+#include "shared/lk/mutex.h"
 #include "shared/lk/processor.h"
 #include "shared/lk/rcupdate.h"
 #include "shared/lk/rhashtable.h"
+#include "shared/lk/rwonce.h"
+#include "shared/lk/sort.h"
 #include "shared/lk/wait.h"
 #include "shared/lk/workqueue.h"
 
 #include "shared/format-block.h"
 #include "shared/fs_info.h"
 #include "shared/block.h"
+#include "shared/stats.h"
 #include "shared/urcu.h"
 #include "shared/trace.h"
 
@@ -72,6 +80,40 @@
  */
 #define SET_LIMIT	64
 
+/*
+ * Blocks waiting to be submitted are queued in lanes.  Reads have
+ * callers blocked waiting for them so they're submitted before
+ * background writeback.  Writeback is given at least a share (1 <<
+ * SUBMIT_WRITE_SHARE_SHIFT) of the free queue depth so that it can't be
+ * starved by a steady stream of reads.
+ */
+enum {
+	SUBMIT_READ = 0,
+	SUBMIT_WRITE,
+	SUBMIT__NR,
+};
+
+#define SUBMIT_WRITE_SHARE_SHIFT	2
+
+/*
+ * Freed extents are discarded once this many have gathered, or when a
+ * sync starts.  Freeing waits for the discard work once the limit of
+ * pending extents is reached.
+ *
+ * The discard work hands the transport a pass of all the gathered
+ * extents at a time and only starts the next pass once the transport
+ * has finished the last.  The freed and discarded seqs count blocks in
+ * the order they were gathered so a sync only has to wait for the
+ * discarded seq to reach the freed seq at the time it started.
+ */
+#define FREE_BATCH	64
+#define FREE_LIMIT	256
+
+struct block_extent {
+	u64 bnr;
+	u64 nr;
+};
+
 struct ngnfs_block_info {
 	struct rhashtable ht;
 
@@ -80,20 +122,34 @@ struct ngnfs_block_info {
 	atomic_t nr_writeback;
 	atomic_t nr_submitted;
 	atomic_t sync_waiters;
+	atomic64_t nr_discarding;
 
 	atomic64_t dirty_seq;
 	atomic64_t writeback_seq;
 	atomic64_t sync_seq;
+	atomic64_t freed_seq;
+	atomic64_t discarded_seq;
 
-	struct llist_head submit_llist;
-	struct list_head submit_list;
+	struct llist_head submit_llist[SUBMIT__NR];
+	struct list_head submit_list[SUBMIT__NR];
 	struct llist_head writeback_llist;
 	struct list_head writeback_list;
 
+	struct mutex sync_cont_mutex;
+	struct list_head sync_cont_list;
+
+	struct mutex free_mutex;
+	unsigned int nr_free_exts;
+	struct block_extent free_exts[FREE_LIMIT];
+	/* only used by the discard work */
+	struct block_extent discard_exts[FREE_LIMIT];
+	u64 discard_end_seq;
+
 	struct ngnfs_fs_info *nfi;
 	struct workqueue_struct *wq;
 	struct work_struct submit_work;
 	struct work_struct writeback_work;
+	struct work_struct discard_work;
 
 	struct ngnfs_block_transport_ops *btr_ops;
 	void *btr_info;
@@ -147,6 +203,7 @@ struct ngnfs_block {
 	struct llist_node submit_llnode;
 	struct list_head submit_head;
 	struct list_head set_head;
+	struct llist_head cont_llist;
 	wait_queue_head_t waitq;
 	unsigned long bits; /* BL_ block bits */
 	int error;
@@ -181,6 +238,7 @@ enum {
 /* declaring these as we want their wake logic along side the work logic */
 static void try_queue_submit_work(struct ngnfs_block_info *blinf);
 static void try_queue_writeback_work(struct ngnfs_block_info *blinf);
+static void try_queue_discard_work(struct ngnfs_block_info *blinf);
 
 static inline void clear_bit_and_wake_up(int nr, unsigned long *bits, wait_queue_head_t *wq)
 {
@@ -216,6 +274,7 @@ static struct ngnfs_block *alloc_block(u64 bnr)
 		init_llist_node(&bl->submit_llnode);
 		INIT_LIST_HEAD(&bl->submit_head);
 		INIT_LIST_HEAD(&bl->set_head);
+		init_llist_head(&bl->cont_llist);
 		init_waitqueue_head(&bl->waitq);
 
 		bl->page = alloc_page(GFP_NOFS);
@@ -319,6 +378,11 @@ static int sync_waiters_dec_error(struct ngnfs_block_info *blinf)
  * caller's sync if their seqs haven't started writeback yet.  We then
  * wait for them to start and for there to be no more blocks in flight.
  *
+ * Sync also waits for all the blocks that were freed before it started
+ * to be discarded so that callers can reuse them without a discard
+ * racing with their writes.  Blocks freed after the sync started don't
+ * hold it up.
+ *
  * We use a sort of latched sync error state.  While there are sync
  * waiters we record IO errors for all the waiters. Only once all the
  * waiters leave is the error cleared.
@@ -327,8 +391,9 @@ static int sync_waiters_dec_error(struct ngnfs_block_info *blinf)
  * the broadcasting of errors to all waiters are great, but it makes for
  * a simple initial implementation.
  */
-static int sync_up_to_seq(struct ngnfs_block_info *blinf, u64 seq)
+static u64 start_sync(struct ngnfs_block_info *blinf, u64 seq)
 {
+	u64 free_seq;
 	u64 sync_seq;
 
 	sync_waiters_inc(blinf);
@@ -341,15 +406,67 @@ static int sync_up_to_seq(struct ngnfs_block_info *blinf, u64 seq)
 	if (seq > sync_seq)
 		try_queue_writeback_work(blinf);
 
+	smp_mb(); /* inc sync waiters before testing frees, pairs with _free */
+	free_seq = atomic64_read(&blinf->freed_seq);
+	try_queue_discard_work(blinf);
+
 	trace_ngnfs_sync_begin(seq);
 
-	wait_event(&blinf->waitq, sync_waiters_has_error(blinf) ||
-		   (atomic64_read(&blinf->writeback_seq) >= seq &&
-		    atomic_read(&blinf->nr_writeback) == 0));
+	return free_seq;
+}
+
+static bool sync_done(struct ngnfs_block_info *blinf, u64 seq, u64 free_seq)
+{
+	return sync_waiters_has_error(blinf) ||
+	       (atomic64_read(&blinf->writeback_seq) >= seq &&
+		atomic_read(&blinf->nr_writeback) == 0 &&
+		atomic64_read(&blinf->discarded_seq) >= free_seq);
+}
+
+static int sync_up_to_seq(struct ngnfs_block_info *blinf, u64 seq)
+{
+	u64 free_seq;
+
+	free_seq = start_sync(blinf, seq);
+
+	wait_event(&blinf->waitq, sync_done(blinf, seq, free_seq));
 
 	return sync_waiters_dec_error(blinf);
 }
 
+/*
+ * Call the continuations of async syncs whose seqs have been written.
+ * This is called after anything that could satisfy a sync: completing
+ * a set's writeback, advancing the writeback seq, or recording an
+ * error.  The unlocked empty test is ordered after the caller's change
+ * by the barrier and a racing adder will check the list itself after
+ * adding its continuation.
+ */
+static void run_sync_conts(struct ngnfs_block_info *blinf)
+{
+	struct ngnfs_block_cont *cont;
+	struct ngnfs_block_cont *tmp;
+	LIST_HEAD(list);
+	int err;
+
+	smp_mb(); /* caller's state change before testing list */
+	if (list_empty(&blinf->sync_cont_list))
+		return;
+
+	mutex_lock(&blinf->sync_cont_mutex);
+	list_for_each_entry_safe(cont, tmp, &blinf->sync_cont_list, head) {
+		if (sync_done(blinf, cont->seq, cont->free_seq))
+			list_move_tail(&cont->head, &list);
+	}
+	mutex_unlock(&blinf->sync_cont_mutex);
+
+	list_for_each_entry_safe(cont, tmp, &list, head) {
+		list_del_init(&cont->head);
+		err = sync_waiters_dec_error(blinf);
+		cont->func(blinf->nfi, cont, err);
+	}
+}
+
 static const struct rhashtable_params ngnfs_block_ht_params = {
         .head_offset = offsetof(struct ngnfs_block, rhead),
         .key_offset = offsetof(struct ngnfs_block, bnr),
@@ -400,6 +517,70 @@ static struct ngnfs_block *lookup_or_alloc_block(struct ngnfs_block_info *blinf,
 	return bl;
 }
 
+/*
+ * Callers are gathering items that were concurrently appended to a
+ * lockless list (llist) and putting them on a private list_head list
+ * for private use.  We'd like to preserve list order so we walk the
+ * llist lifo and construct a private fifo that is then spliced onto the
+ * end of the caller's existing list.
+ *
+ * This doesn't remove/initialize the llist nodes.  The caller will do
+ * that as they iterate over the items the private list.
+ */
+static void del_all_reverse_add_tail(struct list_head *list, struct llist_head *llist,
+				     ssize_t offset)
+{
+	struct llist_node *node;
+	struct llist_node *pos;
+	struct list_head *head;
+	LIST_HEAD(reverse);
+
+	node = llist_del_all(llist);
+	if (node) {
+		llist_for_each(pos, node) {
+			head = (void *)pos + offset;
+			list_add(head, &reverse);
+		}
+		list_splice_tail(&reverse, list);
+	}
+}
+
+/*
+ * Call a get continuation once its block is no longer reading.  The
+ * reference acquired for the continuation is passed to it, or dropped
+ * if the read failed.
+ */
+static void finish_block_cont(struct ngnfs_block_info *blinf, struct ngnfs_block_cont *cont)
+{
+	struct ngnfs_block *bl = cont->bl;
+	int err = 0;
+
+	if (test_bit(BL_ERROR, &bl->bits)) {
+		err = bl->error;
+		put_block(bl);
+		cont->bl = NULL;
+	}
+
+	cont->func(blinf->nfi, cont, err);
+}
+
+static void run_block_conts(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
+{
+	struct ngnfs_block_cont *cont;
+	struct ngnfs_block_cont *tmp;
+	LIST_HEAD(list);
+
+	del_all_reverse_add_tail(&list, &bl->cont_llist,
+				 offsetof(struct ngnfs_block_cont, head) -
+				 offsetof(struct ngnfs_block_cont, llnode));
+
+	list_for_each_entry_safe(cont, tmp, &list, head) {
+		list_del_init(&cont->head);
+		init_llist_node(&cont->llnode);
+		finish_block_cont(blinf, cont);
+	}
+}
+
 /*
  * If data_page is provided then it is a new page that the io transport
  * allocated to store an incoming read.  We swap it in to place and drop
@@ -421,14 +602,30 @@ static void end_read_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl,
 
 	smp_wmb(); /* set error|uptodate before clearing reading */
 	clear_bit_and_wake_up(BL_READING, &bl->bits, &bl->waitq);
+
+	smp_mb(); /* clear reading before testing continuations, pairs with _get_cont */
+	if (!llist_empty(&bl->cont_llist))
+		run_block_conts(blinf, bl);
 }
 
+/*
+ * The effects of a batch of completions on the cache's global state are
+ * gathered and applied once after all the blocks in the batch have
+ * been completed.
+ */
+struct end_io_batch {
+	int nr_writeback;
+	bool sets_done;
+	bool errored;
+};
+
 /*
  * Finish write IO on a block in a set.  Once all the blocks are written
  * we clear all the block's association with the set, clear its
  * dirtying, and put it.
  */
-static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
+static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl,
+			 struct end_io_batch *batch)
 {
 	struct ngnfs_block_set *set = rcu_dereference(bl->set);
 	struct ngnfs_block *tmp;
@@ -439,12 +636,13 @@ static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
 	BUG_ON(test_bit(BL_ERROR, &bl->bits));
 
 	/* each finished block gives room for more writeback in the queue depth */
-	atomic_dec(&blinf->nr_writeback);
-	try_queue_writeback_work(blinf);
+	batch->nr_writeback++;
 
 	if (atomic_dec_return(&set->submitted_blocks) > 0)
 		return;
 
+	trace_ngnfs_writeback_set_end(set->dirty_seq, set->size);
+
 	atomic_sub(set->size, &blinf->nr_dirty);
 	set->size = 0;
 
@@ -465,104 +663,200 @@ static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
 	put_set(set);
 
 	/* finishing the whole set could wake sync or dirty waiters */
-	if (waitqueue_active(&blinf->waitq))
-		wake_up(&blinf->waitq);
+	batch->sets_done = true;
 }
 
 /*
  * An incoming data_page ref is only used for reads. Writes always
  * manage source page that contains their written contents.
  */
-void ngnfs_block_end_io(struct ngnfs_fs_info *nfi, u64 bnr, struct page *data_page, int err)
+static void end_io_block(struct ngnfs_block_info *blinf, u64 bnr, struct page *data_page,
+			 int err, struct end_io_batch *batch)
 {
-	struct ngnfs_block_info *blinf = nfi->block_info;
 	struct ngnfs_block *bl;
 
 	/* XXX describe trying page granular pinning */
 
+	trace_ngnfs_block_end_io(bnr, err);
+
 	bl = lookup_block(blinf, bnr);
 	assert(!IS_ERR_OR_NULL(bl)); /* not supporting this failure yet */
 
 	/* XXX not sure what this means for writeback errors */
 	if (err < 0) {
+		stats_inc(STAT_BLOCK_IO_ERRORS);
 		set_bit(BL_ERROR, &bl->bits);
 		bl->error = err;
 		sync_waiters_set_error(blinf);
+		batch->errored = true;
 	}
 
 	if (test_bit(BL_READING, &bl->bits))
 		end_read_io(blinf, bl, data_page);
 	else
-		end_write_io(blinf, bl);
+		end_write_io(blinf, bl, batch);
 
 	put_block(bl);
 }
 
 /*
- * Callers are gathering items that were concurrently appended to a
- * lockless list (llist) and putting them on a private list_head list
- * for private use.  We'd like to preserve list order so we walk the
- * llist lifo and construct a private fifo that is then spliced onto the
- * end of the caller's existing list.
- *
- * This doesn't remove/initialize the llist nodes.  The caller will do
- * that as they iterate over the items the private list.
+ * Complete a batch of block IOs.  Each block's waiters and
+ * continuations are woken as it's completed, but the queue depth
+ * accounting, waking sync and dirty waiters, and queueing work is only
+ * done once for the whole batch.
  */
-static void del_all_reverse_add_tail(struct list_head *list, struct llist_head *llist,
-				     ssize_t offset)
+void ngnfs_block_end_io_batch(struct ngnfs_fs_info *nfi, struct ngnfs_block_io_result *res,
+			      unsigned int nr)
 {
-	struct llist_node *node;
-	struct llist_node *pos;
-	struct list_head *head;
-	LIST_HEAD(reverse);
+	struct ngnfs_block_info *blinf = nfi->block_info;
+	struct end_io_batch batch = { 0, };
+	unsigned int i;
 
-	node = llist_del_all(llist);
-	if (node) {
-		llist_for_each(pos, node) {
-			head = (void *)pos + offset;
-			list_add(head, &reverse);
-		}
-		list_splice_tail(&reverse, list);
+	for (i = 0; i < nr; i++)
+		end_io_block(blinf, res[i].bnr, res[i].data_page, res[i].err, &batch);
+
+	if (batch.nr_writeback > 0) {
+		atomic_sub(batch.nr_writeback, &blinf->nr_writeback);
+		try_queue_writeback_work(blinf);
 	}
+
+	if (batch.sets_done && waitqueue_active(&blinf->waitq))
+		wake_up(&blinf->waitq);
+	if (batch.sets_done || batch.errored)
+		run_sync_conts(blinf);
+
+	/* each completion makes room in the queue depth for another submission */
+	atomic_sub(nr, &blinf->nr_submitted);
+	try_queue_submit_work(blinf);
+}
+
+void ngnfs_block_end_io(struct ngnfs_fs_info *nfi, u64 bnr, struct page *data_page, int err)
+{
+	struct ngnfs_block_io_result res = {
+		.bnr = bnr,
+		.data_page = data_page,
+		.err = err,
+	};
+
+	ngnfs_block_end_io_batch(nfi, &res, 1);
 }
 
 /*
- * The submit work is responsible for keeping the backend's queue depth
- * full.  This is only concerned with the IO submission pipeline,
- * callers (particularly batch submission preparation) manage higher
- * order concepts like atomic writes.
+ * Discards are advisory, a failed discard only leaves the space
+ * allocated in the device.  We just have to let sync know when each
+ * pass of freed blocks is finished and start the next pass.
  */
-static void ngnfs_block_submit_work(struct work_struct *work)
+void ngnfs_block_end_discard(struct ngnfs_fs_info *nfi, u64 nr, int err)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+
+	if (atomic64_add_return(-nr, &blinf->nr_discarding) == 0) {
+		atomic64_set(&blinf->discarded_seq, blinf->discard_end_seq);
+		smp_mb(); /* store discarded before testing waiters */
+		if (waitqueue_active(&blinf->waitq))
+			wake_up(&blinf->waitq);
+		run_sync_conts(blinf);
+		try_queue_discard_work(blinf);
+	}
+}
+
+void ngnfs_block_kick_submit(struct ngnfs_fs_info *nfi)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+
+	queue_work(blinf->wq, &blinf->submit_work);
+}
+
+static int submit_lane(struct ngnfs_block_info *blinf, int lane, int space)
 {
-	struct ngnfs_block_info *blinf = container_of(work, struct ngnfs_block_info, submit_work);
 	struct ngnfs_fs_info *nfi = blinf->nfi;
 	struct ngnfs_block *tmp;
 	struct ngnfs_block *bl;
-	int space;
+	int submitted = 0;
 	int ret;
 	int op;
 
-	del_all_reverse_add_tail(&blinf->submit_list, &blinf->submit_llist,
-				 offsetof(struct ngnfs_block, submit_head) -
-				 offsetof(struct ngnfs_block, submit_llnode));
-	space = blinf->queue_depth - atomic_read(&blinf->nr_submitted);
+	/* XXX _GET_WRITE isn't operational yet */
+	op = lane == SUBMIT_READ ? NGNFS_BTX_OP_GET_READ : NGNFS_BTX_OP_WRITE;
 
-	list_for_each_entry_safe(bl, tmp, &blinf->submit_list, submit_head) {
-		if (space-- < 0)
+	list_for_each_entry_safe(bl, tmp, &blinf->submit_list[lane], submit_head) {
+		if (submitted >= space)
 			break;
 
 		init_llist_node(&bl->submit_llnode);
 		list_del_init(&bl->submit_head);
 
-		/* XXX _GET_WRITE isn't operational yet */
-		op = test_bit(BL_READING, &bl->bits) ? NGNFS_BTX_OP_GET_READ : NGNFS_BTX_OP_WRITE;
-
 		atomic_inc(&blinf->nr_submitted);
+		trace_ngnfs_block_submit(bl->bnr, op);
 		ret = blinf->btr_ops->submit_block(nfi, blinf->btr_info, op, bl->bnr, bl->page);
 		BUG_ON(ret != 0);
 
 		put_block(bl);
+		submitted++;
 	}
+
+	return submitted;
+}
+
+/*
+ * The submit work is responsible for keeping the backend's queue depth
+ * full.  This is only concerned with the IO submission pipeline,
+ * callers (particularly batch submission preparation) manage higher
+ * order concepts like atomic writes.
+ *
+ * The transport's queue depth can change as it learns more about its
+ * capacity (messaging peers granting credits, say) so we refresh it
+ * each time we submit.
+ *
+ * The free queue depth is divided between the submission lanes as
+ * described above SUBMIT_READ.  Either lane can use the space that the
+ * other doesn't.
+ */
+static void ngnfs_block_submit_work(struct work_struct *work)
+{
+	struct ngnfs_block_info *blinf = container_of(work, struct ngnfs_block_info, submit_work);
+	struct ngnfs_fs_info *nfi = blinf->nfi;
+	int reserve;
+	int space;
+	int ret;
+	int i;
+
+	for (i = 0; i < SUBMIT__NR; i++)
+		del_all_reverse_add_tail(&blinf->submit_list[i], &blinf->submit_llist[i],
+					 offsetof(struct ngnfs_block, submit_head) -
+					 offsetof(struct ngnfs_block, submit_llnode));
+
+	WRITE_ONCE(blinf->queue_depth, blinf->btr_ops->queue_depth(nfi, blinf->btr_info));
+	space = blinf->queue_depth - atomic_read(&blinf->nr_submitted);
+
+	/* reads first, then writeback's share and whatever reads left, then the rest */
+	if (space > 0) {
+		if (list_empty(&blinf->submit_list[SUBMIT_WRITE]))
+			reserve = 0;
+		else
+			reserve = max(space >> SUBMIT_WRITE_SHARE_SHIFT, 1);
+
+		space -= submit_lane(blinf, SUBMIT_READ, space - reserve);
+		space -= submit_lane(blinf, SUBMIT_WRITE, space);
+		space -= submit_lane(blinf, SUBMIT_READ, space);
+	}
+
+	if (blinf->btr_ops->submit_flush) {
+		ret = blinf->btr_ops->submit_flush(nfi, blinf->btr_info);
+		BUG_ON(ret != 0);
+	}
+}
+
+static bool submit_pending(struct ngnfs_block_info *blinf)
+{
+	int i;
+
+	for (i = 0; i < SUBMIT__NR; i++) {
+		if (!list_empty(&blinf->submit_list[i]) || !llist_empty(&blinf->submit_llist[i]))
+			return true;
+	}
+
+	return false;
 }
 
 /*
@@ -570,8 +864,8 @@ static void ngnfs_block_submit_work(struct work_struct *work)
  */
 static void try_queue_submit_work(struct ngnfs_block_info *blinf)
 {
-	if ((!list_empty(&blinf->submit_list) || !llist_empty(&blinf->submit_llist)) &&
-	    (atomic_read(&blinf->nr_submitted) < blinf->queue_depth))
+	if (submit_pending(blinf) &&
+	    (atomic_read(&blinf->nr_submitted) < READ_ONCE(blinf->queue_depth)))
 		queue_work(blinf->wq, &blinf->submit_work);
 }
 
@@ -587,7 +881,7 @@ static bool should_writeback(struct ngnfs_block_info *blinf)
 
 	return (atomic64_read(&blinf->sync_seq) > atomic64_read(&blinf->writeback_seq) ||
 		((dirty - writeback) >= WRITEBACK_THRESH)) &&
-	       (writeback < blinf->queue_depth);
+	       (writeback < READ_ONCE(blinf->queue_depth));
 }
 
 static void try_queue_writeback_work(struct ngnfs_block_info *blinf)
@@ -625,12 +919,17 @@ static void ngnfs_block_writeback_work(struct work_struct *work)
 		smp_mb(); /* set writeback before testing dirtying */
 		if (test_bit(SET_DIRTYING, &set->bits)) {
 			clear_bit_and_wake_up(SET_WRITEBACK, &set->bits, &set->waitq);
+			trace_ngnfs_writeback_wait_dirtying_begin(set->dirty_seq);
 			wait_event(&set->waitq, !test_bit(SET_DIRTYING, &set->bits));
+			trace_ngnfs_writeback_wait_dirtying_end(set->dirty_seq);
 			break;
 		}
 
 		/* list presence ref passes to end_io, get ref to protect block iteration */
 		list_del_init(&set->writeback_head);
+		trace_ngnfs_writeback_set_begin(set->dirty_seq, set->size);
+		stats_inc(STAT_BLOCK_WRITEBACK_SETS);
+		stats_add(STAT_BLOCK_WRITEBACK_BLOCKS, set->size);
 		if (set->size > 0) {
 			atomic_add(set->size, &blinf->nr_writeback);
 			atomic_add(set->size, &set->submitted_blocks);
@@ -645,7 +944,7 @@ static void ngnfs_block_writeback_work(struct work_struct *work)
 
 			list_for_each_entry(bl, &set->block_list, set_head) {
 				get_block(bl);
-				llist_add(&bl->submit_llnode, &blinf->submit_llist);
+				llist_add(&bl->submit_llnode, &blinf->submit_llist[SUBMIT_WRITE]);
 			}
 			try_queue_submit_work(blinf);
 		}
@@ -653,6 +952,104 @@ static void ngnfs_block_writeback_work(struct work_struct *work)
 		atomic64_inc(&blinf->writeback_seq);
 		put_set(set);
 	}
+
+	/* empty sets advance the writeback seq without any io completion */
+	run_sync_conts(blinf);
+}
+
+static int cmp_extents(const void *a, const void *b, const void *priv)
+{
+	const struct block_extent *a_ext = a;
+	const struct block_extent *b_ext = b;
+
+	return a_ext->bnr < b_ext->bnr ? -1 : a_ext->bnr > b_ext->bnr ? 1 : 0;
+}
+
+/*
+ * Start a pass once the last has finished and either enough extents
+ * have gathered or a sync is waiting for them.  Frees can be waiting
+ * for room in the extents but that only happens once a batch has
+ * gathered.
+ */
+static void try_queue_discard_work(struct ngnfs_block_info *blinf)
+{
+	if (atomic64_read(&blinf->nr_discarding) == 0 &&
+	    (READ_ONCE(blinf->nr_free_exts) >= FREE_BATCH ||
+	     (atomic_read(&blinf->sync_waiters) >= SYNC_WAITERS_INC &&
+	      atomic64_read(&blinf->freed_seq) > atomic64_read(&blinf->discarded_seq))))
+		queue_work(blinf->wq, &blinf->discard_work);
+}
+
+/*
+ * The discard work takes all the pending freed extents, sorts and
+ * merges them, and hands the merged extents to the transport.  The
+ * pass is finished once the transport has finished all the merged
+ * blocks, blocks that were freed more than once are only discarded
+ * once.  The pass holds an extra count while it's submitting so that
+ * it can't finish before it has submitted all its extents.
+ */
+static void ngnfs_block_discard_work(struct work_struct *work)
+{
+	struct ngnfs_block_info *blinf = container_of(work, struct ngnfs_block_info,
+						      discard_work);
+	struct ngnfs_fs_info *nfi = blinf->nfi;
+	struct block_extent *exts = blinf->discard_exts;
+	struct block_extent *ext;
+	unsigned int nr;
+	unsigned int i;
+	u64 merged = 0;
+	u64 end_seq;
+	u64 end;
+	int ret;
+
+	/* the end of the last pass queues us again */
+	if (atomic64_read(&blinf->nr_discarding) > 0)
+		return;
+
+	mutex_lock(&blinf->free_mutex);
+	nr = blinf->nr_free_exts;
+	memcpy(exts, blinf->free_exts, nr * sizeof(exts[0]));
+	blinf->nr_free_exts = 0;
+	end_seq = atomic64_read(&blinf->freed_seq);
+	mutex_unlock(&blinf->free_mutex);
+
+	if (nr == 0)
+		return;
+
+	smp_mb(); /* empty free extents before testing waiters */
+	if (waitqueue_active(&blinf->waitq))
+		wake_up(&blinf->waitq);
+
+	sort_r(exts, nr, sizeof(exts[0]), cmp_extents, NULL, NULL);
+
+	for (i = 1, ext = &exts[0]; i < nr; i++) {
+		if (exts[i].bnr <= ext->bnr + ext->nr) {
+			end = max(ext->bnr + ext->nr, exts[i].bnr + exts[i].nr);
+			ext->nr = end - ext->bnr;
+		} else {
+			*(++ext) = exts[i];
+		}
+	}
+	nr = ext - exts + 1;
+
+	for (i = 0; i < nr; i++)
+		merged += exts[i].nr;
+
+	blinf->discard_end_seq = end_seq;
+	atomic64_set(&blinf->nr_discarding, merged + 1);
+
+	for (i = 0; i < nr; i++) {
+		ret = blinf->btr_ops->submit_discard(nfi, blinf->btr_info, exts[i].bnr, exts[i].nr);
+		if (ret < 0)
+			ngnfs_block_end_discard(nfi, exts[i].nr, ret);
+	}
+
+	if (blinf->btr_ops->submit_flush) {
+		ret = blinf->btr_ops->submit_flush(nfi, blinf->btr_info);
+		BUG_ON(ret != 0);
+	}
+
+	ngnfs_block_end_discard(nfi, 1, 0);
 }
 
 static bool bad_nbf(nbf_t nbf)
@@ -660,6 +1057,44 @@ static bool bad_nbf(nbf_t nbf)
 	return hweight_long(nbf & NBF_RW_EXCL) > 1;
 }
 
+/*
+ * Get a referenced block and start reading it if it isn't uptodate.
+ * The caller waits for the read to finish before using the block.
+ */
+static struct ngnfs_block *start_get(struct ngnfs_block_info *blinf, u64 bnr, nbf_t nbf)
+{
+	struct ngnfs_block *bl;
+
+	if (WARN_ON_ONCE(bad_nbf(nbf)))
+		return ERR_PTR(-EINVAL);
+
+	bl = lookup_or_alloc_block(blinf, bnr);
+	if (IS_ERR(bl))
+		return bl;
+
+	/* XXX also drop dirty?  hmm. */
+	if ((nbf & NBF_NEW)) {
+		memset(ngnfs_block_buf(bl), 0, NGNFS_BLOCK_SIZE);
+		set_bit(BL_UPTODATE, &bl->bits);
+	}
+
+	if (test_bit(BL_UPTODATE, &bl->bits)) {
+		trace_ngnfs_block_get_hit(bnr, nbf);
+		stats_inc(STAT_BLOCK_GET_HIT);
+	} else {
+		trace_ngnfs_block_get_miss(bnr, nbf);
+		stats_inc(STAT_BLOCK_GET_MISS);
+	}
+
+	if (!test_bit(BL_UPTODATE, &bl->bits) && !test_and_set_bit(BL_READING, &bl->bits)) {
+		get_block(bl); /* presence on submit lists before hitting transport */
+		llist_add(&bl->submit_llnode, &blinf->submit_llist[SUBMIT_READ]);
+		try_queue_submit_work(blinf);
+	}
+
+	return bl;
+}
+
 /*
  * Acquire a reference to a cached block.  The behaviour of the
  * reference is defined by the block flags as documented at the nbf_t
@@ -675,30 +1110,12 @@ struct ngnfs_block *ngnfs_block_get(struct ngnfs_fs_info *nfi, u64 bnr, nbf_t nb
 	struct ngnfs_block *bl;
 	int err;
 
-	if (WARN_ON_ONCE(bad_nbf(nbf))) {
-		bl = ERR_PTR(-EINVAL);
-		goto out;
-	}
-
-	bl = lookup_or_alloc_block(blinf, bnr);
+	bl = start_get(blinf, bnr, nbf);
 	if (IS_ERR(bl))
 		goto out;
 
-	/* XXX also drop dirty?  hmm. */
-	if ((nbf & NBF_NEW)) {
-		memset(ngnfs_block_buf(bl), 0, NGNFS_BLOCK_SIZE);
-		set_bit(BL_UPTODATE, &bl->bits);
-	}
-
-	if (!test_bit(BL_UPTODATE, &bl->bits)) {
-		if (!test_and_set_bit(BL_READING, &bl->bits)) {
-			get_block(bl); /* presence on submit lists before hitting transport */
-			llist_add(&bl->submit_llnode, &blinf->submit_llist);
-			try_queue_submit_work(blinf);
-		}
-
+	if (!test_bit(BL_UPTODATE, &bl->bits))
 		wait_event(&bl->waitq, !test_bit(BL_READING, &bl->bits));
-	}
 
 	if (test_bit(BL_ERROR, &bl->bits)) {
 		err = bl->error;
@@ -709,6 +1126,39 @@ out:
 	return bl;
 }
 
+/*
+ * Acquire a block reference like _get() but call the continuation once
+ * the block is ready instead of waiting.  The continuation can be
+ * called before this returns or later from the IO completion path.  On
+ * success the continuation's bl has a reference that it must put,
+ * otherwise bl is NULL and the error is passed in.
+ */
+void ngnfs_block_get_cont(struct ngnfs_fs_info *nfi, u64 bnr, nbf_t nbf,
+			  struct ngnfs_block_cont *cont)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+	struct ngnfs_block *bl;
+
+	bl = start_get(blinf, bnr, nbf);
+	if (IS_ERR(bl)) {
+		cont->bl = NULL;
+		cont->func(nfi, cont, PTR_ERR(bl));
+		return;
+	}
+
+	cont->bl = bl;
+
+	if (test_bit(BL_UPTODATE, &bl->bits)) {
+		finish_block_cont(blinf, cont);
+		return;
+	}
+
+	llist_add(&cont->llnode, &bl->cont_llist);
+	smp_mb(); /* add continuation before testing reading, pairs with end_read_io */
+	if (!test_bit(BL_READING, &bl->bits))
+		run_block_conts(blinf, bl);
+}
+
 void ngnfs_block_put(struct ngnfs_block *bl)
 {
 	put_block(bl);
@@ -724,6 +1174,50 @@ struct page *ngnfs_block_page(struct ngnfs_block *bl)
 	return bl->page;
 }
 
+/*
+ * Return a reference to the block's page that remains valid even if
+ * the page is swapped out of the block by a writer.  The caller must
+ * put the page.
+ */
+struct page *ngnfs_block_get_page(struct ngnfs_block *bl)
+{
+	struct page *page;
+
+	rcu_read_lock();
+	page = rcu_dereference(bl->page);
+	get_page(page);
+	rcu_read_unlock();
+
+	return page;
+}
+
+/*
+ * Use the caller's page as the block's contents instead of copying it.
+ * The block gets its own reference to the page and the caller must not
+ * modify it after this.  The caller must be modifying the block between
+ * _dirty_begin and _dirty_end so the block can't be under writeback.
+ * Returns false if the caller should copy instead because the block
+ * is still reading, whose completion would swap in the read page.
+ *
+ * The old page is put after a grace period so that _get_page() callers
+ * can race with the swap.  Callers who only use the block's buf with a
+ * block reference would see the page change beneath them.
+ */
+bool ngnfs_block_swap_page(struct ngnfs_block *bl, struct page *page)
+{
+	struct page *old;
+
+	if (WARN_ON_ONCE(!test_bit(BL_DIRTY, &bl->bits)) || test_bit(BL_READING, &bl->bits))
+		return false;
+
+	get_page(page);
+	old = bl->page;
+	rcu_assign_pointer(bl->page, page);
+	put_page_rcu(old);
+
+	return true;
+}
+
 /*
  * Get a reference to a block's set if it's different than the caller's.
  * If the block doesn't have a set then we either add it to the caller's
@@ -861,6 +1355,8 @@ int ngnfs_block_dirty_begin(struct ngnfs_fs_info *nfi, struct list_head *list, s
 		return 0;
 
 	/* XXX probably interruptible, io errors won't clear dirty */
+	if (atomic_read(&blinf->nr_dirty) >= DIRTY_LIMIT)
+		stats_inc(STAT_BLOCK_DIRTY_LIMIT_WAITS);
 	wait_event(&blinf->waitq, atomic_read(&blinf->nr_dirty) < DIRTY_LIMIT);
 
 restart:
@@ -886,7 +1382,10 @@ restart:
 		if (test_and_set_bit(SET_DIRTYING, &small->bits)) {
 			if (large)
 				clear_set_dirtying(blinf, large);
+			trace_ngnfs_block_wait_dirtying_begin(bl->bnr, small->dirty_seq);
 			wait_event(&small->waitq, !test_bit(SET_DIRTYING, &small->bits));
+			trace_ngnfs_block_wait_dirtying_end(bl->bnr, small->dirty_seq);
+			stats_inc(STAT_BLOCK_DIRTY_RESTARTS);
 			goto restart;
 		}
 
@@ -897,7 +1396,10 @@ restart:
 			clear_set_dirtying(blinf, small);
 			if (large)
 				clear_set_dirtying(blinf, large);
+			trace_ngnfs_block_wait_writeback_begin(bl->bnr, small->dirty_seq);
 			wait_event(&small->waitq, !test_bit(SET_WRITEBACK, &small->bits));
+			trace_ngnfs_block_wait_writeback_end(bl->bnr, small->dirty_seq);
+			stats_inc(STAT_BLOCK_DIRTY_RESTARTS);
 			goto restart;
 		}
 
@@ -928,6 +1430,7 @@ restart:
 			ret = sync_up_to_seq(blinf, seq);
 			if (ret < 0)
 				goto out;
+			stats_inc(STAT_BLOCK_DIRTY_RESTARTS);
 			goto restart;
 		}
 
@@ -950,6 +1453,7 @@ restart:
 			break;
 		set_bit(BL_DIRTY, &bl->bits);
 		atomic_inc(&blinf->nr_dirty);
+		stats_inc(STAT_BLOCK_DIRTIED);
 	}
 
 	/* initially mark set as dirty and establish its writeback position */
@@ -1006,11 +1510,77 @@ int ngnfs_block_sync(struct ngnfs_fs_info *nfi)
 	return sync_up_to_seq(blinf, atomic64_read(&blinf->dirty_seq));
 }
 
+/*
+ * The caller has freed a range of blocks that it won't use again.  The
+ * freed extent is merged with the previous free if it's adjacent and
+ * the discard work is queued once enough extents have gathered or if
+ * a sync is waiting.
+ *
+ * The caller must not reuse freed blocks until a sync started after
+ * the free has returned.
+ *
+ * XXX Freed blocks stay cached until they're reused with NBF_NEW.
+ */
+void ngnfs_block_free(struct ngnfs_fs_info *nfi, u64 bnr, u64 nr)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+	struct block_extent *ext;
+
+	if (!blinf->btr_ops->submit_discard || nr == 0)
+		return;
+
+	stats_add(STAT_BLOCK_FREED, nr);
+
+	mutex_lock(&blinf->free_mutex);
+	while (blinf->nr_free_exts == FREE_LIMIT) {
+		mutex_unlock(&blinf->free_mutex);
+		try_queue_discard_work(blinf);
+		wait_event(&blinf->waitq, READ_ONCE(blinf->nr_free_exts) < FREE_LIMIT);
+		mutex_lock(&blinf->free_mutex);
+	}
+
+	ext = blinf->nr_free_exts ? &blinf->free_exts[blinf->nr_free_exts - 1] : NULL;
+	if (ext && ext->bnr + ext->nr == bnr) {
+		ext->nr += nr;
+	} else {
+		ext = &blinf->free_exts[blinf->nr_free_exts++];
+		ext->bnr = bnr;
+		ext->nr = nr;
+	}
+	atomic64_add(nr, &blinf->freed_seq);
+	mutex_unlock(&blinf->free_mutex);
+
+	smp_mb(); /* store extent before testing sync waiters, pairs with start_sync */
+	try_queue_discard_work(blinf);
+}
+
+/*
+ * Start writing all the blocks that are dirty at the time of the call
+ * and call the continuation once they're written, or an error was
+ * recorded, instead of waiting.  The continuation can be called before
+ * this returns.
+ */
+void ngnfs_block_sync_cont(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+
+	cont->bl = NULL;
+	cont->seq = atomic64_read(&blinf->dirty_seq);
+	cont->free_seq = start_sync(blinf, cont->seq);
+
+	mutex_lock(&blinf->sync_cont_mutex);
+	list_add_tail(&cont->head, &blinf->sync_cont_list);
+	mutex_unlock(&blinf->sync_cont_mutex);
+
+	run_sync_conts(blinf);
+}
+
 int ngnfs_block_setup(struct ngnfs_fs_info *nfi, struct ngnfs_block_transport_ops *btr_ops,
 		      void *btr_setup_arg)
 {
 	struct ngnfs_block_info *blinf;
 	int ret;
+	int i;
 
 	blinf = kzalloc(sizeof(struct ngnfs_block_info), GFP_KERNEL);
 	if (!blinf)
@@ -1020,17 +1590,26 @@ int ngnfs_block_setup(struct ngnfs_fs_info *nfi, struct ngnfs_block_transport_op
 	atomic_set(&blinf->nr_writeback, 0);
 	atomic_set(&blinf->nr_submitted, 0);
 	atomic_set(&blinf->sync_waiters, 0);
+	atomic64_set(&blinf->nr_discarding, 0);
 	atomic64_set(&blinf->dirty_seq, 0);
 	atomic64_set(&blinf->writeback_seq, 0);
 	atomic64_set(&blinf->sync_seq, 0);
-	init_llist_head(&blinf->submit_llist);
-	INIT_LIST_HEAD(&blinf->submit_list);
+	atomic64_set(&blinf->freed_seq, 0);
+	atomic64_set(&blinf->discarded_seq, 0);
+	for (i = 0; i < SUBMIT__NR; i++) {
+		init_llist_head(&blinf->submit_llist[i]);
+		INIT_LIST_HEAD(&blinf->submit_list[i]);
+	}
 	init_llist_head(&blinf->writeback_llist);
 	INIT_LIST_HEAD(&blinf->writeback_list);
+	mutex_init(&blinf->sync_cont_mutex);
+	INIT_LIST_HEAD(&blinf->sync_cont_list);
+	mutex_init(&blinf->free_mutex);
 	blinf->nfi = nfi;
 	blinf->btr_ops = btr_ops;
 	INIT_WORK(&blinf->submit_work, ngnfs_block_submit_work);
 	INIT_WORK(&blinf->writeback_work, ngnfs_block_writeback_work);
+	INIT_WORK(&blinf->discard_work, ngnfs_block_discard_work);
 	init_waitqueue_head(&blinf->waitq);
 
 	if (blinf->btr_ops->setup) {
@@ -9,6 +9,7 @@ struct ngnfs_block;
 #include "shared/fs_info.h"
 #include "shared/lk/gfp.h"
 #include "shared/lk/list.h"
+#include "shared/lk/llist.h"
 #include "shared/lk/types.h"
 
 typedef enum {
@@ -31,8 +32,27 @@ enum {
 	NGNFS_BTX_OP_GET_READ,
 	NGNFS_BTX_OP_GET_WRITE,
 	NGNFS_BTX_OP_WRITE,
+	NGNFS_BTX_OP__NR,
 };
 
+/*
+ * ->submit_block is called for each block that the submit work finds
+ * ready for IO.  Transports can gather the blocks and issue them
+ * together once ->submit_flush is called after the submit work has
+ * finished its pass.  Transports that submit each block as it arrives
+ * can leave ->submit_flush NULL.
+ *
+ * ->submit_discard is called with merged extents of freed blocks
+ * followed by ->submit_flush.  The transport calls _end_discard with
+ * the number of blocks once it's done with them, or returns an error
+ * and the cache completes them.  Transports that can't discard leave it
+ * NULL and frees are ignored.
+ *
+ * Transports that hold back submitted blocks call _kick_submit once
+ * they can make progress so that the submit work calls ->submit_flush
+ * again.
+ */
+
 struct ngnfs_block_transport_ops {
 	void *(*setup)(struct ngnfs_fs_info *nfi, void *arg);
 	void (*shutdown)(struct ngnfs_fs_info *nfi, void *btr_info);
@@ -40,18 +60,65 @@ struct ngnfs_block_transport_ops {
 	int (*queue_depth)(struct ngnfs_fs_info *nfi, void *btr_info);
 	int (*submit_block)(struct ngnfs_fs_info *nfi, void *btr_info,
 			    int op, u64 bnr, struct page *data_page);
+	int (*submit_flush)(struct ngnfs_fs_info *nfi, void *btr_info);
+	int (*submit_discard)(struct ngnfs_fs_info *nfi, void *btr_info, u64 bnr, u64 nr);
+};
+
+/*
+ * Continuations let callers have a function called once a block
+ * operation is complete rather than blocking while waiting for it.
+ * The caller embeds the continuation in their request and the block
+ * cache calls the function from whichever context completes the
+ * operation, often the transport's IO completion.  Functions can't
+ * block and must not be queued on more than one operation at a time.
+ */
+struct ngnfs_block_cont {
+	struct llist_node llnode;
+	struct list_head head;
+	struct ngnfs_block *bl;
+	u64 seq;
+	u64 free_seq;
+	void (*func)(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont, int err);
 };
 
+static inline void ngnfs_block_cont_init(struct ngnfs_block_cont *cont,
+					 void (*func)(struct ngnfs_fs_info *nfi,
+						      struct ngnfs_block_cont *cont, int err))
+{
+	init_llist_node(&cont->llnode);
+	INIT_LIST_HEAD(&cont->head);
+	cont->bl = NULL;
+	cont->seq = 0;
+	cont->free_seq = 0;
+	cont->func = func;
+}
+
 struct ngnfs_block *ngnfs_block_get(struct ngnfs_fs_info *nfi, u64 bnr, nbf_t nbf);
+void ngnfs_block_get_cont(struct ngnfs_fs_info *nfi, u64 bnr, nbf_t nbf,
+			  struct ngnfs_block_cont *cont);
 void ngnfs_block_put(struct ngnfs_block *bl);
 void *ngnfs_block_buf(struct ngnfs_block *bl);
 struct page *ngnfs_block_page(struct ngnfs_block *bl);
+struct page *ngnfs_block_get_page(struct ngnfs_block *bl);
+bool ngnfs_block_swap_page(struct ngnfs_block *bl, struct page *page);
 
 int ngnfs_block_dirty_begin(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off);
 void ngnfs_block_dirty_end(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off);
 int ngnfs_block_sync(struct ngnfs_fs_info *nfi);
+void ngnfs_block_free(struct ngnfs_fs_info *nfi, u64 bnr, u64 nr);
+void ngnfs_block_sync_cont(struct ngnfs_fs_info *nfi, struct ngnfs_block_cont *cont);
+
+struct ngnfs_block_io_result {
+	u64 bnr;
+	struct page *data_page;
+	int err;
+};
 
 void ngnfs_block_end_io(struct ngnfs_fs_info *nfi, u64 bnr, struct page *data_page, int err);
+void ngnfs_block_end_io_batch(struct ngnfs_fs_info *nfi, struct ngnfs_block_io_result *res,
+			      unsigned int nr);
+void ngnfs_block_end_discard(struct ngnfs_fs_info *nfi, u64 nr, int err);
+void ngnfs_block_kick_submit(struct ngnfs_fs_info *nfi);
 
 int ngnfs_block_setup(struct ngnfs_fs_info *nfi, struct ngnfs_block_transport_ops *btr_ops,
 		      void *btr_setup_arg);
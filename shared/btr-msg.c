@@ -1,9 +1,37 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+/*
+ * The msg block transport sends block IO requests to the devd that
+ * stores each block as described by the manifest.
+ *
+ * The block submit work hands us blocks one at a time.  We gather them
+ * in batches for each manifest slot and op and only send messages once
+ * a batch fills or the submit work flushes at the end of its pass.
+ * Single block batches are sent as the simple single block messages,
+ * larger batches as the vector messages.  Discarded extents are
+ * gathered in each slot's own batch of free blocks messages.
+ *
+ * We hold a reference to the msg peer for each manifest slot so that
+ * sends don't have to look up the peer by address.  The peers are
+ * created as we're set up during mount so that connections to all the
+ * devds are established in parallel before the first blocks are read.
+ * Messaging reconnects peers that shut down.  We keep sending to a
+ * peer that has shut down, which orphans the requests for messaging to
+ * resend, until messaging has a new peer for the slot's address.
+ *
+ * The batches and peers are only ever used by the submit work which is
+ * single threaded so they don't need locking.
+ */
+
+#include "shared/lk/build_bug.h"
 #include "shared/lk/byteorder.h"
 #include "shared/lk/err.h"
 #include "shared/lk/errno.h"
 #include "shared/lk/gfp.h"
+#include "shared/lk/math64.h"
+#include "shared/lk/slab.h"
+#include "shared/lk/stddef.h"
+#include "shared/lk/string.h"
 
 #include "shared/block.h"
 #include "shared/btr-msg.h"
@@ -12,6 +40,27 @@
 #include "shared/manifest.h"
 #include "shared/msg.h"
 
+struct btr_msg_batch {
+	u64 bnrs[NGNFS_MSG_MAX_BLOCKS];
+	struct page *pages[NGNFS_MSG_MAX_BLOCKS];
+	u8 nr;
+};
+
+struct btr_msg_free_batch {
+	u64 bnrs[NGNFS_MSG_MAX_FREE_EXTENTS];
+	u64 nrs[NGNFS_MSG_MAX_FREE_EXTENTS];
+	u64 nr_blocks;
+	u8 nr;
+};
+
+struct btr_msg_info {
+	u8 nr_slots;
+	struct ngnfs_peer **peers;
+	struct btr_msg_free_batch *free_batches;
+	/* indexed by [slot * NGNFS_BTX_OP__NR + op] */
+	struct btr_msg_batch batches[];
+};
+
 static int ngnfs_btr_msg_get_block_result(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
 {
 	struct ngnfs_msg_get_block_result *gbr = mdesc->ctl_buf;
@@ -26,7 +75,9 @@ static int ngnfs_btr_msg_get_block_result(struct ngnfs_fs_info *nfi, struct ngnf
 	    ((gbr->err != NGNFS_MSG_ERR_OK) && (mdesc->data_size != 0)))
 		return -EINVAL;
 
-	ngnfs_block_end_io(nfi, le64_to_cpu(gbr->bnr), mdesc->data_page, ngnfs_msg_errno(gbr->err));
+	ngnfs_block_end_io(nfi, le64_to_cpu(gbr->bnr),
+			   mdesc->data_size ? mdesc->data_pages[0] : NULL,
+			   ngnfs_msg_errno(gbr->err));
 
 	return 0;
 }
@@ -39,42 +90,187 @@ static int ngnfs_btr_msg_write_block_result(struct ngnfs_fs_info *nfi, struct ng
 	    mdesc->data_size != 0)
 		return -EINVAL;
 
-	ngnfs_block_end_io(nfi, le64_to_cpu(wbr->bnr), mdesc->data_page, ngnfs_msg_errno(wbr->err));
+	ngnfs_block_end_io(nfi, le64_to_cpu(wbr->bnr), NULL, ngnfs_msg_errno(wbr->err));
 
 	return 0;
 }
 
-static int ngnfs_btr_msg_submit_block(struct ngnfs_fs_info *nfi, void *btr_info, int op, u64 bnr,
-				      struct page *data_page)
+/*
+ * Each successful result consumes the next page of the data payload.
+ * We verify that the results account for the entire payload before
+ * completing any of the blocks.  All the blocks in the message are
+ * completed as one batch.
+ */
+static int ngnfs_btr_msg_get_blocks_result(struct ngnfs_fs_info *nfi,
+					   struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_get_blocks_result *gbr = mdesc->ctl_buf;
+	struct ngnfs_block_io_result res[NGNFS_MSG_MAX_BLOCKS];
+	unsigned int nr_ok;
+	unsigned int i;
+
+	if (mdesc->ctl_size < sizeof(struct ngnfs_msg_get_blocks_result) ||
+	    gbr->nr == 0 || gbr->nr > NGNFS_MSG_MAX_BLOCKS ||
+	    mdesc->ctl_size != offsetof(struct ngnfs_msg_get_blocks_result, res[gbr->nr]))
+		return -EINVAL;
+
+	for (i = 0, nr_ok = 0; i < gbr->nr; i++) {
+		if (gbr->res[i].err == NGNFS_MSG_ERR_OK)
+			nr_ok++;
+	}
+
+	if (mdesc->data_size != nr_ok * NGNFS_BLOCK_SIZE)
+		return -EINVAL;
+
+	for (i = 0, nr_ok = 0; i < gbr->nr; i++) {
+		res[i].bnr = le64_to_cpu(gbr->res[i].bnr);
+		res[i].err = ngnfs_msg_errno(gbr->res[i].err);
+		if (gbr->res[i].err == NGNFS_MSG_ERR_OK)
+			res[i].data_page = mdesc->data_pages[nr_ok++];
+		else
+			res[i].data_page = NULL;
+	}
+
+	ngnfs_block_end_io_batch(nfi, res, gbr->nr);
+
+	return 0;
+}
+
+static int ngnfs_btr_msg_write_blocks_result(struct ngnfs_fs_info *nfi,
+					     struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_write_blocks_result *wbr = mdesc->ctl_buf;
+	struct ngnfs_block_io_result res[NGNFS_MSG_MAX_BLOCKS];
+	unsigned int i;
+
+	if (mdesc->ctl_size < sizeof(struct ngnfs_msg_write_blocks_result) ||
+	    wbr->nr == 0 || wbr->nr > NGNFS_MSG_MAX_BLOCKS ||
+	    mdesc->ctl_size != offsetof(struct ngnfs_msg_write_blocks_result, res[wbr->nr]) ||
+	    mdesc->data_size != 0)
+		return -EINVAL;
+
+	for (i = 0; i < wbr->nr; i++) {
+		res[i].bnr = le64_to_cpu(wbr->res[i].bnr);
+		res[i].data_page = NULL;
+		res[i].err = ngnfs_msg_errno(wbr->res[i].err);
+	}
+
+	ngnfs_block_end_io_batch(nfi, res, wbr->nr);
+
+	return 0;
+}
+
+static int ngnfs_btr_msg_free_blocks_result(struct ngnfs_fs_info *nfi,
+					    struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_free_blocks_result *fbr = mdesc->ctl_buf;
+
+	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_free_blocks_result) ||
+	    mdesc->data_size != 0)
+		return -EINVAL;
+
+	ngnfs_block_end_discard(nfi, le64_to_cpu(fbr->nr_blocks), ngnfs_msg_errno(fbr->err));
+
+	return 0;
+}
+
+/*
+ * Return the slot's peer, getting a new peer if we don't have one or
+ * switching to messaging's replacement if the one we had has shut
+ * down.
+ */
+static struct ngnfs_peer *slot_peer(struct ngnfs_fs_info *nfi, struct btr_msg_info *binf, u8 slot)
+{
+	struct ngnfs_peer *peer = binf->peers[slot];
+	struct ngnfs_peer *found;
+	struct sockaddr_in addr;
+
+	if (peer && ngnfs_msg_peer_is_shutdown(peer)) {
+		ngnfs_manifest_slot_addr(nfi, slot, &addr);
+		found = ngnfs_msg_find_peer(nfi, &addr);
+		if (found) {
+			ngnfs_msg_put_peer(nfi, peer);
+			binf->peers[slot] = found;
+			peer = found;
+		}
+	}
+
+	if (!peer) {
+		ngnfs_manifest_slot_addr(nfi, slot, &addr);
+		peer = ngnfs_msg_get_peer(nfi, &addr);
+		if (!IS_ERR(peer))
+			binf->peers[slot] = peer;
+	}
+
+	return peer;
+}
+
+/*
+ * Send a batch's blocks to the devd in the given slot.  The batch is
+ * emptied and its page references dropped whether the send succeeds or
+ * not.
+ */
+static int send_batch(struct ngnfs_fs_info *nfi, struct btr_msg_info *binf,
+		      struct btr_msg_batch *bat, u8 slot, int op)
 {
 	union {
 		struct ngnfs_msg_get_block gb;
 		struct ngnfs_msg_write_block wb;
+		struct ngnfs_msg_get_blocks gbs;
+		struct ngnfs_msg_write_blocks wbs;
+		u8 buf[offsetof(struct ngnfs_msg_get_blocks, bnrs[NGNFS_MSG_MAX_BLOCKS])];
 	} u;
 	struct ngnfs_msg_desc mdesc;
-	struct sockaddr_in addr;
+	struct ngnfs_peer *peer;
+	u8 access;
 	int ret;
+	int i;
+
+	BUILD_BUG_ON(sizeof(u) > NGNFS_MSG_MAX_CTL_SIZE);
+
+	if (bat->nr == 0)
+		return 0;
+
+	access = op == NGNFS_BTX_OP_GET_READ ? NGNFS_MSG_BLOCK_ACCESS_READ :
+					       NGNFS_MSG_BLOCK_ACCESS_WRITE;
 
 	switch (op) {
 		case NGNFS_BTX_OP_GET_READ:
 		case NGNFS_BTX_OP_GET_WRITE:
-			u.gb.bnr = cpu_to_le64(bnr);
-			u.gb.access = op == NGNFS_BTX_OP_GET_READ ? NGNFS_MSG_BLOCK_ACCESS_READ :
-								    NGNFS_MSG_BLOCK_ACCESS_WRITE;
-			mdesc.ctl_buf = &u.gb;
-			mdesc.ctl_size = sizeof(u.gb);
-			mdesc.data_page = NULL;
+			if (bat->nr == 1) {
+				u.gb.bnr = cpu_to_le64(bat->bnrs[0]);
+				u.gb.access = access;
+				memset(u.gb._pad, 0, sizeof(u.gb._pad));
+				mdesc.ctl_size = sizeof(u.gb);
+				mdesc.type = NGNFS_MSG_GET_BLOCK;
+			} else {
+				u.gbs.nr = bat->nr;
+				u.gbs.access = access;
+				memset(u.gbs._pad, 0, sizeof(u.gbs._pad));
+				for (i = 0; i < bat->nr; i++)
+					u.gbs.bnrs[i] = cpu_to_le64(bat->bnrs[i]);
+				mdesc.ctl_size = offsetof(struct ngnfs_msg_get_blocks, bnrs[bat->nr]);
+				mdesc.type = NGNFS_MSG_GET_BLOCKS;
+			}
+			mdesc.data_pages = NULL;
 			mdesc.data_size = 0;
-			mdesc.type = NGNFS_MSG_GET_BLOCK;
 			break;
 
 		case NGNFS_BTX_OP_WRITE:
-			u.wb.bnr = cpu_to_le64(bnr);
-			mdesc.ctl_buf = &u.wb;
-			mdesc.ctl_size = sizeof(u.wb);
-			mdesc.data_page = data_page;
-			mdesc.data_size = NGNFS_BLOCK_SIZE;
-			mdesc.type = NGNFS_MSG_WRITE_BLOCK;
+			if (bat->nr == 1) {
+				u.wb.bnr = cpu_to_le64(bat->bnrs[0]);
+				mdesc.ctl_size = sizeof(u.wb);
+				mdesc.type = NGNFS_MSG_WRITE_BLOCK;
+			} else {
+				u.wbs.nr = bat->nr;
+				memset(u.wbs._pad, 0, sizeof(u.wbs._pad));
+				for (i = 0; i < bat->nr; i++)
+					u.wbs.bnrs[i] = cpu_to_le64(bat->bnrs[i]);
+				mdesc.ctl_size = offsetof(struct ngnfs_msg_write_blocks, bnrs[bat->nr]);
+				mdesc.type = NGNFS_MSG_WRITE_BLOCKS;
+			}
+			mdesc.data_pages = bat->pages;
+			mdesc.data_size = bat->nr * NGNFS_BLOCK_SIZE;
 			break;
 
 		default:
@@ -82,39 +278,303 @@ static int ngnfs_btr_msg_submit_block(struct ngnfs_fs_info *nfi, void *btr_info,
 			goto out;
 	}
 
-	ret = ngnfs_manifest_map_block(nfi, bnr, &addr);
-	if (ret == 0) {
-		mdesc.addr = &addr;
-		ret = ngnfs_msg_send(nfi, &mdesc);
+	peer = slot_peer(nfi, binf, slot);
+	if (IS_ERR(peer)) {
+		ret = PTR_ERR(peer);
+		goto out;
+	}
+
+	mdesc.addr = NULL;
+	mdesc.ctl_buf = &u;
+	mdesc.req_id = 0;
+
+	ret = ngnfs_msg_send_peer(nfi, peer, &mdesc);
+out:
+	for (i = 0; i < bat->nr; i++) {
+		if (bat->pages[i]) {
+			put_page(bat->pages[i]);
+			bat->pages[i] = NULL;
+		}
+	}
+	bat->nr = 0;
+
+	return ret;
+}
+
+/*
+ * Send a slot's batch of freed extents.  If the send fails the blocks
+ * are finished with the error here, the block cache doesn't know which
+ * of its extents were in the batch.
+ */
+static int send_free_batch(struct ngnfs_fs_info *nfi, struct btr_msg_info *binf,
+			   struct btr_msg_free_batch *bat, u8 slot)
+{
+	union {
+		struct ngnfs_msg_free_blocks fb;
+		u8 buf[offsetof(struct ngnfs_msg_free_blocks, exts[NGNFS_MSG_MAX_FREE_EXTENTS])];
+	} u;
+	struct ngnfs_msg_desc mdesc;
+	struct ngnfs_peer *peer;
+	int ret;
+	int i;
+
+	BUILD_BUG_ON(sizeof(u) > NGNFS_MSG_MAX_CTL_SIZE);
+
+	if (bat->nr == 0)
+		return 0;
+
+	u.fb.nr_blocks = cpu_to_le64(bat->nr_blocks);
+	u.fb.nr = bat->nr;
+	memset(u.fb._pad, 0, sizeof(u.fb._pad));
+	for (i = 0; i < bat->nr; i++) {
+		u.fb.exts[i].bnr = cpu_to_le64(bat->bnrs[i]);
+		u.fb.exts[i].nr = cpu_to_le64(bat->nrs[i]);
+	}
+
+	peer = slot_peer(nfi, binf, slot);
+	if (IS_ERR(peer)) {
+		ret = PTR_ERR(peer);
+		goto out;
 	}
+
+	mdesc.type = NGNFS_MSG_FREE_BLOCKS;
+	mdesc.addr = NULL;
+	mdesc.ctl_buf = &u;
+	mdesc.ctl_size = offsetof(struct ngnfs_msg_free_blocks, exts[bat->nr]);
+	mdesc.data_pages = NULL;
+	mdesc.data_size = 0;
+	mdesc.req_id = 0;
+
+	ret = ngnfs_msg_send_peer(nfi, peer, &mdesc);
 out:
+	if (ret < 0)
+		ngnfs_block_end_discard(nfi, bat->nr_blocks, ret);
+	bat->nr = 0;
+	bat->nr_blocks = 0;
+
 	return ret;
 }
 
+static void add_free(struct ngnfs_fs_info *nfi, struct btr_msg_info *binf, u8 slot,
+		     u64 bnr, u64 nr, u64 nr_blocks)
+{
+	struct btr_msg_free_batch *bat = &binf->free_batches[slot];
+
+	if (bat->nr > 0 && bat->bnrs[bat->nr - 1] + bat->nrs[bat->nr - 1] == bnr) {
+		bat->nrs[bat->nr - 1] += nr;
+	} else {
+		if (bat->nr == NGNFS_MSG_MAX_FREE_EXTENTS)
+			send_free_batch(nfi, binf, bat, slot);
+		bat->bnrs[bat->nr] = bnr;
+		bat->nrs[bat->nr] = nr;
+		bat->nr++;
+	}
+	bat->nr_blocks += nr_blocks;
+}
+
+/* the number of the extent's blocks that are striped to the slot */
+static u64 slot_blocks(struct ngnfs_fs_info *nfi, struct btr_msg_info *binf, u8 slot,
+		       u64 bnr, u64 nr)
+{
+	u8 first = ngnfs_manifest_map_slot(nfi, bnr);
+	u64 skip = (slot + binf->nr_slots - first) % binf->nr_slots;
+	u32 rem;
+
+	if (skip >= nr)
+		return 0;
+
+	return div_u64_rem(nr - skip - 1, binf->nr_slots, &rem) + 1;
+}
+
+/*
+ * Blocks are striped across the slots but each devd's devices can
+ * store the whole block space, so we send the whole extent to every
+ * slot that stores any of its blocks and the devds can discard large
+ * contiguous regions.  Each slot's devd only finishes the blocks that
+ * are striped to it, the others were never written there.  Send
+ * failures finish the blocks so we always accept the extent.
+ */
+static int ngnfs_btr_msg_submit_discard(struct ngnfs_fs_info *nfi, void *btr_info,
+					u64 bnr, u64 nr)
+{
+	struct btr_msg_info *binf = btr_info;
+	u64 nr_blocks;
+	u8 slot;
+
+	for (slot = 0; slot < binf->nr_slots; slot++) {
+		nr_blocks = slot_blocks(nfi, binf, slot, bnr, nr);
+		if (nr_blocks > 0)
+			add_free(nfi, binf, slot, bnr, nr, nr_blocks);
+	}
+
+	return 0;
+}
+
+/*
+ * Add the block to its slot's batch for the op, sending the batch once
+ * it's full.  Written pages are referenced until the batch is sent.
+ */
+static int ngnfs_btr_msg_submit_block(struct ngnfs_fs_info *nfi, void *btr_info, int op, u64 bnr,
+				      struct page *data_page)
+{
+	struct btr_msg_info *binf = btr_info;
+	struct btr_msg_batch *bat;
+	u8 slot;
+
+	if (op < 0 || op >= NGNFS_BTX_OP__NR)
+		return -EOPNOTSUPP;
+
+	slot = ngnfs_manifest_map_slot(nfi, bnr);
+	bat = &binf->batches[slot * NGNFS_BTX_OP__NR + op];
+
+	bat->bnrs[bat->nr] = bnr;
+	if (op == NGNFS_BTX_OP_WRITE) {
+		get_page(data_page);
+		bat->pages[bat->nr] = data_page;
+	}
+	bat->nr++;
+
+	if (bat->nr == NGNFS_MSG_MAX_BLOCKS)
+		return send_batch(nfi, binf, bat, slot, op);
+
+	return 0;
+}
+
+/*
+ * Send all the partial batches gathered during the submit work's pass.
+ * We keep going after errors so that all the batches are emptied.
+ */
+static int ngnfs_btr_msg_submit_flush(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_msg_info *binf = btr_info;
+	int ret = 0;
+	int err;
+	int op;
+	u8 slot;
+
+	for (slot = 0; slot < binf->nr_slots; slot++) {
+		for (op = 0; op < NGNFS_BTX_OP__NR; op++) {
+			err = send_batch(nfi, binf,
+					 &binf->batches[slot * NGNFS_BTX_OP__NR + op], slot, op);
+			if (err < 0 && ret == 0)
+				ret = err;
+		}
+		send_free_batch(nfi, binf, &binf->free_batches[slot], slot);
+	}
+
+	return ret;
+}
+
+/*
+ * Each devd grants us credits for the number of requests we can have in
+ * flight to it.  Each block is at most one request so the sum of the
+ * credits granted by the devds in the manifest is a depth that won't
+ * have the submit work waiting for credits when blocks are spread
+ * evenly across the devds.
+ */
 static int ngnfs_btr_msg_queue_depth(struct ngnfs_fs_info *nfi, void *btr_info)
 {
-	return 32; /* XXX *shrug* */
+	struct btr_msg_info *binf = btr_info;
+	int depth = 0;
+	u8 slot;
+
+	for (slot = 0; slot < binf->nr_slots; slot++)
+		depth += ngnfs_msg_peer_window(binf->peers[slot]);
+
+	return depth;
 }
 
+static void ngnfs_btr_msg_destroy(struct ngnfs_fs_info *nfi, void *btr_info);
+
 static void *ngnfs_btr_msg_setup(struct ngnfs_fs_info *nfi, void *arg)
 {
+	struct btr_msg_info *binf;
+	struct ngnfs_peer *peer;
+	u8 nr_slots;
+	u8 slot;
 	int ret;
 
+	nr_slots = ngnfs_manifest_nr_slots(nfi);
+	binf = kzalloc(offsetof(struct btr_msg_info, batches[nr_slots * NGNFS_BTX_OP__NR]),
+		       GFP_NOFS);
+	if (!binf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	binf->nr_slots = nr_slots;
+	binf->peers = kzalloc(nr_slots * sizeof(binf->peers[0]), GFP_NOFS);
+	binf->free_batches = kzalloc(nr_slots * sizeof(binf->free_batches[0]), GFP_NOFS);
+	if (!binf->peers || !binf->free_batches) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	ret = ngnfs_msg_register_recv(nfi, NGNFS_MSG_GET_BLOCK_RESULT,
 				      ngnfs_btr_msg_get_block_result) ?:
 	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_WRITE_BLOCK_RESULT,
-				      ngnfs_btr_msg_write_block_result);
+				      ngnfs_btr_msg_write_block_result) ?:
+	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_GET_BLOCKS_RESULT,
+				      ngnfs_btr_msg_get_blocks_result) ?:
+	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_WRITE_BLOCKS_RESULT,
+				      ngnfs_btr_msg_write_blocks_result) ?:
+	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_FREE_BLOCKS_RESULT,
+				      ngnfs_btr_msg_free_blocks_result);
 	if (ret < 0)
-		return ERR_PTR(ret);
+		goto out;
 
-	return NULL;
+	/* start connecting to all the devds, each peer connects in its own thread */
+	for (slot = 0; slot < nr_slots; slot++) {
+		peer = slot_peer(nfi, binf, slot);
+		if (IS_ERR(peer)) {
+			ret = PTR_ERR(peer);
+			goto out;
+		}
+	}
+out:
+	if (ret < 0) {
+		ngnfs_btr_msg_destroy(nfi, binf);
+		binf = ERR_PTR(ret);
+	}
+
+	return binf;
 }
 
 static void ngnfs_btr_msg_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
 {
+	struct btr_msg_info *binf = btr_info;
+	struct btr_msg_batch *bat;
+	int i;
+	int j;
+
 	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_GET_BLOCK_RESULT, ngnfs_btr_msg_get_block_result);
 	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_WRITE_BLOCK_RESULT,
 				  ngnfs_btr_msg_write_block_result);
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_GET_BLOCKS_RESULT,
+				  ngnfs_btr_msg_get_blocks_result);
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_WRITE_BLOCKS_RESULT,
+				  ngnfs_btr_msg_write_blocks_result);
+	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_FREE_BLOCKS_RESULT,
+				  ngnfs_btr_msg_free_blocks_result);
+
+	if (!IS_ERR_OR_NULL(binf)) {
+		for (i = 0; i < binf->nr_slots * NGNFS_BTX_OP__NR; i++) {
+			bat = &binf->batches[i];
+			for (j = 0; j < bat->nr; j++) {
+				if (bat->pages[j])
+					put_page(bat->pages[j]);
+			}
+		}
+		if (binf->peers) {
+			for (i = 0; i < binf->nr_slots; i++) {
+				if (binf->peers[i])
+					ngnfs_msg_put_peer(nfi, binf->peers[i]);
+			}
+			kfree(binf->peers);
+		}
+		kfree(binf->free_batches);
+		kfree(binf);
+	}
 }
 
 struct ngnfs_block_transport_ops ngnfs_btr_msg_ops = {
@@ -122,4 +582,6 @@ struct ngnfs_block_transport_ops ngnfs_btr_msg_ops = {
 	.destroy = ngnfs_btr_msg_destroy,
 	.queue_depth = ngnfs_btr_msg_queue_depth,
 	.submit_block = ngnfs_btr_msg_submit_block,
+	.submit_flush = ngnfs_btr_msg_submit_flush,
+	.submit_discard = ngnfs_btr_msg_submit_discard,
 };
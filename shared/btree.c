@@ -15,6 +15,7 @@
 
 #include "shared/btree.h"
 #include "shared/format-block.h"
+#include "shared/trace.h"
 
 /*
  * The internal block format which stores items is balancing operational
@@ -38,8 +39,12 @@
  * avoiding having to worry about referencing block contents after we
  * return.
  *
+ * Freed item space is zeroed as items are deleted, moved, and compacted
+ * so that the unused regions of blocks are always zero.  The message
+ * transport relies on this to trim the free space between the item
+ * offsets and the items when it sends blocks.
+ *
  * XXX:
- *  - zero freed space as we move/compact/delete items
  *  - per-cpu item sorting offset array to avoid double sort
  */
 
@@ -241,6 +246,7 @@ static void remove_item(struct ngnfs_btree_block *bt, u16 pos)
 	tot = total_item_size(item);
 
 	le16_add_cpu(&bt->total_free, tot);
+	memset(item, 0, item_size(item));
 
 	if (get_item_off(bt, pos) == avail_free_end(bt))
 		le16_add_cpu(&bt->avail_free, tot);
@@ -322,6 +328,7 @@ static void move_items(struct ngnfs_btree_block *dst, struct ngnfs_btree_block *
 		dst_item = item_ptr(dst, d + i);
 
 		memcpy(dst_item, src_item, size);
+		memset(src_item, 0, size);
 	}
 
 	/* collapse the front of the src item offs array after items left */
@@ -329,6 +336,7 @@ static void move_items(struct ngnfs_btree_block *dst, struct ngnfs_btree_block *
 		memmove_tail_offs(src, nr, -nr);
 
 	le16_add_cpu(&src->nr_items, -nr);
+	memset(&src->item_off[le16_to_cpu(src->nr_items)], 0, nr * ITEM_OFF_SIZE);
 	le16_add_cpu(&src->total_free, moving);
 
 	le16_add_cpu(&dst->nr_items, nr);
@@ -386,12 +394,12 @@ static void update_parent_ref(struct ngnfs_btree_block *bt, u16 pos,
 
 void ngnfs_btree_init_block(struct ngnfs_btree_block *bt, u8 level)
 {
-	/* XXX do we want to zero the block here?  callers' responsibility? */
 	bt->bnr = 0; /* XXX */
 	bt->nr_items = 0;
 	bt->total_free = cpu_to_le16(NGNFS_BTREE_MAX_FREE);
 	bt->avail_free = bt->total_free;
 	bt->level = level;
+	memset(&bt->item_off[0], 0, NGNFS_BTREE_MAX_FREE);
 }
 
 int ngnfs_btree_lookup(struct ngnfs_btree_block *bt, void *key, size_t key_size,
@@ -412,6 +420,7 @@ int ngnfs_btree_lookup(struct ngnfs_btree_block *bt, void *key, size_t key_size,
 		ret = -ENOENT;
 	}
 
+	trace_ngnfs_btree_lookup(key, key_size, ret);
 	return ret;
 }
 
@@ -434,6 +443,7 @@ int ngnfs_btree_insert(struct ngnfs_btree_block *bt, void *key, size_t key_size,
 		ret = 0;
 	}
 
+	trace_ngnfs_btree_insert(key, key_size, ret);
 	return ret;
 }
 
@@ -451,6 +461,7 @@ int ngnfs_btree_delete(struct ngnfs_btree_block *bt, void *key, size_t key_size)
 		ret = -ENOENT;
 	}
 
+	trace_ngnfs_btree_delete(key, key_size, ret);
 	return ret;
 }
 
@@ -549,7 +560,7 @@ void ngnfs_btree_compact(struct ngnfs_btree_block *bt)
 	u16 size;
 	u16 off;
 	u16 nr;
-	u16 i;
+	int i;
 
 	if (bt->avail_free == bt->total_free)
 		return;
@@ -568,6 +579,9 @@ void ngnfs_btree_compact(struct ngnfs_btree_block *bt)
 		}
 	}
 
+	/* zero the stale item contents that were left behind in free space */
+	memset(&bt->item_off[nr], 0, off - offsetof(struct ngnfs_btree_block, item_off[nr]));
+
 	bt->avail_free = bt->total_free;
 
 	sort_r(&bt->item_off[0], nr, sizeof(bt->item_off[0]), cmp_item_key, swap_words_16, bt);
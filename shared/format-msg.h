@@ -7,11 +7,20 @@
 #include "shared/lk/compiler_attributes.h"
 #include "shared/lk/types.h"
 
+#include "shared/format-block.h"
+
 enum {
 	NGNFS_MSG_GET_BLOCK = 0,
 	NGNFS_MSG_GET_BLOCK_RESULT,
 	NGNFS_MSG_WRITE_BLOCK,
 	NGNFS_MSG_WRITE_BLOCK_RESULT,
+	NGNFS_MSG_GET_BLOCKS,
+	NGNFS_MSG_GET_BLOCKS_RESULT,
+	NGNFS_MSG_WRITE_BLOCKS,
+	NGNFS_MSG_WRITE_BLOCKS_RESULT,
+	NGNFS_MSG_CREDITS,
+	NGNFS_MSG_FREE_BLOCKS,
+	NGNFS_MSG_FREE_BLOCKS_RESULT,
 	NGNFS_MSG__NR,
 };
 
@@ -29,15 +38,59 @@ enum {
 	NGNFS_MSG_BLOCK_ACCESS__UNKNOWN,
 };
 
+/*
+ * Requests are given an id by their sender that is unique among the
+ * sender's requests in flight to the receiver.  Results carry the id of
+ * the request they complete.  Other messages have an id of 0.
+ */
 struct ngnfs_msg_header {
 	__le32 crc;
-	__le16 data_size;
-	__u8 ctl_size;
+	__le32 data_size;
+	__le32 req_id;
+	__le16 ctl_size;
 	__u8 type;
+	__u8 flags;
+};
+
+/* the data payload is a series of encoded blocks, data_size is the encoded size */
+#define NGNFS_MSG_HDR_F_ENCODED		(1 << 0)
+#define NGNFS_MSG_HDR_F__ALL		NGNFS_MSG_HDR_F_ENCODED
+
+enum {
+	/* the full block contents */
+	NGNFS_MSG_BENC_RAW = 0,
+	/* the block contents without a run of zeros at hole_off */
+	NGNFS_MSG_BENC_HOLE,
+	/* the block contents compressed by shared/lz.c */
+	NGNFS_MSG_BENC_LZ,
+	NGNFS_MSG_BENC__NR,
 };
 
-#define NGNFS_MSG_MAX_CTL_SIZE	255
-#define NGNFS_MSG_MAX_DATA_SIZE 4096
+/*
+ * Each encoded block in an encoded payload starts with this header
+ * which is followed by size bytes of encoded contents.  The hole fields
+ * are only used by the hole encoding.
+ */
+struct ngnfs_msg_block_enc {
+	__le16 size;
+	__le16 hole_off;
+	__le16 hole_len;
+	__u8 enc;
+	__u8 _pad;
+};
+
+/*
+ * The vector block messages can describe this many blocks.  Their data
+ * payload is the concatenation of the blocks' contents and sets the
+ * maximum data size of any message.
+ */
+#define NGNFS_MSG_MAX_BLOCKS	16
+
+#define NGNFS_MSG_MAX_CTL_SIZE	1024
+
+/* free blocks messages can describe this many extents */
+#define NGNFS_MSG_MAX_FREE_EXTENTS	32
+#define NGNFS_MSG_MAX_DATA_SIZE (NGNFS_MSG_MAX_BLOCKS * NGNFS_BLOCK_SIZE)
 
 struct ngnfs_msg_get_block {
 	__le64 bnr;
@@ -62,4 +115,85 @@ struct ngnfs_msg_write_block_result {
 	__u8 _pad[7];
 };
 
+/*
+ * The per-block result of a vector message.  Results are in the same
+ * order as the bnrs in the request.
+ */
+struct ngnfs_msg_block_result {
+	__le64 bnr;
+	__u8 err;
+	__u8 _pad[7];
+};
+
+struct ngnfs_msg_get_blocks {
+	__u8 nr;
+	__u8 access;
+	__u8 _pad[6];
+	__le64 bnrs[];
+};
+
+/*
+ * The data payload only contains the blocks whose results have
+ * NGNFS_MSG_ERR_OK, in the order of their results.
+ */
+struct ngnfs_msg_get_blocks_result {
+	__u8 nr;
+	__u8 access;
+	__u8 _pad[6];
+	struct ngnfs_msg_block_result res[];
+};
+
+/*
+ * The data payload contains the contents of each block, in the order of
+ * the bnrs.
+ */
+struct ngnfs_msg_write_blocks {
+	__u8 nr;
+	__u8 _pad[7];
+	__le64 bnrs[];
+};
+
+struct ngnfs_msg_write_blocks_result {
+	__u8 nr;
+	__u8 _pad[7];
+	struct ngnfs_msg_block_result res[];
+};
+
+struct ngnfs_msg_free_extent {
+	__le64 bnr;
+	__le64 nr;
+};
+
+/*
+ * The sender has freed the blocks in the extents and the devd can
+ * discard them.  The result is sent once the discards are finished so
+ * that the sender can then reuse the blocks.  nr_blocks is the number
+ * of freed blocks the sender is waiting on, which can be fewer than the
+ * extents cover if it sends the extents to more than one devd.
+ */
+struct ngnfs_msg_free_blocks {
+	__le64 nr_blocks;
+	__u8 nr;
+	__u8 _pad[7];
+	struct ngnfs_msg_free_extent exts[];
+};
+
+/* nr_blocks is the request's nr_blocks */
+struct ngnfs_msg_free_blocks_result {
+	__le64 nr_blocks;
+	__u8 err;
+	__u8 _pad[7];
+};
+
+/*
+ * Each request message consumes one of the credits that its receiver
+ * has granted the sender, the request's result returns the credit.  A
+ * receiver grants its initial credits by sending a credits message as
+ * it starts communicating with a peer and can grant more at any time.
+ */
+struct ngnfs_msg_credits {
+	__le32 credits;
+	__u8 _pad[4];
+};
+
 #endif
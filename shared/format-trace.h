@@ -8,10 +8,45 @@
 
 #include "shared/lk/byteorder.h"
 
+/*
+ * ns is CLOCK_MONOTONIC, the clock used by ktime_get_ns(), so that
+ * events can be compared with times that are recorded in event fields.
+ * cpu is where the event was stored, the thread could have migrated
+ * since.
+ */
 struct ngnfs_trace_event_header {
+	__le64 ns;
+	__le32 tid;
 	__le16 id;
 	__le16 size;
-	__le32 _pad;
+	__le16 cpu;
+	__u8 _pad[6];
+};
+
+/*
+ * Trace rings are files that start with a header block followed by a
+ * ring of records.  Head is the position after the last reserved
+ * record, it only increases and the ring offset of a position is the
+ * position modulo the ring size.
+ *
+ * A record's pos is set to its position once its event has been
+ * stored, readers use it to tell stored records from records that are
+ * still being stored or that are left over from earlier passes.
+ * Records don't wrap.  A record with an id of 0 pads out the end of the
+ * ring and tails that are too small to hold a record are skipped.
+ */
+#define NGNFS_TRACE_RING_MAGIC		0x676e7261636e676eULL
+#define NGNFS_TRACE_RING_HEADER_SIZE	4096
+
+struct ngnfs_trace_ring_header {
+	__le64 magic;
+	__le64 size;
+	__le64 head;
+};
+
+struct ngnfs_trace_ring_record {
+	__le64 pos;
+	struct ngnfs_trace_event_header hdr;
 };
 
 #endif
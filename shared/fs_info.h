@@ -7,11 +7,13 @@
  * info per-system info stored here.
  */
 struct ngnfs_block_info;
+struct devd_recv_info;
 struct ngnfs_manifest_info;
 struct ngnfs_msg_info;
 
 struct ngnfs_fs_info {
 	struct ngnfs_block_info *block_info;
+	struct devd_recv_info *devd_recv_info;
 	struct ngnfs_manifest_info *manifest_info;
 	struct ngnfs_msg_info *msg_info;
 };
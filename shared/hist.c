@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Log-linear histograms of u64 values, typically latencies in ns.
+ * They're fixed size so they can record any number of values in bounded
+ * memory, at the cost of only reporting percentiles to within the
+ * precision of their buckets.
+ */
+
+#include <string.h>
+
+#include "shared/lk/limits.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/types.h"
+
+#include "shared/hist.h"
+
+static unsigned int val_bucket(u64 val)
+{
+	unsigned int msb;
+
+	if (val < HIST_SUB_NR)
+		return val;
+
+	msb = 63 - __builtin_clzll(val);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       ((val >> (msb - HIST_SUB_BITS)) & (HIST_SUB_NR - 1));
+}
+
+/* the largest value that is recorded in the bucket */
+static u64 bucket_max(unsigned int b)
+{
+	unsigned int shift;
+
+	if (b < HIST_SUB_NR)
+		return b;
+
+	shift = (b >> HIST_SUB_BITS) - 1;
+	return (((u64)HIST_SUB_NR + (b & (HIST_SUB_NR - 1))) << shift) + ((1ULL << shift) - 1);
+}
+
+void hist_init(struct hist *hi)
+{
+	memset(hi, 0, sizeof(struct hist));
+	hi->min = U64_MAX;
+}
+
+void hist_add(struct hist *hi, u64 val)
+{
+	hi->counts[val_bucket(val)]++;
+	hi->nr++;
+	hi->sum += val;
+	hi->min = min(hi->min, val);
+	hi->max = max(hi->max, val);
+}
+
+void hist_merge(struct hist *dst, struct hist *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_NR; i++)
+		dst->counts[i] += src->counts[i];
+	dst->nr += src->nr;
+	dst->sum += src->sum;
+	dst->min = min(dst->min, src->min);
+	dst->max = max(dst->max, src->max);
+}
+
+/*
+ * Return the value below which per_mille thousandths of the recorded
+ * values fall, ie 500 for the median and 999 for p99.9.  The bucket's
+ * largest value is returned, clamped by the recorded min and max.
+ */
+u64 hist_percentile(struct hist *hi, unsigned int per_mille)
+{
+	u64 target;
+	u64 seen = 0;
+	unsigned int i;
+
+	if (hi->nr == 0)
+		return 0;
+
+	target = max_t(u64, 1, (hi->nr * per_mille + 999) / 1000);
+
+	for (i = 0; i < HIST_NR; i++) {
+		seen += hi->counts[i];
+		if (seen >= target)
+			return min(max(bucket_max(i), hi->min), hi->max);
+	}
+
+	return hi->max;
+}
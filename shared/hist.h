@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_SHARED_HIST_H
+#define NGNFS_SHARED_HIST_H
+
+#include "shared/lk/types.h"
+
+/*
+ * Each power of two range of values is divided into 2^HIST_SUB_BITS
+ * linear buckets so recorded values are accurate to within ~6%.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB_NR	(1 << HIST_SUB_BITS)
+#define HIST_NR		((64 - HIST_SUB_BITS + 1) * HIST_SUB_NR)
+
+struct hist {
+	u64 nr;
+	u64 min;
+	u64 max;
+	u64 sum;
+	u64 counts[HIST_NR];
+};
+
+void hist_init(struct hist *hi);
+void hist_add(struct hist *hi, u64 val);
+void hist_merge(struct hist *dst, struct hist *src);
+u64 hist_percentile(struct hist *hi, unsigned int per_mille);
+
+#endif
@@ -65,6 +65,11 @@ static inline void PREFIX##add(TYPE i, ATOMIC *v)			\
 	uatomic_add(&v->counter, i);					\
 }									\
 									\
+static inline TYPE PREFIX##add_return(TYPE i, ATOMIC *v)		\
+{									\
+	return uatomic_add_return(&v->counter, i);			\
+}									\
+									\
 static inline void PREFIX##sub(TYPE i, ATOMIC *v)			\
 {									\
 	uatomic_sub(&v->counter, i);					\
@@ -19,6 +19,7 @@
 struct page {
 	unsigned long refcount;
 	void *buf;
+	struct rcu_head rcu;
 };
 
 static inline struct page *alloc_page(gfp_t gfp_mask)
@@ -34,7 +35,7 @@ static inline struct page *alloc_page(gfp_t gfp_mask)
 			page = NULL;
 		} else {
 			uatomic_set(&page->refcount, 1);
-			if (gfp_mask && __GFP_ZERO)
+			if (gfp_mask & __GFP_ZERO)
 				memset(page->buf, 0, PAGE_SIZE);
 		}
 	}
@@ -49,12 +50,26 @@ static inline void get_page(struct page *page)
 
 static inline void put_page(struct page *page)
 {
-	if (uatomic_sub_return(&page->refcount, -1) == 0) {
+	if (uatomic_sub_return(&page->refcount, 1) == 0) {
 		free(page->buf);
 		free(page);
 	}
 }
 
+static inline void put_page_rcu_cb(struct rcu_head *rcu)
+{
+	put_page(caa_container_of(rcu, struct page, rcu));
+}
+
+/*
+ * Put a reference after a grace period so that rcu readers who found a
+ * pointer to the page can still get a reference.
+ */
+static inline void put_page_rcu(struct page *page)
+{
+	call_rcu(&page->rcu, put_page_rcu_cb);
+}
+
 static inline void *page_address(struct page *page)
 {
 	return page->buf;
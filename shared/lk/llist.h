@@ -12,8 +12,8 @@
 
 /*
  * We don't use the variant with the lock, we only support the op
- * combinations (many add(push), one del_all(pop_all)) that don't
- * require synchronization.
+ * combinations (many add(push), one del_all(pop_all) or del_first(pop))
+ * that don't require synchronization.
  */
 struct llist_head {
 	struct __cds_wfs_stack wfstack;
@@ -54,6 +54,21 @@ static inline bool llist_add(struct llist_node *new, struct llist_head *head)
 	return !cds_wfs_push(&head->wfstack, &new->wfnode);
 }
 
+/*
+ * Like the kernel, callers must serialize del_first with other
+ * del_first and del_all calls on the same list.
+ */
+static inline struct llist_node *llist_del_first(struct llist_head *head)
+{
+	struct cds_wfs_node *wfnode;
+
+	wfnode = __cds_wfs_pop_blocking(&head->wfstack);
+	if (wfnode)
+		return caa_container_of(wfnode, struct llist_node, wfnode);
+	else
+		return NULL;
+}
+
 static inline struct llist_node *llist_del_all(struct llist_head *head)
 {
 	struct cds_wfs_head *wfhead;
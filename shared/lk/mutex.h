@@ -2,12 +2,16 @@
 #ifndef NGNFS_SHARED_LK_MUTEX_H
 #define NGNFS_SHARED_LK_MUTEX_H
 
+#include <assert.h>
 #include <pthread.h>
 
 struct mutex {
 	pthread_mutex_t ptm;
 };
 
+#define DEFINE_MUTEX(name) \
+	struct mutex name = { .ptm = PTHREAD_MUTEX_INITIALIZER }
+
 static inline void mutex_init(struct mutex *mutex)
 {
 	int ret;
@@ -101,6 +101,23 @@ void *rhashtable_lookup_get_insert_fast(struct rhashtable *ht, struct rhash_head
 	return NULL;
 }
 
+/*
+ * Returns 0 if the object was removed or -ENOENT if it wasn't present,
+ * possibly because a racing caller removed it.  Like the kernel, this
+ * takes the rcu_read_lock itself.
+ */
+int rhashtable_remove_fast(struct rhashtable *ht, struct rhash_head *head,
+			   const struct rhashtable_params params)
+{
+	int ret;
+
+	rcu_read_lock();
+	ret = cds_lfht_del(ht->lfht, head_to_node(head));
+	rcu_read_unlock();
+
+	return ret == 0 ? 0 : -ENOENT;
+}
+
 /*
  * XXX starting with simple fixed size for now.
  */
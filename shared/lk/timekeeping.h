@@ -4,8 +4,14 @@
 
 #include "shared/lk/ktime.h"
 
+ktime_t ktime_get(void);
 ktime_t ktime_get_real(void);
 
+static inline u64 ktime_get_ns(void)
+{
+        return ktime_to_ns(ktime_get());
+}
+
 static inline u64 ktime_get_real_ns(void)
 {
         return ktime_to_ns(ktime_get_real());
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <assert.h>
+#include <time.h>
 
 #include "shared/urcu.h"
 
@@ -65,6 +66,45 @@ do {												\
 	}											\
 } while (0)
 
+/*
+ * Like wait_event() but give up once timeout_ns nanoseconds have
+ * passed.  Unlike the kernel the timeout is in nanoseconds rather than
+ * jiffies and nothing is returned, callers test their condition.
+ */
+#define wait_event_timeout(wq_head, condition, timeout_ns)					\
+do {												\
+	__typeof__(wq_head) _wq = (wq_head);							\
+	struct timespec _ts;									\
+	uint64_t _deadline;									\
+	uint64_t _now;										\
+	uint32_t _ctr;										\
+	long _ret;										\
+												\
+        if (!(condition)) {									\
+		clock_gettime(CLOCK_MONOTONIC, &_ts);						\
+		_deadline = (_ts.tv_sec * 1000000000ULL) + _ts.tv_nsec + (timeout_ns);	\
+		uatomic_inc(&_wq->nr_waiting);							\
+		for (;;) {									\
+			_ctr = uatomic_read(&_wq->wake_counter);				\
+			cmm_barrier();								\
+			if (condition)								\
+				break;								\
+			clock_gettime(CLOCK_MONOTONIC, &_ts);					\
+			_now = (_ts.tv_sec * 1000000000ULL) + _ts.tv_nsec;			\
+			if (_now >= _deadline)							\
+				break;								\
+			_ts.tv_sec = (_deadline - _now) / 1000000000ULL;			\
+			_ts.tv_nsec = (_deadline - _now) % 1000000000ULL;			\
+			_ret = syscall(SYS_futex, &_wq->wake_counter, FUTEX_WAIT,_ctr,		\
+				      &_ts, NULL, 0);						\
+			assert(_ret == 0 ||							\
+			       (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||	\
+				errno == ETIMEDOUT));						\
+		}										\
+		uatomic_dec(&_wq->nr_waiting);							\
+	}											\
+} while (0)
+
 /*
  * The caller is responsible for ordering of sleeping and waking.  This
  * implementation just needs to make sure that concurrent sleeping and
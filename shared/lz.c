@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * A small LZ77 compressor in the style of the LZ4 block format.  It's
+ * meant for compressing individual blocks on the wire so it trades
+ * ratio for speed: a single hash table probe per input position and no
+ * lazy matching.
+ *
+ * The compressed stream is a series of sequences.  Each sequence starts
+ * with a token byte whose high nibble is the number of literal bytes
+ * and whose low nibble is the match length minus the minimum match.  A
+ * nibble of 15 is followed by bytes that are added to the length until
+ * a byte less than 255.  The literals follow, then a le16 offset back
+ * from the current output position to the start of the match, then any
+ * additional match length bytes.  The final sequence only has literals
+ * and ends the stream.
+ *
+ * The decompressor is given untrusted input from the network so it
+ * checks every length and offset against the bounds of its buffers.
+ */
+
+#include "shared/lk/byteorder.h"
+#include "shared/lk/errno.h"
+#include "shared/lk/limits.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/string.h"
+#include "shared/lk/types.h"
+#include "shared/lk/unaligned.h"
+
+#include "shared/lz.h"
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	12
+#define LZ_NIBBLE_MAX	15
+
+static inline u32 lz_hash(const u8 *p)
+{
+	return (get_unaligned_le32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Store the remainder of a length that didn't fit in its nibble.
+ */
+static u8 *put_len(u8 *op, u8 *oend, size_t len)
+{
+	while (len >= U8_MAX) {
+		if (op >= oend)
+			return NULL;
+		*(op++) = U8_MAX;
+		len -= U8_MAX;
+	}
+
+	if (op >= oend)
+		return NULL;
+	*(op++) = len;
+
+	return op;
+}
+
+/*
+ * Store a sequence of literals followed by a match.  A match_len of 0
+ * stores the final sequence of only literals.  Returns NULL if the
+ * sequence doesn't fit in the output.
+ */
+static u8 *put_seq(u8 *op, u8 *oend, const u8 *lit, size_t lit_len, size_t off, size_t match_len)
+{
+	u8 *token;
+
+	if (op >= oend)
+		return NULL;
+	token = op++;
+
+	*token = min_t(size_t, lit_len, LZ_NIBBLE_MAX) << 4;
+	if (lit_len >= LZ_NIBBLE_MAX) {
+		op = put_len(op, oend, lit_len - LZ_NIBBLE_MAX);
+		if (!op)
+			return NULL;
+	}
+
+	if (lit_len > oend - op)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len == 0)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	put_unaligned_le16(off, op);
+	op += 2;
+
+	match_len -= LZ_MIN_MATCH;
+	*token |= min_t(size_t, match_len, LZ_NIBBLE_MAX);
+	if (match_len >= LZ_NIBBLE_MAX)
+		op = put_len(op, oend, match_len - LZ_NIBBLE_MAX);
+
+	return op;
+}
+
+/*
+ * Returns the number of compressed bytes stored in dst, or 0 if the
+ * compressed stream didn't fit in dst_len.  Callers give a dst_len
+ * smaller than the src_len to only get compressed output that saves
+ * space.
+ */
+size_t ngnfs_lz_compress(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+	u16 table[1 << LZ_HASH_BITS];
+	const u8 *base = src;
+	const u8 *ip = src;
+	const u8 *anchor = src;
+	const u8 *iend = base + src_len;
+	const u8 *ref;
+	u8 *op = dst;
+	u8 *oend = op + dst_len;
+	size_t match_len;
+	u32 h;
+	u16 cand;
+
+	if (src_len > NGNFS_LZ_MAX_INPUT)
+		return 0;
+
+	/* positions are stored + 1 so that 0 is an empty entry */
+	memset(table, 0, sizeof(table));
+
+	while (src_len >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH) {
+		h = lz_hash(ip);
+		cand = table[h];
+		table[h] = (ip - base) + 1;
+
+		if (cand == 0 || memcmp(base + cand - 1, ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		ref = base + cand - 1;
+		match_len = LZ_MIN_MATCH;
+		while (ip + match_len < iend && ref[match_len] == ip[match_len])
+			match_len++;
+
+		op = put_seq(op, oend, anchor, ip - anchor, ip - ref, match_len);
+		if (!op)
+			return 0;
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (u8 *)dst;
+}
+
+/*
+ * Read the remainder of a length that didn't fit in its nibble.
+ */
+static int get_len(const u8 **ipp, const u8 *iend, size_t *len, size_t max)
+{
+	const u8 *ip = *ipp;
+	u8 b;
+
+	do {
+		if (ip >= iend)
+			return -EINVAL;
+		b = *(ip++);
+		*len += b;
+		if (*len > max)
+			return -EINVAL;
+	} while (b == U8_MAX);
+
+	*ipp = ip;
+	return 0;
+}
+
+/*
+ * Returns the number of decompressed bytes stored in dst or -EINVAL if
+ * the compressed stream is corrupt or would overflow dst.
+ */
+int ngnfs_lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+	const u8 *ip = src;
+	const u8 *iend = ip + src_len;
+	const u8 *ref;
+	u8 *base = dst;
+	u8 *op = dst;
+	u8 *oend = op + dst_len;
+	size_t match_len;
+	size_t lit_len;
+	size_t off;
+	u8 token;
+
+	while (ip < iend) {
+		token = *(ip++);
+
+		lit_len = token >> 4;
+		if (lit_len == LZ_NIBBLE_MAX && get_len(&ip, iend, &lit_len, dst_len) < 0)
+			return -EINVAL;
+
+		if (lit_len > iend - ip || lit_len > oend - op)
+			return -EINVAL;
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		/* the final sequence only has literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EINVAL;
+		off = get_unaligned_le16(ip);
+		ip += 2;
+		if (off == 0 || off > op - base)
+			return -EINVAL;
+
+		match_len = token & LZ_NIBBLE_MAX;
+		if (match_len == LZ_NIBBLE_MAX && get_len(&ip, iend, &match_len, dst_len) < 0)
+			return -EINVAL;
+		match_len += LZ_MIN_MATCH;
+
+		if (match_len > oend - op)
+			return -EINVAL;
+
+		/* matches can overlap their output, copy bytes in order */
+		ref = op - off;
+		while (match_len-- > 0)
+			*(op++) = *(ref++);
+	}
+
+	return op - base;
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_SHARED_LZ_H
+#define NGNFS_SHARED_LZ_H
+
+#include "shared/lk/limits.h"
+#include "shared/lk/types.h"
+
+/* we store input positions in u16s */
+#define NGNFS_LZ_MAX_INPUT	U16_MAX
+
+size_t ngnfs_lz_compress(const void *src, size_t src_len, void *dst, size_t dst_len);
+int ngnfs_lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+#endif
@@ -17,13 +17,38 @@ struct ngnfs_manifest_info {
 	struct sockaddr_in addrs[];
 };
 
-int ngnfs_manifest_map_block(struct ngnfs_fs_info *nfi, u64 bnr, struct sockaddr_in *addr)
+/*
+ * Each address in the manifest occupies a slot.  Callers can use the
+ * slot index to maintain their own per-address state without having to
+ * compare addresses.
+ */
+u8 ngnfs_manifest_nr_slots(struct ngnfs_fs_info *nfi)
+{
+	struct ngnfs_manifest_info *mfinf = nfi->manifest_info;
+
+	return mfinf->nr_addrs;
+}
+
+u8 ngnfs_manifest_map_slot(struct ngnfs_fs_info *nfi, u64 bnr)
 {
 	struct ngnfs_manifest_info *mfinf = nfi->manifest_info;
 	u32 rem;
 
 	div_u64_rem(bnr, mfinf->nr_addrs, &rem);
-	*addr = mfinf->addrs[rem];
+
+	return rem;
+}
+
+void ngnfs_manifest_slot_addr(struct ngnfs_fs_info *nfi, u8 slot, struct sockaddr_in *addr)
+{
+	struct ngnfs_manifest_info *mfinf = nfi->manifest_info;
+
+	*addr = mfinf->addrs[slot];
+}
+
+int ngnfs_manifest_map_block(struct ngnfs_fs_info *nfi, u64 bnr, struct sockaddr_in *addr)
+{
+	ngnfs_manifest_slot_addr(nfi, ngnfs_manifest_map_slot(nfi, bnr), addr);
 
 	return 0;
 }
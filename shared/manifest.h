@@ -12,6 +12,9 @@ struct ngnfs_manifest_addr_head {
 	struct sockaddr_in addr;
 };
 
+u8 ngnfs_manifest_nr_slots(struct ngnfs_fs_info *nfi);
+u8 ngnfs_manifest_map_slot(struct ngnfs_fs_info *nfi, u64 bnr);
+void ngnfs_manifest_slot_addr(struct ngnfs_fs_info *nfi, u8 slot, struct sockaddr_in *addr);
 int ngnfs_manifest_map_block(struct ngnfs_fs_info *nfi, u64 bnr, struct sockaddr_in *addr);
 int ngnfs_manifest_setup(struct ngnfs_fs_info *nfi, struct list_head *list, u8 nr);
 void ngnfs_manifest_destroy(struct ngnfs_fs_info *nfi);
@@ -36,6 +36,8 @@ struct mount_options {
 	struct list_head addr_list;
 	u8 nr_addrs;
 	char *trace_path;
+	u64 trace_ring_size;
+	int encoding;
 };
 
 static struct option_more mount_moreopts[] = {
@@ -43,16 +45,25 @@ static struct option_more mount_moreopts[] = {
 	  .arg = "addr:port",
 	  .desc = "IPv4 address of devd server", },
 
+	{ .longopt = { "encoding", required_argument, NULL, 'e' },
+	  .arg = "none|trim|lz",
+	  .desc = "encoding of block payloads sent to devds, (default none)", },
+
 	{ .longopt = { "trace_file", required_argument, NULL, 't' },
 	  .arg = "file_path",
-	  .desc = "append debugging traces to this file",
+	  .desc = "append debugging traces to this file, file_path.events lists enabled events",
 	  .required = 1, },
+
+	{ .longopt = { "trace_ring_mb", required_argument, NULL, 'r' },
+	  .arg = "nr",
+	  .desc = "store traces in a ring of nr MiB in the trace file instead of appending", },
 };
 
 static int parse_mount_opt(int c, char *str, void *arg)
 {
 	struct mount_options *opts = arg;
 	struct ngnfs_manifest_addr_head *ahead;
+	unsigned long long ull;
 	int ret = -EINVAL;
 
 	switch(c) {
@@ -78,6 +89,21 @@ static int parse_mount_opt(int c, char *str, void *arg)
 		list_add_tail(&ahead->head, &opts->addr_list);
 		opts->nr_addrs++;
 		break;
+	case 'e':
+		ret = ngnfs_msg_parse_encoding(&opts->encoding, str);
+		if (ret < 0) {
+			log("unknown -e encoding '%s'", str);
+			goto out;
+		}
+		break;
+	case 'r':
+		ret = parse_ull(&ull, str, 1, TRACE_RING_MAX_MB);
+		if (ret < 0) {
+			log("invalid -r trace ring size '%s'", str);
+			goto out;
+		}
+		opts->trace_ring_size = ull << 20;
+		break;
 	case 't':
 		ret = strdup_nerr(&opts->trace_path, str);
 		break;
@@ -106,9 +132,10 @@ int ngnfs_mount(struct ngnfs_fs_info *nfi, int argc, char **argv)
 		goto out;
 	}
 
-	ret = trace_setup(opts.trace_path) ?:
+	ret = trace_setup(opts.trace_path, opts.trace_ring_size) ?:
 	      ngnfs_manifest_setup(nfi, &opts.addr_list, opts.nr_addrs) ?:
 	      ngnfs_msg_setup(nfi, &ngnfs_mtr_socket_ops, NULL, NULL) ?:
+	      ngnfs_msg_set_encoding(nfi, opts.encoding) ?:
 	      ngnfs_block_setup(nfi, &ngnfs_btr_msg_ops, NULL);
 out:
 	if (ret < 0)
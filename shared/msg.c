@@ -7,13 +7,28 @@
  * trying to send to an address without a matching peer or by accepting
  * a connection on a listening address.
  *
- * Message delivery is very loose right now.  There's no timeouts,
- * reconnect attempts, or retransmission.  This'll all get fleshed out
- * as we better understand the layers that are communicating.
+ * Callers that send to the same peers repeatedly can hold a reference
+ * to the peer and send to it directly rather than looking it up by
+ * address for every message.
+ *
+ * Requests are tracked until their result arrives.  Each request is
+ * given an id that its result carries back.  Requests that don't see a
+ * result before a deadline are sent again, and requests to peers that
+ * shut down are sent again to a new peer for the same address.
+ * Receivers can see a request more than once and we drop the results
+ * that arrive after the first.
+ *
+ * Addresses whose connections drop are reconnected as soon as they
+ * have orphaned requests.  Connection attempts that fail back off
+ * exponentially before the address is tried again.
  *
  * The receive path is marshalled by having layers register receive
  * handlers for a u8 type in a message header.
  *
+ * Peers bound the number of requests they'll accept from each other
+ * with credits.  Senders wait for a credit before sending each request
+ * and receiving the request's result returns the credit.
+ *
  * Most of the heavy lifting is handled by message transport layers.
  * They register ops to be called by messaging and call into messaging
  * with incoming peer connections or messages.
@@ -25,21 +40,63 @@
  *  - teardown and remove from hash table
  */
 
+#include "shared/lk/barrier.h"
 #include "shared/lk/byteorder.h"
 #include "shared/lk/bug.h"
+#include "shared/lk/build_bug.h"
+#include "shared/lk/cmpxchg.h"
+#include "shared/lk/container_of.h"
 #include "shared/lk/err.h"
 #include "shared/lk/errno.h"
 #include "shared/lk/kernel.h"
 #include "shared/lk/limits.h"
+#include "shared/lk/list.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/mutex.h"
 #include "shared/lk/rcupdate.h"
 #include "shared/lk/rhashtable.h"
+#include "shared/lk/rwonce.h"
 #include "shared/lk/stddef.h"
+#include "shared/lk/string.h"
+#include "shared/lk/time64.h"
+#include "shared/lk/timekeeping.h"
+#include "shared/lk/wait.h"
 
+#include "shared/lz.h"
 #include "shared/msg.h"
+#include "shared/stats.h"
+#include "shared/thread.h"
+#include "shared/trace.h"
+
+/*
+ * The number of requests that we let each peer have outstanding to us.
+ * It's also the number we assume a peer will grant us before we've
+ * heard from it.
+ */
+#define NGNFS_MSG_DEFAULT_CREDITS	32
+
+/* requests are sent again if their result hasn't arrived by then */
+#define NGNFS_MSG_REQ_TIMEOUT_NS	(10 * NSEC_PER_SEC)
+/* how often the resend thread checks deadlines and orphaned requests */
+#define NGNFS_MSG_RESEND_TICK_NS	NSEC_PER_SEC
+/* bounds of the delay between failed connection attempts to an address */
+#define NGNFS_MSG_RECONNECT_MIN_NS	(10 * NSEC_PER_MSEC)
+#define NGNFS_MSG_RECONNECT_MAX_NS	(2 * NSEC_PER_SEC)
 
 struct ngnfs_msg_info {
+	struct ngnfs_fs_info *nfi;
 	struct rhashtable ht;
 	ngnfs_msg_recv_fn_t *recv_fns[NGNFS_MSG__NR];
+	int recv_credits;
+	int encoding;
+
+	struct mutex mutex;
+	struct list_head peer_list;
+	struct list_head orphan_list;
+	struct list_head reconnect_list;
+	struct thread resend_thr;
+	wait_queue_head_t resend_waitq;
+	int resend_now;
 
 	struct ngnfs_msg_transport_ops *mtr_ops;
 	void *mtr_info;
@@ -48,27 +105,161 @@ struct ngnfs_msg_info {
 
 struct ngnfs_peer {
 	struct rcu_head rcu;
+	struct rcu_head unhash_rcu;
+	struct ngnfs_msg_info *minf;
 	atomic_t refcount;
 	struct rhash_head rhead;
 	struct sockaddr_in addr;
+	wait_queue_head_t waitq;
+	atomic_t credits;
+	int window;
+	int err;
+	bool accepted;
+
+	struct list_head minf_head;
+	struct mutex req_mutex;
+	struct list_head req_list;
+	u32 next_req_id;
+
 	void *info;
 };
 
+/*
+ * A request that has been sent and is waiting for its result.  We keep
+ * our own copy of the message so that it can be sent again after the
+ * caller has moved on.  Requests are on their peer's list in deadline
+ * order or on the orphan list once their peer has shut down.
+ */
+struct ngnfs_msg_req {
+	struct list_head head;
+	struct sockaddr_in addr;
+	u64 sent_ns;
+	u64 deadline_ns;
+	u32 id;
+	u32 data_size;
+	u32 resends;
+	u16 ctl_size;
+	u8 type;
+	struct page *data_pages[NGNFS_MSG_MAX_BLOCKS];
+	u8 ctl[];
+};
+
+/*
+ * Addresses that we've failed to connect to.  The record is removed
+ * once a connection to the address hears from its peer.
+ */
+struct ngnfs_msg_reconnect {
+	struct list_head head;
+	struct sockaddr_in addr;
+	u64 retry_ns;
+	u64 delay_ns;
+};
+
+/*
+ * The transport's peer info is allocated after our peer struct.
+ */
+static inline struct ngnfs_peer *info_peer(void *info)
+{
+	return (struct ngnfs_peer *)info - 1;
+}
+
+enum {
+	/* consumes a credit from the receiver */
+	MT_REQUEST = (1 << 0),
+	/* returns a credit to the receiver */
+	MT_RESULT = (1 << 1),
+	/* bulk writeback that can be sent after foreground messages */
+	MT_BACKGROUND = (1 << 2),
+};
+
+static const u8 msg_type_flags[NGNFS_MSG__NR] = {
+	[NGNFS_MSG_GET_BLOCK] = MT_REQUEST,
+	[NGNFS_MSG_GET_BLOCK_RESULT] = MT_RESULT,
+	[NGNFS_MSG_WRITE_BLOCK] = MT_REQUEST | MT_BACKGROUND,
+	[NGNFS_MSG_WRITE_BLOCK_RESULT] = MT_RESULT,
+	[NGNFS_MSG_GET_BLOCKS] = MT_REQUEST,
+	[NGNFS_MSG_GET_BLOCKS_RESULT] = MT_RESULT,
+	[NGNFS_MSG_WRITE_BLOCKS] = MT_REQUEST | MT_BACKGROUND,
+	[NGNFS_MSG_WRITE_BLOCKS_RESULT] = MT_RESULT,
+	[NGNFS_MSG_FREE_BLOCKS] = MT_REQUEST | MT_BACKGROUND,
+	[NGNFS_MSG_FREE_BLOCKS_RESULT] = MT_RESULT,
+};
+
+/*
+ * Transports can use the priority of a message's type to send
+ * foreground messages, which callers are typically waiting for, before
+ * background writes.  The type has been verified by the caller.
+ */
+int ngnfs_msg_priority(u8 type)
+{
+	return (msg_type_flags[type] & MT_BACKGROUND) ? NGNFS_MSG_PRIO_BG : NGNFS_MSG_PRIO_FG;
+}
+
 static const struct rhashtable_params ngnfs_msg_ht_params = {
         .head_offset = offsetof(struct ngnfs_peer, rhead),
         .key_offset = offsetof(struct ngnfs_peer, addr),
         .key_len = sizeof_field(struct ngnfs_peer, addr),
 };
 
+static void free_req(struct ngnfs_msg_req *req)
+{
+	unsigned int i;
+
+	if (req) {
+		for (i = 0; i < ARRAY_SIZE(req->data_pages) && req->data_pages[i]; i++)
+			put_page(req->data_pages[i]);
+		kfree(req);
+	}
+}
+
+static void free_req_list(struct list_head *list)
+{
+	struct ngnfs_msg_req *req;
+	struct ngnfs_msg_req *tmp;
+
+	list_for_each_entry_safe(req, tmp, list, head) {
+		list_del_init(&req->head);
+		free_req(req);
+	}
+}
+
+/*
+ * Peers only have requests in flight when their final reference is put
+ * during teardown.  Peers that shut down have already moved their
+ * requests to the orphan list.
+ */
 static void put_peer(struct ngnfs_msg_info *minf, struct ngnfs_peer *peer)
 {
 	if (!IS_ERR_OR_NULL(peer) && atomic_dec_return(&peer->refcount) == 0) {
 		if (peer->info && minf->mtr_ops->destroy_peer)
 			minf->mtr_ops->destroy_peer(peer->info);
+		mutex_lock(&minf->mutex);
+		list_del_init(&peer->minf_head);
+		mutex_unlock(&minf->mutex);
+		free_req_list(&peer->req_list);
 		kfree_rcu(&peer->rcu);
 	}
 }
 
+/*
+ * Grant the peer more credits to send us requests.  This is sent
+ * directly through the transport as it doesn't need a credit itself.
+ */
+static int send_credits(struct ngnfs_msg_info *minf, struct ngnfs_peer *peer, int credits)
+{
+	struct ngnfs_msg_credits cr = {
+		.credits = cpu_to_le32(credits),
+	};
+	struct ngnfs_msg_desc mdesc = {
+		.addr = &peer->addr,
+		.ctl_buf = &cr,
+		.ctl_size = sizeof(cr),
+		.type = NGNFS_MSG_CREDITS,
+	};
+
+	return minf->mtr_ops->send(peer->info, &mdesc);
+}
+
 /*
  * Get a peer for a given address.  If the peer doesn't exist then we
  * allocate a new one, initialize it, and start it up if it won the race
@@ -107,7 +298,15 @@ static struct ngnfs_peer *get_peer(struct ngnfs_fs_info *nfi, struct ngnfs_msg_i
 	}
 
 	atomic_set(&peer->refcount, 1);
+	peer->minf = minf;
 	memcpy(&peer->addr, addr, sizeof(peer->addr)); /* memcpy for ht memcmp */
+	init_waitqueue_head(&peer->waitq);
+	atomic_set(&peer->credits, 0);
+	INIT_LIST_HEAD(&peer->minf_head);
+	mutex_init(&peer->req_mutex);
+	INIT_LIST_HEAD(&peer->req_list);
+	peer->next_req_id = 1;
+	peer->accepted = !!accepted;
 
 	if (minf->mtr_ops->peer_info_size > 0) {
 		peer->info = (peer + 1);
@@ -132,7 +331,12 @@ static struct ngnfs_peer *get_peer(struct ngnfs_fs_info *nfi, struct ngnfs_msg_i
 		goto out;
 	}
 
-	ret = minf->mtr_ops->start(peer->info, addr, accepted);
+	mutex_lock(&minf->mutex);
+	list_add_tail(&peer->minf_head, &minf->peer_list);
+	mutex_unlock(&minf->mutex);
+
+	ret = minf->mtr_ops->start(peer->info, addr, accepted) ?:
+	      send_credits(minf, peer, minf->recv_credits);
 out:
 	if (ret < 0) {
 		put_peer(minf, peer);
@@ -180,19 +384,508 @@ int ngnfs_msg_errno(u8 err)
 int ngnfs_msg_verify_header(struct ngnfs_msg_header *hdr)
 {
 	if ((hdr->ctl_size == 0 && hdr->data_size == 0) ||
-	    hdr->ctl_size > NGNFS_MSG_MAX_CTL_SIZE ||
-	    le16_to_cpu(hdr->data_size) > NGNFS_MSG_MAX_DATA_SIZE ||
-	    hdr->type >= NGNFS_MSG__NR)
+	    le16_to_cpu(hdr->ctl_size) > NGNFS_MSG_MAX_CTL_SIZE ||
+	    le32_to_cpu(hdr->data_size) > NGNFS_MSG_MAX_DATA_SIZE ||
+	    hdr->type >= NGNFS_MSG__NR ||
+	    (hdr->flags & ~NGNFS_MSG_HDR_F__ALL) ||
+	    ((hdr->flags & NGNFS_MSG_HDR_F_ENCODED) && hdr->data_size == 0))
 		return -EINVAL;
 
 	return 0;
 }
 
+int ngnfs_msg_parse_encoding(int *enc, char *str)
+{
+	static char *names[] = {
+		[NGNFS_MSG_ENCODE_NONE] = "none",
+		[NGNFS_MSG_ENCODE_TRIM] = "trim",
+		[NGNFS_MSG_ENCODE_LZ] = "lz",
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (!strcmp(str, names[i])) {
+			*enc = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+int ngnfs_msg_set_encoding(struct ngnfs_fs_info *nfi, int enc)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+
+	if (enc < NGNFS_MSG_ENCODE_NONE || enc > NGNFS_MSG_ENCODE_LZ)
+		return -EINVAL;
+
+	WRITE_ONCE(minf->encoding, enc);
+	return 0;
+}
+
 /*
- * Establish a peer context and then hand the send off to the transport.
- * The transport will be copying the buf and page contents so the caller
- * can free the sent data once this returns.  (XXX We'll want to change
- * this to send by reference.)
+ * Find the longest run of zero bytes in the block, in aligned u64s.
+ * Btree blocks zero their free space so this finds the gap between
+ * their item offset array and their items.
+ */
+static void find_hole(void *buf, u16 *hole_off, u16 *hole_len)
+{
+	u64 *words = buf;
+	unsigned int best_start = 0;
+	unsigned int best_nr = 0;
+	unsigned int start = 0;
+	unsigned int i;
+
+	for (i = 0; i < NGNFS_BLOCK_SIZE / sizeof(u64); i++) {
+		if (words[i] != 0) {
+			start = i + 1;
+		} else if (i + 1 - start > best_nr) {
+			best_start = start;
+			best_nr = i + 1 - start;
+		}
+	}
+
+	*hole_off = best_start * sizeof(u64);
+	*hole_len = best_nr * sizeof(u64);
+}
+
+/*
+ * Encode a block into dst which has room for the encoded header and a
+ * full block.  Lz output is only used if it's smaller than the trimmed
+ * block.  Returns the size of the encoded block including its header.
+ */
+static size_t encode_block(int encoding, void *dst, void *src)
+{
+	struct ngnfs_msg_block_enc *benc = dst;
+	void *data = benc + 1;
+	size_t size = 0;
+	u16 hole_off;
+	u16 hole_len;
+	u8 enc;
+
+	find_hole(src, &hole_off, &hole_len);
+
+	if (encoding == NGNFS_MSG_ENCODE_LZ && NGNFS_BLOCK_SIZE - hole_len > 1)
+		size = ngnfs_lz_compress(src, NGNFS_BLOCK_SIZE, data,
+					 NGNFS_BLOCK_SIZE - hole_len - 1);
+
+	if (size > 0) {
+		enc = NGNFS_MSG_BENC_LZ;
+		hole_off = 0;
+		hole_len = 0;
+	} else if (hole_len > 0) {
+		enc = NGNFS_MSG_BENC_HOLE;
+		size = NGNFS_BLOCK_SIZE - hole_len;
+		memcpy(data, src, hole_off);
+		memcpy(data + hole_off, src + hole_off + hole_len, size - hole_off);
+	} else {
+		enc = NGNFS_MSG_BENC_RAW;
+		size = NGNFS_BLOCK_SIZE;
+		memcpy(data, src, size);
+	}
+
+	benc->size = cpu_to_le16(size);
+	benc->hole_off = cpu_to_le16(hole_off);
+	benc->hole_len = cpu_to_le16(hole_len);
+	benc->enc = enc;
+	benc->_pad = 0;
+
+	return sizeof(struct ngnfs_msg_block_enc) + size;
+}
+
+/*
+ * Transports call this to encode a message's data payload into a
+ * contiguous dst buffer with ngnfs_msg_encode_room() bytes.  Only
+ * payloads made of whole blocks are encoded.  0 is returned if we're
+ * not encoding or the encoded payload isn't smaller, in which case the
+ * transport sends the raw payload.
+ */
+u32 ngnfs_msg_encode_data(struct ngnfs_fs_info *nfi, void *dst, struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+	int encoding = READ_ONCE(minf->encoding);
+	unsigned int i;
+	u32 size = 0;
+
+	BUILD_BUG_ON(NGNFS_BLOCK_SIZE != PAGE_SIZE);
+
+	if (encoding == NGNFS_MSG_ENCODE_NONE || mdesc->data_size == 0 ||
+	    (mdesc->data_size & (NGNFS_BLOCK_SIZE - 1)))
+		return 0;
+
+	for (i = 0; i < (mdesc->data_size >> NGNFS_BLOCK_SHIFT); i++)
+		size += encode_block(encoding, dst + size, page_address(mdesc->data_pages[i]));
+
+	return size < mdesc->data_size ? size : 0;
+}
+
+static int decode_block(struct ngnfs_msg_block_enc *benc, void *data, void *dst)
+{
+	u16 size = le16_to_cpu(benc->size);
+	u16 hole_off = le16_to_cpu(benc->hole_off);
+	u16 hole_len = le16_to_cpu(benc->hole_len);
+
+	switch (benc->enc) {
+		case NGNFS_MSG_BENC_RAW:
+			if (size != NGNFS_BLOCK_SIZE)
+				return -EINVAL;
+			memcpy(dst, data, size);
+			return 0;
+
+		case NGNFS_MSG_BENC_HOLE:
+			if (hole_off + hole_len > NGNFS_BLOCK_SIZE ||
+			    size != NGNFS_BLOCK_SIZE - hole_len)
+				return -EINVAL;
+			memcpy(dst, data, hole_off);
+			memset(dst + hole_off, 0, hole_len);
+			memcpy(dst + hole_off + hole_len, data + hole_off, size - hole_off);
+			return 0;
+
+		case NGNFS_MSG_BENC_LZ:
+			if (ngnfs_lz_decompress(data, size, dst, NGNFS_BLOCK_SIZE) != NGNFS_BLOCK_SIZE)
+				return -EINVAL;
+			return 0;
+
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * Decode an encoded data payload into newly allocated pages, returning
+ * the decoded size.  The caller puts any pages that were stored in the
+ * array, including after errors.
+ */
+int ngnfs_msg_decode_data(void *src, u32 size, struct page **pages, u32 *data_size)
+{
+	struct ngnfs_msg_block_enc *benc;
+	unsigned int nr = 0;
+	u32 enc_size;
+	u32 off = 0;
+	int ret;
+
+	while (off < size) {
+		if (nr == NGNFS_MSG_MAX_BLOCKS || size - off < sizeof(struct ngnfs_msg_block_enc))
+			return -EINVAL;
+
+		benc = src + off;
+		enc_size = le16_to_cpu(benc->size);
+		off += sizeof(struct ngnfs_msg_block_enc);
+		if (enc_size > size - off)
+			return -EINVAL;
+
+		pages[nr] = alloc_page(GFP_NOFS);
+		if (!pages[nr])
+			return -ENOMEM;
+
+		ret = decode_block(benc, src + off, page_address(pages[nr]));
+		if (ret < 0)
+			return ret;
+
+		off += enc_size;
+		nr++;
+	}
+
+	*data_size = nr << NGNFS_BLOCK_SHIFT;
+	return 0;
+}
+
+static bool take_credit(struct ngnfs_peer *peer)
+{
+	int old;
+
+	do {
+		old = atomic_read(&peer->credits);
+	} while (old > 0 && atomic_cmpxchg(&peer->credits, old, old - 1) != old);
+
+	return old > 0;
+}
+
+static void return_credits(struct ngnfs_peer *peer, int credits)
+{
+	atomic_add(credits, &peer->credits);
+	smp_mb(); /* store credits before testing waiters */
+	if (waitqueue_active(&peer->waitq))
+		wake_up(&peer->waitq);
+}
+
+/*
+ * Copy the caller's request so that we can send it again.  The data
+ * pages are copied rather than referenced because callers are free to
+ * modify their pages once the send returns.  (XXX This goes away with
+ * sending by reference.)
+ */
+static struct ngnfs_msg_req *alloc_req(struct ngnfs_peer *peer, struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_req *req;
+	unsigned int nr_pages;
+	unsigned int i;
+	size_t size;
+
+	nr_pages = ngnfs_msg_nr_data_pages(mdesc);
+	if (WARN_ON_ONCE(nr_pages > ARRAY_SIZE(req->data_pages)))
+		return ERR_PTR(-EINVAL);
+
+	req = kzalloc(sizeof(struct ngnfs_msg_req) + mdesc->ctl_size, GFP_NOFS);
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&req->head);
+	memcpy(&req->addr, &peer->addr, sizeof(req->addr));
+	req->data_size = mdesc->data_size;
+	req->ctl_size = mdesc->ctl_size;
+	req->type = mdesc->type;
+	if (mdesc->ctl_size)
+		memcpy(req->ctl, mdesc->ctl_buf, mdesc->ctl_size);
+
+	for (i = 0; i < nr_pages; i++) {
+		req->data_pages[i] = alloc_page(GFP_NOFS);
+		if (!req->data_pages[i]) {
+			free_req(req);
+			return ERR_PTR(-ENOMEM);
+		}
+		size = min_t(size_t, mdesc->data_size - (i << PAGE_SHIFT), PAGE_SIZE);
+		memcpy(page_address(req->data_pages[i]), page_address(mdesc->data_pages[i]), size);
+	}
+
+	return req;
+}
+
+/*
+ * Hand a tracked request to the transport.  Send failures are ignored,
+ * the request will be sent again once it times out or its peer shuts
+ * down.  The caller holds the peer's req_mutex so the request can't be
+ * completed and freed while we're sending it.
+ */
+static void send_req(struct ngnfs_msg_info *minf, struct ngnfs_peer *peer,
+		     struct ngnfs_msg_req *req)
+{
+	struct ngnfs_msg_desc mdesc = {
+		.addr = &peer->addr,
+		.ctl_buf = req->ctl,
+		.data_pages = req->data_pages,
+		.data_size = req->data_size,
+		.req_id = req->id,
+		.ctl_size = req->ctl_size,
+		.type = req->type,
+	};
+
+	minf->mtr_ops->send(peer->info, &mdesc);
+}
+
+/*
+ * Have the resend thread make a pass without waiting for its tick.
+ */
+static void kick_resend(struct ngnfs_msg_info *minf)
+{
+	WRITE_ONCE(minf->resend_now, 1);
+	smp_mb(); /* store resend_now before testing waiters */
+	if (waitqueue_active(&minf->resend_waitq))
+		wake_up(&minf->resend_waitq);
+}
+
+static void orphan_req(struct ngnfs_msg_info *minf, struct ngnfs_msg_req *req)
+{
+	mutex_lock(&minf->mutex);
+	list_add_tail(&req->head, &minf->orphan_list);
+	mutex_unlock(&minf->mutex);
+	kick_resend(minf);
+}
+
+/* the caller holds the minf mutex */
+static struct ngnfs_msg_reconnect *find_reconnect(struct ngnfs_msg_info *minf,
+						  struct sockaddr_in *addr)
+{
+	struct ngnfs_msg_reconnect *rc;
+
+	list_for_each_entry(rc, &minf->reconnect_list, head) {
+		if (!memcmp(&rc->addr, addr, sizeof(rc->addr)))
+			return rc;
+	}
+
+	return NULL;
+}
+
+/*
+ * A connection that we initiated has shut down without ever hearing
+ * from its peer.  Double the delay before we try the address again.
+ * Failing to allocate the record just means that we don't back off.
+ * The caller holds the minf mutex.
+ */
+static void backoff_reconnect(struct ngnfs_msg_info *minf, struct ngnfs_peer *peer)
+{
+	struct ngnfs_msg_reconnect *rc;
+
+	rc = find_reconnect(minf, &peer->addr);
+	if (!rc) {
+		rc = kzalloc(sizeof(struct ngnfs_msg_reconnect), GFP_NOFS);
+		if (!rc)
+			return;
+		memcpy(&rc->addr, &peer->addr, sizeof(rc->addr));
+		rc->delay_ns = NGNFS_MSG_RECONNECT_MIN_NS;
+		list_add_tail(&rc->head, &minf->reconnect_list);
+	} else {
+		rc->delay_ns = min_t(u64, rc->delay_ns * 2, NGNFS_MSG_RECONNECT_MAX_NS);
+	}
+
+	rc->retry_ns = ktime_get_ns() + rc->delay_ns;
+}
+
+/*
+ * A connection that we initiated has heard from its peer.  The address
+ * no longer backs off and requests orphaned while it was connecting can
+ * be sent.
+ */
+static void peer_connected(struct ngnfs_msg_info *minf, struct ngnfs_peer *peer)
+{
+	struct ngnfs_msg_reconnect *rc;
+
+	mutex_lock(&minf->mutex);
+	rc = find_reconnect(minf, &peer->addr);
+	if (rc)
+		list_del_init(&rc->head);
+	mutex_unlock(&minf->mutex);
+
+	kfree(rc);
+	kick_resend(minf);
+}
+
+/*
+ * Give a request a new id, add it to the peer's in flight list, and
+ * send it.  The caller has taken a credit for the request.  The request
+ * is orphaned if the peer has already shut down and won't move its
+ * requests to the orphan list.  Ids only need to be unique among the
+ * peer's requests in flight so we can let them wrap, skipping 0.
+ */
+static void track_send_req(struct ngnfs_msg_info *minf, struct ngnfs_peer *peer,
+			   struct ngnfs_msg_req *req)
+{
+	mutex_lock(&peer->req_mutex);
+	if (READ_ONCE(peer->err) != 0) {
+		mutex_unlock(&peer->req_mutex);
+		orphan_req(minf, req);
+		return;
+	}
+
+	req->id = peer->next_req_id++ ?: peer->next_req_id++;
+	req->sent_ns = ktime_get_ns();
+	req->deadline_ns = req->sent_ns + NGNFS_MSG_REQ_TIMEOUT_NS;
+	list_add_tail(&req->head, &peer->req_list);
+	trace_ngnfs_msg_send(req->type, req->id, req->ctl_size, req->data_size);
+	send_req(minf, peer, req);
+	mutex_unlock(&peer->req_mutex);
+}
+
+/*
+ * Remove and return the request that a result completes.  Results for
+ * requests that we've sent more than once can arrive after the first
+ * has completed the request and won't find it.
+ */
+static struct ngnfs_msg_req *claim_req(struct ngnfs_peer *peer, u32 id)
+{
+	struct ngnfs_msg_req *found = NULL;
+	struct ngnfs_msg_req *req;
+
+	mutex_lock(&peer->req_mutex);
+	list_for_each_entry(req, &peer->req_list, head) {
+		if (req->id == id) {
+			list_del_init(&req->head);
+			found = req;
+			break;
+		}
+	}
+	mutex_unlock(&peer->req_mutex);
+
+	return found;
+}
+
+/*
+ * Return a reference to the current peer for the address without
+ * creating one, NULL if there isn't a peer for the address.
+ */
+struct ngnfs_peer *ngnfs_msg_find_peer(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_peer *peer;
+
+	rcu_read_lock();
+	peer = rhashtable_lookup(&minf->ht, addr, ngnfs_msg_ht_params);
+	if (peer)
+		atomic_inc(&peer->refcount);
+	rcu_read_unlock();
+
+	return peer;
+}
+
+/*
+ * Callers can resolve a peer once and send to it with _send_peer()
+ * instead of looking it up for every send.  The peer is removed from
+ * the hash table once it shuts down.  Requests sent to a peer that has
+ * shut down are orphaned and reconnected by messaging, so callers can
+ * keep sending to it until _find_peer() returns its replacement.
+ */
+struct ngnfs_peer *ngnfs_msg_get_peer(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
+{
+	return get_peer(nfi, nfi->msg_info, addr, NULL);
+}
+
+void ngnfs_msg_put_peer(struct ngnfs_fs_info *nfi, struct ngnfs_peer *peer)
+{
+	put_peer(nfi->msg_info, peer);
+}
+
+bool ngnfs_msg_peer_is_shutdown(struct ngnfs_peer *peer)
+{
+	return READ_ONCE(peer->err) != 0;
+}
+
+/*
+ * Hand the send off to the transport for the caller's referenced peer.
+ * The desc's addr isn't used.  The transport will be copying the buf
+ * and page contents so the caller can free the sent data once this
+ * returns.  (XXX We'll want to change this to send by reference.)
+ *
+ * Requests wait for the peer to grant us a credit.  This is the flow
+ * control that stops us from burying a peer in requests.  Callers who
+ * don't want to block should limit their requests in flight by the
+ * credits that the peer has granted.
+ *
+ * Once a request is tracked it will be delivered, eventually, so we
+ * only return errors from failing to copy the request.  Requests to a
+ * peer that has shut down are sent to the next peer for its address.
+ */
+int ngnfs_msg_send_peer(struct ngnfs_fs_info *nfi, struct ngnfs_peer *peer,
+			struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_msg_req *req;
+
+	if (WARN_ON_ONCE(mdesc->type >= NGNFS_MSG__NR))
+		return -EINVAL;
+
+	stats_inc(STAT_MSG_SEND_MSGS + mdesc->type);
+	stats_add(STAT_MSG_SEND_BYTES + mdesc->type, mdesc->ctl_size + mdesc->data_size);
+
+	if (!(msg_type_flags[mdesc->type] & MT_REQUEST)) {
+		trace_ngnfs_msg_send(mdesc->type, mdesc->req_id, mdesc->ctl_size,
+				     mdesc->data_size);
+		return minf->mtr_ops->send(peer->info, mdesc);
+	}
+
+	req = alloc_req(peer, mdesc);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	wait_event(&peer->waitq, take_credit(peer) || READ_ONCE(peer->err) != 0);
+	track_send_req(minf, peer, req);
+
+	return 0;
+}
+
+/*
+ * Send to the peer at the desc's address, establishing a peer context
+ * if one doesn't exist.
  */
 int ngnfs_msg_send(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
 {
@@ -201,27 +894,279 @@ int ngnfs_msg_send(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
 	int ret;
 
 	peer = get_peer(nfi, minf, mdesc->addr, NULL);
-	if (IS_ERR(peer)) {
-		ret = PTR_ERR(peer);
-	} else {
-		ret = minf->mtr_ops->send(peer->info, mdesc);
-		put_peer(minf, peer);
-	}
+	if (IS_ERR(peer))
+		return PTR_ERR(peer);
+
+	ret = ngnfs_msg_send_peer(nfi, peer, mdesc);
+	put_peer(minf, peer);
 
 	return ret;
 }
 
+/*
+ * Credits are granted as a count of additional requests that we can
+ * send.  We bound the grants to keep the count from overflowing.
+ */
+static int recv_credits(struct ngnfs_peer *peer, struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_credits *cr = mdesc->ctl_buf;
+	u32 credits;
+	int old;
+
+	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_credits) || mdesc->data_size != 0)
+		return -EINVAL;
+
+	credits = le32_to_cpu(cr->credits);
+	if (credits > U16_MAX || peer->window + credits > U16_MAX)
+		return -EINVAL;
+
+	old = peer->window;
+	WRITE_ONCE(peer->window, peer->window + credits);
+	return_credits(peer, credits);
+
+	if (old == 0 && !peer->accepted)
+		peer_connected(peer->minf, peer);
+
+	return 0;
+}
+
 /*
  * The caller has only verified the internal validity of the header.
+ * The transport's peer info identifies the peer that sent the message.
  */
-int ngnfs_msg_recv(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+int ngnfs_msg_recv(struct ngnfs_fs_info *nfi, void *info, struct ngnfs_msg_desc *mdesc)
 {
 	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_peer *peer = info_peer(info);
+	struct ngnfs_msg_req *req = NULL;
+	u64 lat_ns;
+	int ret;
+
+	trace_ngnfs_msg_recv(mdesc->type, mdesc->req_id, mdesc->ctl_size, mdesc->data_size);
+	if (mdesc->type < NGNFS_MSG__NR) {
+		stats_inc(STAT_MSG_RECV_MSGS + mdesc->type);
+		stats_add(STAT_MSG_RECV_BYTES + mdesc->type, mdesc->ctl_size + mdesc->data_size);
+	}
+
+	if (mdesc->type == NGNFS_MSG_CREDITS)
+		return recv_credits(peer, mdesc);
+
+	if (mdesc->type < ARRAY_SIZE(msg_type_flags) && (msg_type_flags[mdesc->type] & MT_RESULT)) {
+		req = claim_req(peer, mdesc->req_id);
+		if (!req)
+			return 0;
+	}
 
 	if (mdesc->type < ARRAY_SIZE(minf->recv_fns) && minf->recv_fns[mdesc->type])
-		return minf->recv_fns[mdesc->type](nfi, mdesc);
+		ret = minf->recv_fns[mdesc->type](nfi, mdesc);
 	else
-		return -EINVAL;
+		ret = -EINVAL;
+
+	if (req) {
+		if (ret == 0) {
+			lat_ns = ktime_get_ns() - req->sent_ns;
+			trace_ngnfs_msg_result(req->type, req->id, req->resends, lat_ns);
+			stats_hist_add(STAT_HIST_MSG_REQUEST_NS, lat_ns);
+			return_credits(peer, 1);
+			free_req(req);
+		} else {
+			orphan_req(minf, req);
+		}
+	}
+
+	return ret;
+}
+
+static void put_unhashed_peer(struct rcu_head *rcu)
+{
+	struct ngnfs_peer *peer = container_of(rcu, struct ngnfs_peer, unhash_rcu);
+
+	put_peer(peer->minf, peer);
+}
+
+/*
+ * The transport tells us that it has stopped communicating with a
+ * peer.  Senders waiting for credits will see the error and its
+ * requests in flight are orphaned to be sent to a new peer.  Outgoing
+ * connections that never heard from their peer back off before their
+ * address is tried again.
+ *
+ * We remove the peer from the hash table so that future sends to its
+ * address get a new peer.  The transport can call us from the peer's
+ * threads so we drop the hash table's reference, which can destroy the
+ * peer and wait for its threads, after a grace period instead.
+ */
+void ngnfs_msg_peer_shutdown(struct ngnfs_fs_info *nfi, void *info, int err)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_peer *peer = info_peer(info);
+	LIST_HEAD(list);
+
+	if (cmpxchg(&peer->err, 0, err ?: -ESHUTDOWN) == 0) {
+		smp_mb(); /* store err before testing waiters */
+		if (waitqueue_active(&peer->waitq))
+			wake_up(&peer->waitq);
+
+		mutex_lock(&peer->req_mutex);
+		list_splice_init(&peer->req_list, &list);
+		mutex_unlock(&peer->req_mutex);
+
+		mutex_lock(&minf->mutex);
+		list_splice_tail_init(&list, &minf->orphan_list);
+		list_del_init(&peer->minf_head);
+		if (!peer->accepted && READ_ONCE(peer->window) == 0)
+			backoff_reconnect(minf, peer);
+		mutex_unlock(&minf->mutex);
+		kick_resend(minf);
+
+		if (rhashtable_remove_fast(&minf->ht, &peer->rhead, ngnfs_msg_ht_params) == 0)
+			call_rcu(&peer->unhash_rcu, put_unhashed_peer);
+	}
+}
+
+/*
+ * Send requests again that have passed their deadline.  The request
+ * keeps its id and credit.  The peer's list is in deadline order and
+ * resent requests get the latest deadline so we can stop at the first
+ * request that hasn't expired.
+ */
+static void resend_expired(struct ngnfs_msg_info *minf)
+{
+	struct ngnfs_msg_req *req;
+	struct ngnfs_peer *peer;
+	u64 now = ktime_get_ns();
+
+	mutex_lock(&minf->mutex);
+	list_for_each_entry(peer, &minf->peer_list, minf_head) {
+		mutex_lock(&peer->req_mutex);
+		while ((req = list_first_entry_or_null(&peer->req_list, struct ngnfs_msg_req, head)) &&
+		       req->deadline_ns <= now) {
+			req->resends++;
+			req->deadline_ns = now + NGNFS_MSG_REQ_TIMEOUT_NS;
+			list_move_tail(&req->head, &peer->req_list);
+			trace_ngnfs_msg_resend(req->type, req->id, req->resends);
+			stats_inc(STAT_MSG_RESENDS);
+			send_req(minf, peer, req);
+		}
+		mutex_unlock(&peer->req_mutex);
+	}
+	mutex_unlock(&minf->mutex);
+}
+
+/*
+ * Send orphaned requests to the current peer for their address, which
+ * connects a new peer if needed.  We only get one peer for each address
+ * in a pass so that we don't spin up a connection per request to a
+ * peer that's down, and we don't try addresses that are backing off.
+ * Requests that can't get a peer or a credit are left for a later pass.
+ *
+ * Returns the time at which the earliest address that's backing off
+ * can be tried again, U64_MAX if none are.
+ */
+static u64 resend_orphans(struct ngnfs_msg_info *minf)
+{
+	struct ngnfs_msg_reconnect *rc;
+	struct ngnfs_msg_req *first;
+	struct ngnfs_msg_req *req;
+	struct ngnfs_msg_req *tmp;
+	struct ngnfs_peer *peer;
+	u64 now = ktime_get_ns();
+	u64 retry_ns = U64_MAX;
+	u64 next_ns = U64_MAX;
+	LIST_HEAD(list);
+	LIST_HEAD(retry);
+
+	mutex_lock(&minf->mutex);
+	list_splice_init(&minf->orphan_list, &list);
+	mutex_unlock(&minf->mutex);
+
+	while ((first = list_first_entry_or_null(&list, struct ngnfs_msg_req, head))) {
+		mutex_lock(&minf->mutex);
+		rc = find_reconnect(minf, &first->addr);
+		retry_ns = rc ? rc->retry_ns : 0;
+		mutex_unlock(&minf->mutex);
+
+		if (retry_ns > now) {
+			peer = ERR_PTR(-EAGAIN);
+			next_ns = min(next_ns, retry_ns);
+		} else {
+			peer = get_peer(minf->nfi, minf, &first->addr, NULL);
+		}
+
+		list_for_each_entry_safe(req, tmp, &list, head) {
+			if (req != first && memcmp(&req->addr, &first->addr, sizeof(req->addr)))
+				continue;
+
+			if (IS_ERR(peer) || !take_credit(peer)) {
+				list_move_tail(&req->head, &retry);
+			} else {
+				list_del_init(&req->head);
+				req->resends++;
+				trace_ngnfs_msg_resend(req->type, req->id, req->resends);
+				stats_inc(STAT_MSG_RESENDS);
+				track_send_req(minf, peer, req);
+			}
+		}
+
+		put_peer(minf, peer);
+	}
+
+	if (!list_empty(&retry)) {
+		mutex_lock(&minf->mutex);
+		list_splice_tail_init(&retry, &minf->orphan_list);
+		mutex_unlock(&minf->mutex);
+	}
+
+	return next_ns;
+}
+
+/*
+ * Passes are made every tick to check deadlines, when kicked by
+ * requests being orphaned or peers connecting, and when an address
+ * with orphaned requests is done backing off.
+ */
+static void resend_thread(struct thread *thr, void *arg)
+{
+	struct ngnfs_msg_info *minf = arg;
+	u64 timeout_ns = NGNFS_MSG_RESEND_TICK_NS;
+	u64 next_ns;
+	u64 now;
+
+	while (!thread_should_return(thr)) {
+		wait_event_timeout(&minf->resend_waitq,
+				   READ_ONCE(minf->resend_now) || thread_should_return(thr),
+				   timeout_ns);
+		if (thread_should_return(thr))
+			break;
+
+		WRITE_ONCE(minf->resend_now, 0);
+		smp_mb(); /* clear resend_now before checking lists */
+
+		resend_expired(minf);
+		next_ns = resend_orphans(minf);
+
+		now = ktime_get_ns();
+		if (next_ns <= now)
+			timeout_ns = 0;
+		else
+			timeout_ns = min_t(u64, next_ns - now, NGNFS_MSG_RESEND_TICK_NS);
+	}
+}
+
+/*
+ * Return the number of requests that the peer allows us to have in
+ * flight.  Peers that we haven't heard from yet, including callers
+ * that don't have a peer yet and pass NULL, are assumed to allow the
+ * default.
+ */
+int ngnfs_msg_peer_window(struct ngnfs_peer *peer)
+{
+	int window = 0;
+
+	if (peer)
+		window = READ_ONCE(peer->window);
+
+	return window ?: NGNFS_MSG_DEFAULT_CREDITS;
 }
 
 /*
@@ -289,7 +1234,15 @@ int ngnfs_msg_setup(struct ngnfs_fs_info *nfi, struct ngnfs_msg_transport_ops *m
 		goto out;
 	}
 
+	minf->nfi = nfi;
 	minf->mtr_ops = mtr_ops;
+	minf->recv_credits = NGNFS_MSG_DEFAULT_CREDITS;
+	mutex_init(&minf->mutex);
+	INIT_LIST_HEAD(&minf->peer_list);
+	INIT_LIST_HEAD(&minf->orphan_list);
+	INIT_LIST_HEAD(&minf->reconnect_list);
+	thread_init(&minf->resend_thr);
+	init_waitqueue_head(&minf->resend_waitq);
 
 	if (minf->mtr_ops->setup) {
 		info = minf->mtr_ops->setup(nfi, setup_arg);
@@ -308,6 +1261,10 @@ int ngnfs_msg_setup(struct ngnfs_fs_info *nfi, struct ngnfs_msg_transport_ops *m
 
 	nfi->msg_info = minf;
 
+	ret = thread_start(&minf->resend_thr, resend_thread, minf);
+	if (ret < 0)
+		goto out;
+
 	if (listen_addr) {
 		info = minf->mtr_ops->start_listen(nfi, listen_addr);
 		if (IS_ERR(info)) {
@@ -333,8 +1290,14 @@ static void free_ht_node_peer(void *ptr, void *arg)
 void ngnfs_msg_destroy(struct ngnfs_fs_info *nfi)
 {
 	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_msg_reconnect *rc_tmp;
+	struct ngnfs_msg_reconnect *rc;
 
 	if (minf) {
+		thread_stop_indicate(&minf->resend_thr);
+		wake_up(&minf->resend_waitq);
+		thread_stop_wait(&minf->resend_thr);
+
 		if (minf->listen_info)
 			minf->mtr_ops->stop_listen(nfi, minf->listen_info);
 		if (minf->mtr_ops->shutdown)
@@ -342,6 +1305,12 @@ void ngnfs_msg_destroy(struct ngnfs_fs_info *nfi)
 		if (minf->mtr_ops->destroy)
 			minf->mtr_ops->destroy(nfi, minf->mtr_info);
 		rhashtable_free_and_destroy(&minf->ht, free_ht_node_peer, minf);
+		rcu_barrier(); /* wait for puts of shutdown peers */
+		free_req_list(&minf->orphan_list);
+		list_for_each_entry_safe(rc, rc_tmp, &minf->reconnect_list, head) {
+			list_del_init(&rc->head);
+			kfree(rc);
+		}
 		kfree(minf);
 	}
 }
@@ -8,6 +8,7 @@
 #include "shared/fs_info.h"
 #include "shared/lk/atomic.h"
 #include "shared/lk/gfp.h"
+#include "shared/lk/math.h"
 #include "shared/lk/types.h"
 
 /*
@@ -15,16 +16,28 @@
  * reference to this data by the callee after returning must be copied
  * out.  These only exist to avoid having a billion argument copies in
  * each frame up and down the call stack.
+ *
+ * The data payload is stored in an array of pages.  Each page is full
+ * except for the last which holds the remainder of the data size.
+ *
+ * The req_id of sent requests is assigned by messaging.  Senders of
+ * results copy the req_id from the request's desc.
  */
 struct ngnfs_msg_desc {
 	struct sockaddr_in *addr;
 	void *ctl_buf;
-	struct page *data_page;
-	u16 data_size;
-	u8 ctl_size;
+	struct page **data_pages;
+	u32 data_size;
+	u32 req_id;
+	u16 ctl_size;
 	u8 type;
 };
 
+static inline unsigned int ngnfs_msg_nr_data_pages(struct ngnfs_msg_desc *mdesc)
+{
+	return DIV_ROUND_UP(mdesc->data_size, PAGE_SIZE);
+}
+
 struct ngnfs_msg_transport_ops {
 	void *(*setup)(struct ngnfs_fs_info *nfi, void *arg);
 	void (*shutdown)(struct ngnfs_fs_info *nfi, void *mtr_info);
@@ -39,14 +52,60 @@ struct ngnfs_msg_transport_ops {
 	int (*send)(void *info, struct ngnfs_msg_desc *mdesc);
 };
 
+/*
+ * Transports have a lane for each priority and send from the
+ * foreground lane first.
+ */
+enum {
+	NGNFS_MSG_PRIO_FG = 0,
+	NGNFS_MSG_PRIO_BG,
+	NGNFS_MSG_PRIO__NR,
+};
+
+/*
+ * Senders can encode block data payloads to reduce their size on the
+ * wire.  Trimming sends blocks without their longest run of zeros, lz
+ * also tries compressing them.  Receivers decode any encoding.
+ */
+enum {
+	NGNFS_MSG_ENCODE_NONE = 0,
+	NGNFS_MSG_ENCODE_TRIM,
+	NGNFS_MSG_ENCODE_LZ,
+};
+
+/*
+ * Transports encode into a buffer with this much room, encoded blocks
+ * that don't shrink are larger than the raw block by their header.
+ */
+static inline size_t ngnfs_msg_encode_room(struct ngnfs_msg_desc *mdesc)
+{
+	return mdesc->data_size + ngnfs_msg_nr_data_pages(mdesc) * sizeof(struct ngnfs_msg_block_enc);
+}
+
+int ngnfs_msg_parse_encoding(int *enc, char *str);
+int ngnfs_msg_set_encoding(struct ngnfs_fs_info *nfi, int enc);
+u32 ngnfs_msg_encode_data(struct ngnfs_fs_info *nfi, void *dst, struct ngnfs_msg_desc *mdesc);
+int ngnfs_msg_decode_data(void *src, u32 size, struct page **pages, u32 *data_size);
+
 u8 ngnfs_msg_err(int eno);
 int ngnfs_msg_errno(u8 err);
 
 int ngnfs_msg_verify_header(struct ngnfs_msg_header *hdr);
+int ngnfs_msg_priority(u8 type);
+
+struct ngnfs_peer;
 
+struct ngnfs_peer *ngnfs_msg_get_peer(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr);
+struct ngnfs_peer *ngnfs_msg_find_peer(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr);
+void ngnfs_msg_put_peer(struct ngnfs_fs_info *nfi, struct ngnfs_peer *peer);
+bool ngnfs_msg_peer_is_shutdown(struct ngnfs_peer *peer);
+int ngnfs_msg_peer_window(struct ngnfs_peer *peer);
+int ngnfs_msg_send_peer(struct ngnfs_fs_info *nfi, struct ngnfs_peer *peer,
+			struct ngnfs_msg_desc *mdesc);
 int ngnfs_msg_send(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc);
-int ngnfs_msg_recv(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc);
+int ngnfs_msg_recv(struct ngnfs_fs_info *nfi, void *info, struct ngnfs_msg_desc *mdesc);
 int ngnfs_msg_accept(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr, void *arg);
+void ngnfs_msg_peer_shutdown(struct ngnfs_fs_info *nfi, void *info, int err);
 
 /*
  * The receive path does basic checks of the incoming receive packet.
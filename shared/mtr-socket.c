@@ -17,6 +17,7 @@
 #include "shared/msg.h"
 #include "shared/mtr-socket.h"
 #include "shared/thread.h"
+#include "shared/trace.h"
 
 /*
  * Provide a msg transport based on threads using sockets.
@@ -26,8 +27,8 @@ struct socket_peer_info {
 	struct ngnfs_fs_info *nfi;
 	struct sockaddr_in addr;
 	wait_queue_head_t waitq;
-	struct cds_wfcq_head send_q_head;
-	struct cds_wfcq_tail send_q_tail;
+	struct cds_wfcq_head send_q_head[NGNFS_MSG_PRIO__NR];
+	struct cds_wfcq_tail send_q_tail[NGNFS_MSG_PRIO__NR];
 	struct thread connect_thr;
 	struct thread listen_thr;
 	struct thread send_thr;
@@ -35,6 +36,7 @@ struct socket_peer_info {
 	int fd;
 	int err;
 	int shutdown;
+	int listening;
 };
 
 struct socket_send_buf {
@@ -52,11 +54,14 @@ struct socket_send_buf {
  */
 static void shutdown_peer(struct socket_peer_info *pinf, int err)
 {
+	trace_ngnfs_socket_shutdown(&pinf->addr, err);
+
 	if (uatomic_cmpxchg(&pinf->shutdown, 0, 1) == 0) {
 		thread_stop_indicate(&pinf->connect_thr);
 		thread_stop_indicate(&pinf->listen_thr);
 		thread_stop_indicate(&pinf->send_thr);
 		thread_stop_indicate(&pinf->recv_thr);
+		wake_up(&pinf->waitq);
 		if (pinf->fd >= 0)
 			shutdown(pinf->fd, SHUT_RDWR);
 	}
@@ -64,6 +69,9 @@ static void shutdown_peer(struct socket_peer_info *pinf, int err)
 	/* don't really mind if this races */
 	if (err < 0 && pinf->err == 0)
 		pinf->err = err;
+
+	if (!pinf->listening)
+		ngnfs_msg_peer_shutdown(pinf->nfi, pinf, err);
 }
 
 typedef ssize_t (*iovec_func)(int fd, const struct iovec *iov, int iovcnt);
@@ -117,28 +125,81 @@ static int iov_append(struct iovec *iov, int iovcnt, void *base, size_t len)
 	return iovcnt + 1;
 }
 
+/*
+ * Foreground messages are sent before background messages, but after
+ * every SEND_BG_SHARE foreground messages a waiting background message
+ * is sent so that writeback isn't starved.
+ */
+#define SEND_BG_SHARE	4
+
+static bool send_queues_empty(struct cds_wfcq_head *heads, struct cds_wfcq_tail *tails)
+{
+	int i;
+
+	for (i = 0; i < NGNFS_MSG_PRIO__NR; i++) {
+		if (!cds_wfcq_empty(&heads[i], &tails[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Dequeue the next message to send from the private lanes.  We splice
+ * in newly queued messages before each message so that a foreground
+ * message doesn't wait behind a long run of spliced background
+ * messages.
+ */
+static struct cds_wfcq_node *dequeue_send(struct socket_peer_info *pinf,
+					  struct cds_wfcq_head *heads,
+					  struct cds_wfcq_tail *tails, int *fg_sent)
+{
+	struct cds_wfcq_node *node = NULL;
+	int i;
+
+	for (i = 0; i < NGNFS_MSG_PRIO__NR; i++) {
+		if (!cds_wfcq_empty(&pinf->send_q_head[i], &pinf->send_q_tail[i]))
+			__cds_wfcq_splice_nonblocking(&heads[i], &tails[i],
+						      &pinf->send_q_head[i], &pinf->send_q_tail[i]);
+	}
+
+	if (*fg_sent < SEND_BG_SHARE)
+		node = __cds_wfcq_dequeue_nonblocking(&heads[NGNFS_MSG_PRIO_FG],
+						      &tails[NGNFS_MSG_PRIO_FG]);
+	if (node) {
+		(*fg_sent)++;
+	} else {
+		*fg_sent = 0;
+		for (i = NGNFS_MSG_PRIO__NR - 1; i >= 0 && !node; i--)
+			node = __cds_wfcq_dequeue_nonblocking(&heads[i], &tails[i]);
+	}
+
+	/* testing the theory that a single splice will never need to block */
+	assert(node != CDS_WFCQ_WOULDBLOCK);
+	return node;
+}
+
 static void socket_send_thread(struct thread *thr, void *arg)
 {
 	struct socket_peer_info *pinf = arg;
+	struct cds_wfcq_head heads[NGNFS_MSG_PRIO__NR];
+	struct cds_wfcq_tail tails[NGNFS_MSG_PRIO__NR];
 	struct socket_send_buf *sbuf;
 	struct cds_wfcq_node *node;
-	struct cds_wfcq_head head;
-	struct cds_wfcq_tail tail;
 	struct iovec iov;
+	int fg_sent = 0;
 	int ret = 0;
+	int i;
 
-	cds_wfcq_init(&head, &tail);
+	for (i = 0; i < NGNFS_MSG_PRIO__NR; i++)
+		cds_wfcq_init(&heads[i], &tails[i]);
 
 	while (!thread_should_return(thr)) {
 
-		wait_event(&pinf->waitq, !cds_wfcq_empty(&pinf->send_q_head, &pinf->send_q_tail) ||
+		wait_event(&pinf->waitq, !send_queues_empty(pinf->send_q_head, pinf->send_q_tail) ||
 			   thread_should_return(thr));
 
-		__cds_wfcq_splice_nonblocking(&head, &tail, &pinf->send_q_head, &pinf->send_q_tail);
-
-		while ((node = __cds_wfcq_dequeue_nonblocking(&head, &tail))) {
-			/* testing the theory that a single splice will never need to block */
-			assert(node != CDS_WFCQ_WOULDBLOCK);
+		while ((node = dequeue_send(pinf, heads, tails, &fg_sent))) {
 			sbuf = caa_container_of(node, struct socket_send_buf, q_node);
 
 			iov_append(&iov, 0, &sbuf->hdr, sbuf->size);
@@ -153,36 +214,53 @@ static void socket_send_thread(struct thread *thr, void *arg)
 
 	ret = 0;
 out:
-	while ((node = __cds_wfcq_dequeue_nonblocking(&head, &tail))) {
-		assert(node != CDS_WFCQ_WOULDBLOCK);
-		sbuf = caa_container_of(node, struct socket_send_buf, q_node);
-		free(sbuf);
+	for (i = 0; i < NGNFS_MSG_PRIO__NR; i++) {
+		while ((node = __cds_wfcq_dequeue_nonblocking(&heads[i], &tails[i]))) {
+			assert(node != CDS_WFCQ_WOULDBLOCK);
+			sbuf = caa_container_of(node, struct socket_send_buf, q_node);
+			free(sbuf);
+		}
 	}
 
 	shutdown_peer(pinf, ret);
 }
 
+/*
+ * Each message's data payload is received into newly allocated pages
+ * which are then released once the recv handler returns.  Handlers
+ * take their own page references if they need them.  Encoded payloads
+ * are received into a buffer and decoded into the pages.
+ */
+#define RECV_MAX_PAGES DIV_ROUND_UP(NGNFS_MSG_MAX_DATA_SIZE, PAGE_SIZE)
+
 static void socket_recv_thread(struct thread *thr, void *arg)
 {
 	struct socket_peer_info *pinf = arg;
+	struct page *data_pages[RECV_MAX_PAGES] = { NULL, };
 	struct page *ctl_page = NULL;
 	struct ngnfs_msg_header hdr;
 	struct ngnfs_msg_desc mdesc;
-	struct iovec iov[3];
+	struct iovec iov[1 + RECV_MAX_PAGES];
+	void *enc_buf = NULL;
+	unsigned int nr_pages;
+	unsigned int i;
+	size_t size;
 	int iovcnt;
 	int ret;
 
 	/* we'll want sub page alloc */
-	BUILD_BUG_ON(PAGE_SIZE != NGNFS_MSG_MAX_DATA_SIZE);
+	BUILD_BUG_ON(NGNFS_MSG_MAX_CTL_SIZE > PAGE_SIZE);
 
 	ctl_page = alloc_page(GFP_NOFS);
-	if (!ctl_page) {
+	enc_buf = malloc(NGNFS_MSG_MAX_DATA_SIZE);
+	if (!ctl_page || !enc_buf) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
 	mdesc.addr = &pinf->addr;
 	mdesc.ctl_buf = page_address(ctl_page);
+	mdesc.data_pages = data_pages;
 
 	ret = 0;
 	while (!thread_should_return(thr)) {
@@ -196,38 +274,52 @@ static void socket_recv_thread(struct thread *thr, void *arg)
 		if (ret < 0)
 			break;
 
-		mdesc.data_size = le16_to_cpu(hdr.data_size);
-		mdesc.ctl_size = hdr.ctl_size;
+		mdesc.data_size = le32_to_cpu(hdr.data_size);
+		mdesc.ctl_size = le16_to_cpu(hdr.ctl_size);
+		mdesc.req_id = le32_to_cpu(hdr.req_id);
 		mdesc.type = hdr.type;
 
-		if (mdesc.data_size) {
-			mdesc.data_page = alloc_page(GFP_NOFS);
-			if (!mdesc.data_page) {
-				ret = -ENOMEM;
-				break;
-			}
+		iovcnt = iov_append(iov, 0, page_address(ctl_page), mdesc.ctl_size);
+		if (hdr.flags & NGNFS_MSG_HDR_F_ENCODED) {
+			iovcnt = iov_append(iov, iovcnt, enc_buf, mdesc.data_size);
+			nr_pages = 0;
 		} else {
-			mdesc.data_page = NULL;
+			nr_pages = ngnfs_msg_nr_data_pages(&mdesc);
 		}
 
-		iovcnt = iov_append(iov, 0, page_address(ctl_page), mdesc.ctl_size);
-		iovcnt = iov_append(iov, iovcnt, page_address(mdesc.data_page), mdesc.data_size);
+		for (i = 0; i < nr_pages; i++) {
+			data_pages[i] = alloc_page(GFP_NOFS);
+			if (!data_pages[i]) {
+				ret = -ENOMEM;
+				break;
+			}
 
-		ret = whole_iovec(readv, pinf->fd, iov, iovcnt);
-		if (ret < 0)
-			break;
+			size = min_t(size_t, mdesc.data_size - (i << PAGE_SHIFT), PAGE_SIZE);
+			iovcnt = iov_append(iov, iovcnt, page_address(data_pages[i]), size);
+		}
 
-		ret = ngnfs_msg_recv(pinf->nfi, &mdesc);
+		if (ret == 0)
+			ret = whole_iovec(readv, pinf->fd, iov, iovcnt);
+		if (ret == 0 && (hdr.flags & NGNFS_MSG_HDR_F_ENCODED)) {
+			ret = ngnfs_msg_decode_data(enc_buf, mdesc.data_size, data_pages,
+						    &mdesc.data_size);
+			nr_pages = RECV_MAX_PAGES;
+		}
+		if (ret == 0)
+			ret = ngnfs_msg_recv(pinf->nfi, pinf, &mdesc);
 
-		if (mdesc.data_page) {
-			put_page(mdesc.data_page);
-			mdesc.data_page = NULL;
+		for (i = 0; i < nr_pages && data_pages[i]; i++) {
+			put_page(data_pages[i]);
+			data_pages[i] = NULL;
 		}
 		if (ret < 0)
 			break;
 	}
 
 out:
+	if (ctl_page)
+		put_page(ctl_page);
+	free(enc_buf);
 	shutdown_peer(pinf, ret);
 }
 
@@ -270,8 +362,8 @@ static void socket_connect_thread(struct thread *thr, void *arg)
 
 	ret = connect(fd, (struct sockaddr *)&pinf->addr, sizeof(pinf->addr));
 	if (ret < 0) {
-		ret = -ret;
-		log("error creating send thread: "ENOF, ENOA(-ret));
+		ret = -errno;
+		log("error connecting to "IPV4F": "ENOF, IPV4A(&pinf->addr), ENOA(-ret));
 		goto out;
 	}
 
@@ -284,6 +376,7 @@ static void socket_connect_thread(struct thread *thr, void *arg)
 
 	ret = start_send_recv(pinf);
 out:
+	trace_ngnfs_socket_connect(&pinf->addr, ret);
 	if (fd >= 0)
 		close(fd);
 	if (ret < 0)
@@ -317,6 +410,8 @@ static void socket_listen_thread(struct thread *thr, void *arg)
 			break;
 		}
 
+		trace_ngnfs_socket_accept(&addr);
+
 		ret = set_connected_options(fd) ?:
 		      ngnfs_msg_accept(pinf->nfi, &addr, &fd);
 		if (ret < 0) {
@@ -334,10 +429,12 @@ static void socket_listen_thread(struct thread *thr, void *arg)
 static void socket_init_peer(void *info, struct ngnfs_fs_info *nfi)
 {
 	struct socket_peer_info *pinf = info;
+	int i;
 
 	pinf->nfi = nfi;
 	init_waitqueue_head(&pinf->waitq);
-	cds_wfcq_init(&pinf->send_q_head, &pinf->send_q_tail);
+	for (i = 0; i < NGNFS_MSG_PRIO__NR; i++)
+		cds_wfcq_init(&pinf->send_q_head[i], &pinf->send_q_tail[i]);
 	thread_init(&pinf->connect_thr);
 	thread_init(&pinf->listen_thr);
 	thread_init(&pinf->send_thr);
@@ -407,6 +504,7 @@ static void *socket_start_listen(struct ngnfs_fs_info *nfi, struct sockaddr_in *
 	}
 
 	socket_init_peer(pinf, nfi);
+	pinf->listening = 1;
 
 	pinf->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (pinf->fd < 0) {
@@ -470,8 +568,13 @@ static int socket_send(void *info, struct ngnfs_msg_desc *mdesc)
 {
 	struct socket_peer_info *pinf = info;
 	struct socket_send_buf *sbuf;
+	unsigned int nr_pages;
+	unsigned int i;
+	size_t size;
+	u32 enc_size;
 	void *data;
 	void *ctl;
+	int prio;
 	int ret;
 
 	if (pinf->err) {
@@ -479,7 +582,8 @@ static int socket_send(void *info, struct ngnfs_msg_desc *mdesc)
 		goto out;
 	}
 
-	sbuf = malloc(sizeof(struct socket_send_buf) + mdesc->ctl_size + mdesc->data_size);
+	sbuf = malloc(sizeof(struct socket_send_buf) + mdesc->ctl_size +
+		      ngnfs_msg_encode_room(mdesc));
 	if (!sbuf) {
 		ret = -ENOMEM;
 		goto out;
@@ -488,19 +592,34 @@ static int socket_send(void *info, struct ngnfs_msg_desc *mdesc)
 	/* XXX crc not used yet */
 	cds_wfcq_node_init(&sbuf->q_node);
 	sbuf->size = sizeof(struct ngnfs_msg_header) + mdesc->ctl_size + mdesc->data_size;
-	sbuf->hdr.data_size = cpu_to_le16(mdesc->data_size);
-	sbuf->hdr.ctl_size = mdesc->ctl_size;
+	sbuf->hdr.data_size = cpu_to_le32(mdesc->data_size);
+	sbuf->hdr.req_id = cpu_to_le32(mdesc->req_id);
+	sbuf->hdr.ctl_size = cpu_to_le16(mdesc->ctl_size);
 	sbuf->hdr.type = mdesc->type;
+	sbuf->hdr.flags = 0;
 
 	ctl = &sbuf->hdr + 1;
 	data = ctl + mdesc->ctl_size;
 
 	if (mdesc->ctl_size)
 		memcpy(ctl, mdesc->ctl_buf, mdesc->ctl_size);
-	if (mdesc->data_size)
-		memcpy(data, page_address(mdesc->data_page), mdesc->data_size);
 
-	cds_wfcq_enqueue(&pinf->send_q_head, &pinf->send_q_tail, &sbuf->q_node);
+	enc_size = ngnfs_msg_encode_data(pinf->nfi, data, mdesc);
+	if (enc_size > 0) {
+		sbuf->size -= mdesc->data_size - enc_size;
+		sbuf->hdr.data_size = cpu_to_le32(enc_size);
+		sbuf->hdr.flags = NGNFS_MSG_HDR_F_ENCODED;
+	} else {
+		nr_pages = ngnfs_msg_nr_data_pages(mdesc);
+		for (i = 0; i < nr_pages; i++) {
+			size = min_t(size_t, mdesc->data_size - (i << PAGE_SHIFT), PAGE_SIZE);
+			memcpy(data, page_address(mdesc->data_pages[i]), size);
+			data += size;
+		}
+	}
+
+	prio = ngnfs_msg_priority(mdesc->type);
+	cds_wfcq_enqueue(&pinf->send_q_head[prio], &pinf->send_q_tail[prio], &sbuf->q_node);
 	wake_up(&pinf->waitq);
 	ret = 0;
 out:
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Counters and histograms that each layer records as it works.
+ *
+ * Each thread records in its own private stats so that recording
+ * doesn't lock or share cachelines with other threads.  Readers walk
+ * all the registered threads and sum their stats into a snapshot.  The
+ * snapshot isn't atomic, a count and histogram that are recorded
+ * together might be seen before and after the other was updated.
+ *
+ * Only threads started through the thread wrappers are registered,
+ * other threads (urcu's, say) don't record stats.  A thread's stats are
+ * added to the totals of exited threads as it unregisters.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "shared/lk/barrier.h"
+#include "shared/lk/kernel.h"
+#include "shared/lk/list.h"
+#include "shared/lk/mutex.h"
+#include "shared/lk/rwonce.h"
+
+#include "shared/hist.h"
+#include "shared/stats.h"
+#include "shared/urcu.h"
+
+struct stats_thread {
+	struct list_head head;
+	bool registered;
+	u64 counters[STAT__NR];
+	struct hist *hists[STAT_HIST__NR];
+};
+
+typedef struct stats_thread stats_tls_t;
+static DEFINE_URCU_TLS(stats_tls_t, stats_tls);
+
+static DEFINE_MUTEX(stats_mutex);
+static LIST_HEAD(stats_threads);
+static struct stats_thread exited_stats;
+
+/*
+ * Array entries are only initialized for the first of their counters,
+ * the rest are printed with their index.
+ */
+static const struct stat_desc {
+	char *name;
+	unsigned int nr;
+} counter_descs[STAT__NR] = {
+	[STAT_BLOCK_GET_HIT]		= { "block_get_hit", 1 },
+	[STAT_BLOCK_GET_MISS]		= { "block_get_miss", 1 },
+	[STAT_BLOCK_DIRTIED]		= { "block_dirtied", 1 },
+	[STAT_BLOCK_DIRTY_LIMIT_WAITS]	= { "block_dirty_limit_waits", 1 },
+	[STAT_BLOCK_DIRTY_RESTARTS]	= { "block_dirty_restarts", 1 },
+	[STAT_BLOCK_WRITEBACK_SETS]	= { "block_writeback_sets", 1 },
+	[STAT_BLOCK_WRITEBACK_BLOCKS]	= { "block_writeback_blocks", 1 },
+	[STAT_BLOCK_IO_ERRORS]		= { "block_io_errors", 1 },
+	[STAT_BLOCK_FREED]		= { "block_freed", 1 },
+	[STAT_TXN_EXECUTED]		= { "txn_executed", 1 },
+	[STAT_TXN_ERRORS]		= { "txn_errors", 1 },
+	[STAT_MSG_SEND_MSGS]		= { "msg_send_msgs", NGNFS_MSG__NR },
+	[STAT_MSG_SEND_BYTES]		= { "msg_send_bytes", NGNFS_MSG__NR },
+	[STAT_MSG_RECV_MSGS]		= { "msg_recv_msgs", NGNFS_MSG__NR },
+	[STAT_MSG_RECV_BYTES]		= { "msg_recv_bytes", NGNFS_MSG__NR },
+	[STAT_MSG_RESENDS]		= { "msg_resends", 1 },
+	[STAT_AIO_SUBMITTED]		= { "aio_submitted", 1 },
+	[STAT_AIO_BLOCKS]		= { "aio_blocks", 1 },
+};
+
+static char *hist_names[STAT_HIST__NR] = {
+	[STAT_HIST_TXN_EXECUTE_NS]	= "txn_execute_ns",
+	[STAT_HIST_MSG_REQUEST_NS]	= "msg_request_ns",
+	[STAT_HIST_AIO_IO_NS]		= "aio_io_ns",
+	[STAT_HIST_AIO_INFLIGHT]	= "aio_inflight",
+};
+
+/*
+ * Only the owning thread modifies its counters, the write just has to
+ * be atomic for racing readers.
+ */
+void stats_add(unsigned int nr, u64 val)
+{
+	struct stats_thread *st = &URCU_TLS(stats_tls);
+
+	if (st->registered)
+		WRITE_ONCE(st->counters[nr], st->counters[nr] + val);
+}
+
+/*
+ * Histograms are allocated as they're first recorded as most threads
+ * only record a few of them.  Values are dropped if allocation fails.
+ */
+void stats_hist_add(unsigned int nr, u64 val)
+{
+	struct stats_thread *st = &URCU_TLS(stats_tls);
+	struct hist *hi;
+
+	if (!st->registered)
+		return;
+
+	hi = st->hists[nr];
+	if (!hi) {
+		hi = malloc(sizeof(struct hist));
+		if (!hi)
+			return;
+		hist_init(hi);
+		smp_wmb(); /* init before publishing to readers */
+		WRITE_ONCE(st->hists[nr], hi);
+	}
+
+	hist_add(hi, val);
+}
+
+static void add_stats(struct stats_thread *dst, struct stats_thread *src)
+{
+	struct hist *hi;
+	unsigned int i;
+
+	for (i = 0; i < STAT__NR; i++)
+		dst->counters[i] += READ_ONCE(src->counters[i]);
+
+	for (i = 0; i < STAT_HIST__NR; i++) {
+		hi = READ_ONCE(src->hists[i]);
+		if (hi) {
+			smp_rmb(); /* pointer before init contents */
+			hist_merge(dst->hists[i], hi);
+		}
+	}
+}
+
+static void free_hists(struct stats_thread *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < STAT_HIST__NR; i++) {
+		free(st->hists[i]);
+		st->hists[i] = NULL;
+	}
+}
+
+static int alloc_hists(struct stats_thread *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < STAT_HIST__NR; i++) {
+		st->hists[i] = malloc(sizeof(struct hist));
+		if (!st->hists[i]) {
+			free_hists(st);
+			return -ENOMEM;
+		}
+		hist_init(st->hists[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * Called by the thread wrappers, threads must unregister before they
+ * exit so that readers don't walk their freed TLS.
+ */
+void stats_register_thread(void)
+{
+	struct stats_thread *st = &URCU_TLS(stats_tls);
+
+	memset(st, 0, sizeof(struct stats_thread));
+
+	mutex_lock(&stats_mutex);
+	list_add_tail(&st->head, &stats_threads);
+	st->registered = true;
+	mutex_unlock(&stats_mutex);
+}
+
+/*
+ * Add the thread's stats to the exited totals.  The totals take the
+ * first exiting thread's histograms rather than allocating their own.
+ */
+void stats_unregister_thread(void)
+{
+	struct stats_thread *st = &URCU_TLS(stats_tls);
+	unsigned int i;
+
+	if (!st->registered)
+		return;
+
+	mutex_lock(&stats_mutex);
+
+	list_del_init(&st->head);
+	st->registered = false;
+
+	for (i = 0; i < STAT_HIST__NR; i++) {
+		if (st->hists[i] && !exited_stats.hists[i]) {
+			exited_stats.hists[i] = st->hists[i];
+			st->hists[i] = NULL;
+		}
+	}
+	for (i = 0; i < STAT__NR; i++)
+		exited_stats.counters[i] += st->counters[i];
+	for (i = 0; i < STAT_HIST__NR; i++) {
+		if (st->hists[i])
+			hist_merge(exited_stats.hists[i], st->hists[i]);
+	}
+
+	mutex_unlock(&stats_mutex);
+
+	free_hists(st);
+}
+
+static void print_hist(char *name, struct hist *hi)
+{
+	if (hi->nr == 0)
+		return;
+
+	printf("%s nr %llu min %llu mean %llu p50 %llu p99 %llu p99.9 %llu max %llu\n",
+	       name, hi->nr, hi->min, hi->sum / hi->nr, hist_percentile(hi, 500),
+	       hist_percentile(hi, 990), hist_percentile(hi, 999), hi->max);
+}
+
+/*
+ * Print a snapshot of the sum of all threads' stats.  Counters in
+ * arrays and histograms are only printed once they've recorded values.
+ */
+int stats_print(void)
+{
+	struct stats_thread *snap;
+	struct stats_thread *st;
+	const struct stat_desc *desc;
+	unsigned int i;
+	unsigned int j;
+	int ret;
+
+	snap = calloc(1, sizeof(struct stats_thread));
+	if (!snap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = alloc_hists(snap);
+	if (ret < 0)
+		goto out;
+
+	mutex_lock(&stats_mutex);
+	add_stats(snap, &exited_stats);
+	list_for_each_entry(st, &stats_threads, head)
+		add_stats(snap, st);
+	mutex_unlock(&stats_mutex);
+
+	for (i = 0; i < STAT__NR; i += desc->nr) {
+		desc = &counter_descs[i];
+		if (desc->nr == 1) {
+			printf("%s %llu\n", desc->name, snap->counters[i]);
+			continue;
+		}
+
+		for (j = 0; j < desc->nr; j++) {
+			if (snap->counters[i + j])
+				printf("%s[%u] %llu\n", desc->name, j, snap->counters[i + j]);
+		}
+	}
+
+	for (i = 0; i < STAT_HIST__NR; i++)
+		print_hist(hist_names[i], snap->hists[i]);
+
+	fflush(stdout);
+	ret = 0;
+out:
+	if (snap) {
+		free_hists(snap);
+		free(snap);
+	}
+	return ret;
+}
+
+/*
+ * Called after all threads have unregistered.
+ */
+void stats_destroy(void)
+{
+	mutex_lock(&stats_mutex);
+	free_hists(&exited_stats);
+	mutex_unlock(&stats_mutex);
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_SHARED_STATS_H
+#define NGNFS_SHARED_STATS_H
+
+#include "shared/lk/types.h"
+
+#include "shared/format-msg.h"
+
+/*
+ * Counters that are incremented by each layer.  Per-type message
+ * counters are indexed by the message type.
+ *
+ * Txns aren't retried yet.  A txn that races with other dirtying waits
+ * and restarts in the block cache's _dirty_begin, which is counted by
+ * STAT_BLOCK_DIRTY_RESTARTS.
+ */
+enum {
+	STAT_BLOCK_GET_HIT = 0,
+	STAT_BLOCK_GET_MISS,
+	STAT_BLOCK_DIRTIED,
+	STAT_BLOCK_DIRTY_LIMIT_WAITS,
+	STAT_BLOCK_DIRTY_RESTARTS,
+	STAT_BLOCK_WRITEBACK_SETS,
+	STAT_BLOCK_WRITEBACK_BLOCKS,
+	STAT_BLOCK_IO_ERRORS,
+	STAT_BLOCK_FREED,
+	STAT_TXN_EXECUTED,
+	STAT_TXN_ERRORS,
+	STAT_MSG_SEND_MSGS,
+	STAT_MSG_SEND_BYTES = STAT_MSG_SEND_MSGS + NGNFS_MSG__NR,
+	STAT_MSG_RECV_MSGS = STAT_MSG_SEND_BYTES + NGNFS_MSG__NR,
+	STAT_MSG_RECV_BYTES = STAT_MSG_RECV_MSGS + NGNFS_MSG__NR,
+	STAT_MSG_RESENDS = STAT_MSG_RECV_BYTES + NGNFS_MSG__NR,
+	STAT_AIO_SUBMITTED,
+	STAT_AIO_BLOCKS,
+	STAT__NR,
+};
+
+/*
+ * Histograms of latencies in nanoseconds, or of other values as named.
+ */
+enum {
+	STAT_HIST_TXN_EXECUTE_NS = 0,
+	STAT_HIST_MSG_REQUEST_NS,
+	STAT_HIST_AIO_IO_NS,
+	STAT_HIST_AIO_INFLIGHT,
+	STAT_HIST__NR,
+};
+
+void stats_add(unsigned int nr, u64 val);
+void stats_hist_add(unsigned int nr, u64 val);
+
+static inline void stats_inc(unsigned int nr)
+{
+	stats_add(nr, 1);
+}
+
+int stats_print(void);
+
+void stats_register_thread(void);
+void stats_unregister_thread(void);
+void stats_destroy(void);
+
+#endif
@@ -14,6 +14,7 @@
 #include "shared/lk/bitops.h"
 
 #include "shared/log.h"
+#include "shared/stats.h"
 #include "shared/thread.h"
 #include "shared/trace.h"
 
@@ -29,10 +30,12 @@ static void register_thread(void)
 	rcu_register_thread();
 	ret = trace_register_thread();
 	assert(ret == 0); /* XXX */
+	stats_register_thread();
 }
 
 static void unregister_thread(void)
 {
+	stats_unregister_thread();
 	trace_unregister_thread();
 	rcu_unregister_thread();
 }
@@ -73,12 +76,15 @@ int thread_prepare_main(void)
 void thread_finish_main(void)
 {
 	unregister_thread();
+	stats_destroy();
 	trace_destroy();
 }
 
 /*
  * Having blocked signals for other threads, block waiting for signals
  * in a main monitoring thread so other threads aren't affected.
+ * SIGUSR1 reloads the enabled trace events, SIGUSR2 prints a snapshot
+ * of the stats, other signals exit.
  */
 int thread_sigwait(void)
 {
@@ -95,6 +101,16 @@ int thread_sigwait(void)
 			break;
 		}
 
+		if (sig == SIGUSR1) {
+			trace_reload_events();
+			continue;
+		}
+
+		if (sig == SIGUSR2) {
+			stats_print();
+			continue;
+		}
+
 		printf("got signal %u, exiting\n", sig);
 		trace_flush();
 		exit(1);
@@ -1,64 +1,116 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+#define _GNU_SOURCE /* gettid, sched_getcpu */
+
 #include <unistd.h>
+#include <sched.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 
+#include "shared/lk/barrier.h"
 #include "shared/lk/bitops.h"
 #include "shared/lk/build_bug.h"
 #include "shared/lk/byteorder.h"
+#include "shared/lk/cache.h"
+#include "shared/lk/cmpxchg.h"
 #include "shared/lk/err.h"
+#include "shared/lk/kernel.h"
+#include "shared/lk/limits.h"
 #include "shared/lk/list.h"
 #include "shared/lk/math.h"
 #include "shared/lk/minmax.h"
 #include "shared/lk/mutex.h"
+#include "shared/lk/time64.h"
+#include "shared/lk/timekeeping.h"
 #include "shared/lk/wait.h"
 
 #include "shared/format-trace.h"
+#include "shared/log.h"
 #include "shared/thread.h"
 #include "shared/trace.h"
 #include "shared/urcu.h"
 
 #define BUF_SIZE (32 * 1024)
-#define NR_BUFS (1024 * 1024 / BUF_SIZE)
+#define MAX_BUFS (16 * 1024 * 1024 / BUF_SIZE)
+#define DETACH_NS (1 * NSEC_PER_SEC)
+
+#define EVENTS_SUFFIX ".events"
+#define EVENTS_SPEC_SIZE (64 * 1024)
 
 /*
- * userspace tracing stores tracing events in private per-thread buffer
- * pools.  As buffers fill they're handed to a writing thread.  When the
- * writing thread is done they're available for storing again.  If all
- * the buffers are writing then trace events are dropped.
+ * userspace tracing stores tracing events in per-thread buffers.  As
+ * buffers fill they're handed to a writing thread.  When the writing
+ * thread is done they're returned to a pool shared by all threads.
+ *
+ * Buffers are only allocated as threads first store events, and the
+ * number of buffers is bounded.  Trace events are dropped if all the
+ * buffers are full and waiting to be written.  The writer periodically
+ * takes buffers from all the threads so that idle threads don't hold
+ * on to partial buffers, and it frees buffers that sat unused in the
+ * pool for a period.  Memory use follows trace activity rather than
+ * the number of threads.
+ *
+ * Each event's header records when it was stored, and by which thread
+ * on which cpu, so that traces can be used to measure latencies.  The
+ * monotonic clock and getcpu are vdso calls so this costs tens of
+ * nanoseconds per event.
+ *
+ * Each event can be enabled or disabled at runtime.  The events to
+ * enable are read from a control file next to the trace file, named
+ * with an .events suffix, as tracing is set up and whenever the process
+ * receives SIGUSR1.  All events are enabled if there's no control file.
+ *
+ * Instead of appending to the trace file, threads can store events
+ * directly in a ring that's mapped from the trace file.  Threads
+ * reserve records by advancing the ring's head and mark them stored
+ * once their event is filled.  There's no writing thread, readers can
+ * follow the ring as events are stored, and the most recent events
+ * survive the process crashing.
  */
 
 struct trace_info {
 	struct mutex mutex;
 	struct cds_list_head threads;
 
+	/* protected by the mutex */
+	struct list_head free_bufs;
+	unsigned int nr_bufs;
+	unsigned int nr_free;
+	unsigned int free_low;
+
+	unsigned long nr_dropped;
+
 	int fd;
+	char *events_path;
+	struct ngnfs_trace_ring_header *ring;
+	void *ring_data;
+	u64 ring_size;
 	wait_queue_head_t waitq;
 	struct thread write_thr;
 	struct cds_wfcq_head write_head;
 	struct cds_wfcq_tail write_tail;
 };
 
+/*
+ * A buffer is either in the free pool, being stored to by one thread,
+ * or queued for the writer.
+ */
 struct trace_buf {
-	int refcount;
 	struct cds_wfcq_node node;	/* sending to write thread */
-	struct list_head head;		/* private to appending thread */
-	unsigned long bits;
+	struct list_head head;		/* in free pool */
 	void *ptr;
 	size_t len;
 	size_t size;
 };
 
-enum {
-	TB_WRITING = 0,
-};
-
 struct trace_thread_private {
 	struct cds_list_head head;
-	struct list_head bufs;
 	struct trace_buf *storing_buf;
+	u64 ring_pos;
+	u32 tid;
 };
 
 typedef struct trace_thread_private tpriv_tls_t;
@@ -67,41 +119,125 @@ static DEFINE_URCU_TLS(tpriv_tls_t, tpriv_tls);
 /* see comment above trace_setup() */
 static struct trace_info *global_trinf = NULL;
 
-static struct trace_buf *alloc_tbuf(void)
+/* see trace_event_enabled() */
+unsigned long trace_event_bits[DIV_ROUND_UP(NGNFS_TRACE_EVENT_NR, BITS_PER_LONG)]
+	____cacheline_aligned;
+
+/*
+ * Get a buffer from the pool, allocating a new one if the pool is empty
+ * and we're under the limit.  Returns NULL if all the buffers are in
+ * use.
+ */
+static struct trace_buf *get_pool_tbuf(struct trace_info *trinf)
 {
 	struct trace_buf *tbuf;
+	bool alloc = false;
 
-	tbuf = malloc(sizeof(struct trace_buf) + BUF_SIZE);
+	mutex_lock(&trinf->mutex);
+	tbuf = list_first_entry_or_null(&trinf->free_bufs, struct trace_buf, head);
 	if (tbuf) {
-		tbuf->refcount = 1;
-		cds_wfcq_node_init(&tbuf->node);
+		list_del_init(&tbuf->head);
+		trinf->nr_free--;
+		trinf->free_low = min(trinf->free_low, trinf->nr_free);
+	} else if (trinf->nr_bufs < MAX_BUFS) {
+		trinf->nr_bufs++;
+		alloc = true;
+	}
+	mutex_unlock(&trinf->mutex);
+
+	if (alloc) {
+		tbuf = malloc(sizeof(struct trace_buf) + BUF_SIZE);
+		if (!tbuf) {
+			mutex_lock(&trinf->mutex);
+			trinf->nr_bufs--;
+			mutex_unlock(&trinf->mutex);
+			return NULL;
+		}
+
 		INIT_LIST_HEAD(&tbuf->head);
-		tbuf->bits = 0;
 		tbuf->ptr = (void *)(tbuf + 1);
-		tbuf->len = 0;
 		tbuf->size = BUF_SIZE;
 	}
 
+	if (tbuf) {
+		cds_wfcq_node_init(&tbuf->node);
+		tbuf->len = 0;
+	}
+
 	return tbuf;
 }
 
-static void put_tbuf(struct trace_buf *tbuf)
+static void put_pool_tbuf(struct trace_info *trinf, struct trace_buf *tbuf)
+{
+	mutex_lock(&trinf->mutex);
+	list_add(&tbuf->head, &trinf->free_bufs);
+	trinf->nr_free++;
+	mutex_unlock(&trinf->mutex);
+}
+
+/*
+ * Free the buffers that weren't used from the pool since the last time
+ * we trimmed it.
+ */
+static void trim_pool(struct trace_info *trinf)
 {
-	if (tbuf && uatomic_add_return(&tbuf->refcount, -1) == 0)
+	struct trace_buf *tbuf;
+	LIST_HEAD(list);
+	unsigned int nr;
+
+	mutex_lock(&trinf->mutex);
+	for (nr = trinf->free_low; nr > 0; nr--) {
+		tbuf = list_last_entry(&trinf->free_bufs, struct trace_buf, head);
+		list_move(&tbuf->head, &list);
+	}
+	trinf->nr_bufs -= trinf->free_low;
+	trinf->nr_free -= trinf->free_low;
+	trinf->free_low = trinf->nr_free;
+	mutex_unlock(&trinf->mutex);
+
+	while ((tbuf = list_first_entry_or_null(&list, struct trace_buf, head))) {
+		list_del(&tbuf->head);
 		free(tbuf);
+	}
 }
 
-static void get_tbuf(struct trace_buf *tbuf)
+/*
+ * Whoever clears a thread's storing_buf pointer owns the buffer and
+ * sends it to the writer.  The thread can still be storing into the
+ * buffer, the writer waits for an rcu grace period before using it.
+ */
+static void detach_storing_buf(struct trace_info *trinf, struct trace_thread_private *tpriv,
+			       struct trace_buf *tbuf)
 {
-	uatomic_add(&tbuf->refcount, 1);
+	if (tbuf && cmpxchg(&tpriv->storing_buf, tbuf, NULL) == tbuf) {
+		cds_wfcq_enqueue(&trinf->write_head, &trinf->write_tail, &tbuf->node);
+		wake_up(&trinf->waitq);
+	}
+}
+
+/*
+ * Send all the threads' storing bufs to the writer.  We hold the RCU
+ * lock while iterating over the threads.  Exiting threads will wait for
+ * our grace period to expire before freeing their tpriv.
+ */
+static void detach_all_storing_bufs(struct trace_info *trinf)
+{
+	struct trace_thread_private *tpriv;
+
+	rcu_read_lock();
+	cds_list_for_each_entry_rcu(tpriv, &trinf->threads, head)
+		detach_storing_buf(trinf, tpriv, rcu_dereference(tpriv->storing_buf));
+	rcu_read_unlock();
 }
 
 /*
  * When buffers are ready to be written they're enqueued for the writing
- * thread.  Flush can enqueue bufs while threads are still storing into
- * them so we wait for an rcu grace period for stores to drain before
- * writing.  Once we're done writing we re-initialize the buffer, clear
- * the writing bit, and drop our reference.
+ * thread.  Threads can still be storing into the bufs so we wait for an
+ * rcu grace period for stores to drain before writing.  Once we're done
+ * writing the buffers go back to the pool.
+ *
+ * We also wake up periodically to write out the partial buffers of
+ * idle threads and to free buffers that the pool didn't need.
  */
 static void trace_write_thread(struct thread *thr, void *arg)
 {
@@ -111,19 +247,37 @@ static void trace_write_thread(struct thread *thr, void *arg)
 	struct cds_wfcq_tail tail;
 	struct iovec *iov = NULL;
 	struct trace_buf *tbuf;
-	LIST_HEAD(list);
+	unsigned long dropped;
+	u64 next_detach = 0;
 	ssize_t total;
 	ssize_t sret;
 	int iovsize = 0;
 	int iovcnt;
+	bool stop;
 	void *new;
 
 	cds_wfcq_init(&head, &tail);
 
 	/* always try to write traces before returning */
 	do {
-		wait_event(&trinf->waitq, !cds_wfcq_empty(&trinf->write_head, &trinf->write_tail) ||
-			   thread_should_return(thr));
+		wait_event_timeout(&trinf->waitq,
+				   !cds_wfcq_empty(&trinf->write_head, &trinf->write_tail) ||
+				   thread_should_return(thr), DETACH_NS);
+
+		stop = thread_should_return(thr);
+		if (stop || ktime_get_ns() >= next_detach) {
+			detach_all_storing_bufs(trinf);
+			trim_pool(trinf);
+			next_detach = ktime_get_ns() + DETACH_NS;
+
+			dropped = uatomic_xchg(&trinf->nr_dropped, 0);
+			if (dropped)
+				log("dropped %lu trace events, all %u trace buffers were in use",
+				    dropped, MAX_BUFS);
+		}
+
+		if (cds_wfcq_empty(&trinf->write_head, &trinf->write_tail))
+			continue;
 
 		__cds_wfcq_splice_nonblocking(&head, &tail, &trinf->write_head, &trinf->write_tail);
 
@@ -151,141 +305,180 @@ static void trace_write_thread(struct thread *thr, void *arg)
 		sret = writev(trinf->fd, iov, iovcnt);
 		assert(sret == total); /* XXX */
 
-		/* let destroy know we're done, usually does nothing */
-		wake_up(&trinf->waitq);
-
 		while ((node = __cds_wfcq_dequeue_nonblocking(&head, &tail))) {
 			tbuf = caa_container_of(node, struct trace_buf, node);
-
-			tbuf->len = 0;
-			cds_wfcq_node_init(&tbuf->node);
-			cmm_barrier(); /* re-init node before clearing writing enables use */
-			clear_bit(TB_WRITING, &tbuf->bits);
-			put_tbuf(tbuf);
+			put_pool_tbuf(trinf, tbuf);
 		}
-	} while (!thread_should_return(thr));
+
+		/* let flush and destroy know we're done, usually does nothing */
+		wake_up(&trinf->waitq);
+	} while (!stop);
 
 	free(iov);
 }
 
 /*
- * If we set the writing bit then grab a ref and enqueue the buf for the
- * writer.
+ * Reserve space for an event at the end of the thread's storing buf.
+ * Only the storing thread sets its storing_buf, others can only clear
+ * it as they send it to the writer.
  */
-static void try_enqueue_writing(struct trace_info *trinf, struct trace_buf *tbuf)
+static struct ngnfs_trace_event_header *reserve_buf(struct trace_info *trinf,
+						    struct trace_thread_private *tpriv,
+						    size_t total)
 {
-	if (!test_and_set_bit(TB_WRITING, &tbuf->bits)) {
-		cmm_barrier(); /* set bit before using tbuf */
-		get_tbuf(tbuf);
-		cds_wfcq_enqueue(&trinf->write_head, &trinf->write_tail, &tbuf->node);
-		wake_up(&trinf->waitq);
+	struct ngnfs_trace_event_header *hdr;
+	struct trace_buf *tbuf;
+
+	tbuf = rcu_dereference(tpriv->storing_buf);
+
+	if (tbuf && tbuf->len + total > tbuf->size) {
+		detach_storing_buf(trinf, tpriv, tbuf);
+		tbuf = NULL;
+	}
+
+	/* drop events until a buf is available */
+	if (!tbuf) {
+		tbuf = get_pool_tbuf(trinf);
+		if (!tbuf) {
+			uatomic_inc(&trinf->nr_dropped);
+			return NULL;
+		}
+
+		rcu_assign_pointer(tpriv->storing_buf, tbuf);
 	}
+
+	hdr = tbuf->ptr + tbuf->len;
+	tbuf->len += total;
+
+	return hdr;
+}
+
+/*
+ * Reserve a record in the ring by advancing its head.  If the record
+ * doesn't fit before the end of the ring then we also reserve the rest
+ * of the ring and fill it with a pad record, if it's large enough.
+ * Our record's pos is set once the event is stored by
+ * trace_store_commit().  Until then it can't match the record's
+ * position, whatever was left in the ring from earlier passes.
+ */
+static struct ngnfs_trace_event_header *reserve_ring(struct trace_info *trinf,
+						     struct trace_thread_private *tpriv,
+						     size_t total)
+{
+	struct ngnfs_trace_ring_header *rh = trinf->ring;
+	struct ngnfs_trace_ring_record *rec;
+	u64 size = trinf->ring_size;
+	__le64 old;
+	__le64 cur;
+	u64 head;
+	u64 pad;
+
+	total += sizeof(rec->pos);
+
+	cur = READ_ONCE(rh->head);
+	do {
+		old = cur;
+		head = le64_to_cpu(old);
+		pad = size - (head % size);
+		if (pad >= total)
+			pad = 0;
+	} while ((cur = cmpxchg(&rh->head, old, cpu_to_le64(head + pad + total))) != old);
+
+	if (pad >= sizeof(struct ngnfs_trace_ring_record)) {
+		rec = trinf->ring_data + (head % size);
+		memset(&rec->hdr, 0, sizeof(rec->hdr));
+		rec->hdr.size = cpu_to_le16(pad - sizeof(rec->pos));
+		smp_wmb(); /* pad hdr before pos marks it stored */
+		WRITE_ONCE(rec->pos, cpu_to_le64(head));
+	}
+
+	tpriv->ring_pos = head + pad;
+	rec = trinf->ring_data + (tpriv->ring_pos % size);
+	WRITE_ONCE(rec->pos, cpu_to_le64(U64_MAX));
+
+	return &rec->hdr;
 }
 
 /*
  * Return a pointer for the caller to store their new trace event.  The
  * caller is holding an RCU read lock the duration of their use of the
- * pointer.
+ * pointer and calls trace_store_commit() once they've stored their
+ * event.
  */
 void *trace_store_ptr(u16 id, size_t len)
 {
 	struct trace_thread_private *tpriv = &URCU_TLS(tpriv_tls);
 	struct trace_info *trinf = global_trinf;
 	struct ngnfs_trace_event_header *hdr;
-	struct trace_buf *tbuf;
 	size_t total;
-	void *ptr;
 
-	if (!trinf)
+	/* unregistered threads would never have their bufs detached */
+	if (!trinf || !tpriv->tid)
 		return NULL;
 
-	tbuf = rcu_dereference(tpriv->storing_buf);
-
 	/* total includes header and final alignment padding */
 	total = sizeof(struct ngnfs_trace_event_header) + round_up(len, sizeof(u64));
 
-	/* see if buffer is full or flush started writing it */
-	if (tbuf && ((tbuf->len + total > tbuf->size) || test_bit(TB_WRITING, &tbuf->bits))) {
-		try_enqueue_writing(trinf, tbuf);
-
-		/* move the writing buf to the end */
-		list_move_tail(&tbuf->head, &tpriv->bufs);
-		rcu_assign_pointer(tpriv->storing_buf, NULL);
-		tbuf = NULL;
-	}
-
-	/* try to get the next buf, dropping events until the next is done writing */
-	if (!tbuf) {
-		tbuf = list_first_entry_or_null(&tpriv->bufs, struct trace_buf, head);
-		if (!tbuf || test_bit(TB_WRITING, &tbuf->bits))
-			return NULL;
-
-		rcu_assign_pointer(tpriv->storing_buf, tbuf);
-	}
+	if (trinf->ring)
+		hdr = reserve_ring(trinf, tpriv, total);
+	else
+		hdr = reserve_buf(trinf, tpriv, total);
+	if (!hdr)
+		return NULL;
 
-	hdr = tbuf->ptr;
+	hdr->ns = cpu_to_le64(ktime_get_ns());
+	hdr->tid = cpu_to_le32(tpriv->tid);
 	hdr->id = cpu_to_le16(id);
 	hdr->size = cpu_to_le16(total);
+	hdr->cpu = cpu_to_le16(sched_getcpu());
+	memset(hdr->_pad, 0, sizeof(hdr->_pad));
 
-	ptr = (void *)(hdr + 1);
-	tbuf->len += total;
+	return hdr + 1;
+}
+
+/*
+ * Events in buffers are written once the rcu read lock is dropped,
+ * events in the ring are marked stored by setting their record's pos.
+ */
+void trace_store_commit(void *ptr)
+{
+	struct trace_thread_private *tpriv = &URCU_TLS(tpriv_tls);
+	struct trace_info *trinf = global_trinf;
+	struct ngnfs_trace_ring_record *rec;
 
-	return ptr;
+	if (trinf && trinf->ring) {
+		rec = ptr - sizeof(struct ngnfs_trace_ring_record);
+		smp_wmb(); /* event before pos marks it stored */
+		WRITE_ONCE(rec->pos, cpu_to_le64(tpriv->ring_pos));
+	}
 }
 
 /*
  * Flushing trace events makes all traces visible that were in thread
- * buffers before the flush call.  We iterate over all the threads, mark
- * their current storing bufs as writing, and send them to the writer.
- *
- * We hold the RCU lock while getting buf refs via the storing_buf
- * pointer.  Exiting threads will wait for our grace period to expire
- * before freeing their tpriv that we're iterating over.
+ * buffers before the flush call.  We send all the threads' current
+ * storing bufs to the writer and wait for it to write them.
  */
 void trace_flush(void)
 {
 	struct trace_info *trinf = global_trinf;
-	struct trace_thread_private *tpriv;
-	struct trace_buf *tbuf;
-
-	rcu_read_lock();
-
-	cds_list_for_each_entry_rcu(tpriv, &trinf->threads, head) {
-		tbuf = rcu_dereference(tpriv->storing_buf);
-		if (tbuf)
-			try_enqueue_writing(trinf, tbuf);
-	}
 
-	rcu_read_unlock();
+	detach_all_storing_bufs(trinf);
 
 	/* wait for writer to finish with queued bufs */
 	wait_event(&trinf->waitq, cds_wfcq_empty(&trinf->write_head, &trinf->write_tail));
 }
 
-static void put_list_bufs(struct list_head *list)
-{
-	struct trace_buf *tbuf;
-
-	while ((tbuf = list_first_entry_or_null(list, struct trace_buf, head))) {
-		list_del_init(&tbuf->head);
-		put_tbuf(tbuf);
-	}
-}
-
 /*
- * This presumes that threads are few and long lived.  We
- * unconditionally allocate large per-thread tracing buffers for all
- * threads, regardless of whether tracing is in use or not.  The urcu
- * tls helpers don't have a very useful init mechanism, so we initialize
- * newly allocated tpriv here as the first possible user in the thread.
+ * The urcu tls helpers don't have a very useful init mechanism, so we
+ * initialize newly allocated tpriv here as the first possible user in
+ * the thread.  Buffers aren't allocated until the thread stores its
+ * first event.
  */
 int trace_register_thread(void)
 {
 	struct trace_thread_private *tpriv = &URCU_TLS(tpriv_tls);
 	struct trace_info *trinf = global_trinf;
-	struct trace_buf *tbuf;
 	int ret;
-	int i;
 
 	if (!trinf) {
 		ret = 0;
@@ -299,19 +492,8 @@ int trace_register_thread(void)
 	}
 
 	CDS_INIT_LIST_HEAD(&tpriv->head);
-	INIT_LIST_HEAD(&tpriv->bufs);
 	tpriv->storing_buf = NULL;
-
-	for (i = 0; i < NR_BUFS; i++) {
-		tbuf = alloc_tbuf();
-		if (!tbuf) {
-			put_list_bufs(&tpriv->bufs);
-			ret = -ENOMEM;
-			goto out;
-		}
-
-		list_add(&tbuf->head, &tpriv->bufs);
-	}
+	tpriv->tid = gettid();
 
 	mutex_lock(&trinf->mutex);
 	cds_list_add_tail_rcu(&tpriv->head, &trinf->threads);
@@ -326,31 +508,21 @@ void trace_unregister_thread(void)
 {
 	struct trace_thread_private *tpriv = &URCU_TLS(tpriv_tls);
 	struct trace_info *trinf = global_trinf;
-	struct trace_buf *tbuf;
 
-	if (!trinf || !tpriv)
+	if (!trinf || !tpriv || !tpriv->tid)
 		return;
 
-	rcu_read_lock();
-
 	/* remove our thread from the threads list */
 	mutex_lock(&trinf->mutex);
 	cds_list_del_rcu(&tpriv->head);
 	mutex_unlock(&trinf->mutex);
 
-	/* start write on remaining partial buf (has to be idle, we'd be storing) */
-	tbuf = rcu_dereference(tpriv->storing_buf);
-	if (tbuf) {
-		try_enqueue_writing(trinf, tbuf);
-		rcu_assign_pointer(tpriv->storing_buf, NULL);
-	}
-	rcu_read_unlock();
-
-	/* wait for list/storing_buf readers (flush) to finish before putting/freeing */
-	if (tbuf)
-		synchronize_rcu();
+	/* stop storing and send our partial buf to the writer */
+	tpriv->tid = 0;
+	detach_storing_buf(trinf, tpriv, READ_ONCE(tpriv->storing_buf));
 
-	put_list_bufs(&tpriv->bufs);
+	/* wait for threads list readers (flush, writer) to finish with tpriv */
+	synchronize_rcu();
 	/*
 	 * XXX Not sure if we're responsible for freeing tpriv or not..
 	 * Seems so?
@@ -383,7 +555,16 @@ int trace_init(void)
 
 	mutex_init(&trinf->mutex);
 	CDS_INIT_LIST_HEAD(&trinf->threads);
+	INIT_LIST_HEAD(&trinf->free_bufs);
+	trinf->nr_bufs = 0;
+	trinf->nr_free = 0;
+	trinf->free_low = 0;
+	trinf->nr_dropped = 0;
 	trinf->fd = -1;
+	trinf->events_path = NULL;
+	trinf->ring = NULL;
+	trinf->ring_data = NULL;
+	trinf->ring_size = 0;
 	init_waitqueue_head(&trinf->waitq);
 	thread_init(&trinf->write_thr);
 	cds_wfcq_init(&trinf->write_head, &trinf->write_tail);
@@ -394,7 +575,53 @@ out:
 	return ret;
 }
 
-int trace_setup(char *trace_path)
+/*
+ * Allocate the ring file's blocks up front so that stores to the
+ * mapping can't fail to allocate, and then initialize the ring header.
+ * The magic is set last so readers don't see a partially initialized
+ * ring.
+ */
+static int setup_ring(struct trace_info *trinf, char *trace_path, u64 ring_size)
+{
+	struct ngnfs_trace_ring_header *rh;
+	size_t map_size = NGNFS_TRACE_RING_HEADER_SIZE + ring_size;
+	void *map;
+	int ret;
+
+	ret = -posix_fallocate(trinf->fd, 0, map_size);
+	if (ret < 0) {
+		log("error allocating %llu byte trace ring file '%s': "ENOF,
+		    (unsigned long long)map_size, trace_path, ENOA(-ret));
+		goto out;
+	}
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, trinf->fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		log("error mapping trace ring file '%s': "ENOF, trace_path, ENOA(-ret));
+		goto out;
+	}
+
+	rh = map;
+	rh->size = cpu_to_le64(ring_size);
+	rh->head = 0;
+	smp_wmb(); /* header before magic */
+	WRITE_ONCE(rh->magic, cpu_to_le64(NGNFS_TRACE_RING_MAGIC));
+
+	trinf->ring = rh;
+	trinf->ring_data = map + NGNFS_TRACE_RING_HEADER_SIZE;
+	trinf->ring_size = ring_size;
+	ret = 0;
+out:
+	return ret;
+}
+
+/*
+ * Events are appended to the trace file by the writing thread, or if
+ * ring_size is non-zero the trace file is recreated as a ring of that
+ * many bytes that threads store events in directly.
+ */
+int trace_setup(char *trace_path, u64 ring_size)
 {
 	struct trace_info *trinf = global_trinf;
 	int ret;
@@ -402,14 +629,28 @@ int trace_setup(char *trace_path)
 	if (!trinf)
 		return 0;
 
-	trinf->fd = open(trace_path, O_CREAT | O_WRONLY | O_APPEND, 0644);
+	if (ring_size)
+		trinf->fd = open(trace_path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	else
+		trinf->fd = open(trace_path, O_CREAT | O_WRONLY | O_APPEND, 0644);
 	if (trinf->fd < 0) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
+	if (asprintf(&trinf->events_path, "%s" EVENTS_SUFFIX, trace_path) < 0) {
+		trinf->events_path = NULL;
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	/* start writing thread after trinf is initialized for its _register_thread */
-	ret = thread_start(&trinf->write_thr, trace_write_thread, trinf);
+	if (ring_size)
+		ret = setup_ring(trinf, trace_path, ring_size);
+	else
+		ret = thread_start(&trinf->write_thr, trace_write_thread, trinf);
+
+	ret = ret ?: trace_reload_events();
 out:
 	if (ret < 0 && trinf->fd >= 0) {
 		close(trinf->fd);
@@ -419,6 +660,122 @@ out:
 	return ret;
 }
 
+/*
+ * Enable the events described by the spec and disable all others.  The
+ * spec's words, separated by whitespace or commas, are applied in order
+ * to an initially empty set.  "all" and "none" enable or disable every
+ * event, an event's name enables it, and a name prefixed with "-"
+ * disables it.  A name ending in "*" matches all the events that start
+ * with the preceding prefix.  Nothing changes if a name isn't found.
+ */
+int trace_set_events(char *spec)
+{
+	unsigned long bits[ARRAY_SIZE(trace_event_bits)] = { 0, };
+	char *saveptr = NULL;
+	bool enable;
+	bool prefix;
+	bool found;
+	char *name;
+	char *tok;
+	size_t len;
+	int nr = 0;
+	int id;
+	int i;
+
+	for (tok = strtok_r(spec, " \t\n,", &saveptr); tok; tok = strtok_r(NULL, " \t\n,", &saveptr)) {
+		enable = tok[0] != '-';
+		if (!enable)
+			tok++;
+
+		if (!strcmp(tok, "none")) {
+			enable = !enable;
+			tok = "all";
+		}
+
+		len = strlen(tok);
+		prefix = len > 0 && tok[len - 1] == '*';
+		if (prefix)
+			len--;
+
+		found = false;
+		for (id = 1; id < NGNFS_TRACE_EVENT_NR; id++) {
+			name = trace_event_desc(id)->name;
+			if (strcmp(tok, "all") &&
+			    (prefix ? strncmp(name, tok, len) : strcmp(name, tok)))
+				continue;
+
+			found = true;
+			if (enable)
+				bits[id / BITS_PER_LONG] |= 1UL << (id % BITS_PER_LONG);
+			else
+				bits[id / BITS_PER_LONG] &= ~(1UL << (id % BITS_PER_LONG));
+		}
+
+		if (!found) {
+			log("unknown trace event '%s'", tok);
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bits); i++) {
+		WRITE_ONCE(trace_event_bits[i], bits[i]);
+		nr += hweight_long(bits[i]);
+	}
+
+	log("%d of %d trace events enabled", nr, NGNFS_TRACE_EVENT_NR - 1);
+	return 0;
+}
+
+/*
+ * Read the events to enable from the control file.  All events are
+ * enabled if it doesn't exist.
+ */
+int trace_reload_events(void)
+{
+	struct trace_info *trinf = global_trinf;
+	char *spec = NULL;
+	ssize_t sret;
+	int fd = -1;
+	int ret;
+
+	if (!trinf || !trinf->events_path)
+		return 0;
+
+	spec = malloc(EVENTS_SPEC_SIZE);
+	if (!spec) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	fd = open(trinf->events_path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		if (ret != -ENOENT) {
+			log("error opening trace events file '%s': "ENOF,
+			    trinf->events_path, ENOA(-ret));
+			goto out;
+		}
+		strcpy(spec, "all");
+	} else {
+		sret = read(fd, spec, EVENTS_SPEC_SIZE - 1);
+		if (sret < 0) {
+			ret = -errno;
+			log("error reading trace events file '%s': "ENOF,
+			    trinf->events_path, ENOA(-ret));
+			goto out;
+		}
+		spec[sret] = '\0';
+	}
+
+	ret = trace_set_events(spec);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(spec);
+
+	return ret;
+}
+
 /*
  * Fully tear down tracing.  This is called after all other trace users
  * have stopped.
@@ -426,18 +783,29 @@ out:
 void trace_destroy(void)
 {
 	struct trace_info *trinf = global_trinf;
+	struct trace_buf *tbuf;
 
 	if (trinf) {
+		memset(trace_event_bits, 0, sizeof(trace_event_bits));
+
 		/* wait for writer to finish with queued bufs */
 		wait_event(&trinf->waitq, cds_wfcq_empty(&trinf->write_head, &trinf->write_tail));
 
-		/* then shut it down */
+		/* then shut it down, it writes out remaining storing bufs */
 		thread_stop_indicate(&trinf->write_thr);
 		wake_up(&trinf->waitq);
 		thread_stop_wait(&trinf->write_thr);
 
+		while ((tbuf = list_first_entry_or_null(&trinf->free_bufs, struct trace_buf, head))) {
+			list_del(&tbuf->head);
+			free(tbuf);
+		}
+
+		if (trinf->ring)
+			munmap(trinf->ring, NGNFS_TRACE_RING_HEADER_SIZE + trinf->ring_size);
 		if (trinf->fd >= 0)
 			close(trinf->fd);
+		free(trinf->events_path);
 
 		/*
 		 * XXX I wonder if we're supposed to clean up any
@@ -3,9 +3,19 @@
 #define NGNFS_SHARED_TRACE_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <netinet/in.h>
 
+#include "shared/lk/bits.h"
+#include "shared/lk/compiler.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/rwonce.h"
 #include "shared/lk/types.h"
 
+#include "shared/format-trace.h"
+#include "shared/log.h"
 #include "shared/urcu.h"
 
 /*
@@ -16,19 +26,95 @@ do {				\
 	rcu_read_lock();	\
 } while (0)
 
-#define trace_store_end()	\
-do {				\
-	rcu_read_unlock();	\
+#define trace_store_end(ptr)			\
+do {						\
+	if (ptr)				\
+		trace_store_commit(ptr);	\
+	rcu_read_unlock();			\
 } while (0)
 
+/*
+ * Integer fields are stored in the event struct, as are fixed size byte
+ * arrays and sockaddr_in addresses.  Variable length byte arrays and
+ * strings store their u16 length in the struct and their bytes after
+ * the struct, in the order of the fields.
+ */
+enum {
+	TRACE_FIELD_INT = 0,
+	TRACE_FIELD_HEX,
+	TRACE_FIELD_IPV4,
+	TRACE_FIELD_VAR_HEX,
+	TRACE_FIELD_VAR_STR,
+};
+
+/* bounds the bytes stored by each variable length field */
+#define TRACE_VAR_MAX	512
+
+/*
+ * Generated descriptions of each event's stored fields.  The off and
+ * size of variable length fields describe their length.
+ */
+struct ngnfs_trace_field_desc {
+	char *label;
+	char *fmt;
+	u16 off;
+	u16 size;
+	u8 type;
+	bool is_signed;
+};
+
+struct ngnfs_trace_event_desc {
+	char *name;
+	u16 size;
+	u16 nr_fields;
+	const struct ngnfs_trace_field_desc *fields;
+};
+
+/*
+ * These are used by the generated print_trace_event().  Variable
+ * length fields are clamped to the stored event in case the event is
+ * from a different build.
+ */
+static inline u16 trace_var_len(void *var, u16 len, void *end)
+{
+	return var + len <= end ? len : var < end ? end - var : 0;
+}
+
+static inline void trace_print_hex(void *ptr, unsigned int len)
+{
+	u8 *bytes = ptr;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		printf("%02x", bytes[i]);
+}
+
+/*
+ * Events are only stored if their bit is set.  A disabled event costs
+ * the load of a read-mostly word and a well predicted branch.
+ */
+extern unsigned long trace_event_bits[];
+
+static inline bool trace_event_enabled(u16 id)
+{
+	return unlikely(READ_ONCE(trace_event_bits[id / BITS_PER_LONG]) &
+			(1UL << (id % BITS_PER_LONG)));
+}
+
+/* bounds the trace_ring_mb option */
+#define TRACE_RING_MAX_MB	(64 * 1024)
+
 void *trace_store_ptr(u16 id, size_t len);
+void trace_store_commit(void *ptr);
 void trace_flush(void);
 
 int trace_register_thread(void);
 void trace_unregister_thread(void);
 
 int trace_init(void);
-int trace_setup(char *trace_path);
+int trace_setup(char *trace_path, u64 ring_size);
+int trace_set_events(char *spec);
+int trace_reload_events(void);
 void trace_destroy(void);
 
 #include "generated-trace-inlines.h"
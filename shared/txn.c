@@ -3,8 +3,11 @@
 #include "shared/lk/err.h"
 #include "shared/lk/errno.h"
 #include "shared/lk/list.h"
+#include "shared/lk/timekeeping.h"
 
 #include "shared/block.h"
+#include "shared/stats.h"
+#include "shared/trace.h"
 #include "shared/txn.h"
 
 /*
@@ -84,8 +87,16 @@ int ngnfs_txn_execute(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
 {
 	struct ngnfs_transaction_block *tblk;
 	struct ngnfs_block *bl;
+	u64 first_bnr;
+	u64 start_ns;
 	int ret = 0;
 
+	/* traces are keyed by the first block */
+	tblk = list_first_entry_or_null(&txn->blocks, struct ngnfs_transaction_block, head);
+	first_bnr = tblk ? tblk->bnr : 0;
+	trace_ngnfs_txn_execute_begin(first_bnr);
+	start_ns = ktime_get_ns();
+
 	list_for_each_entry(tblk, &txn->blocks, head) {
 		bl = ngnfs_block_get(nfi, tblk->bnr, tblk->nbf);
 		if (IS_ERR(bl)) {
@@ -119,6 +130,9 @@ int ngnfs_txn_execute(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
 	}
 
 out:
+	stats_hist_add(STAT_HIST_TXN_EXECUTE_NS, ktime_get_ns() - start_ns);
+	stats_inc(ret < 0 ? STAT_TXN_ERRORS : STAT_TXN_EXECUTED);
+	trace_ngnfs_txn_execute_end(first_bnr, ret);
 	return ret;
 }
 